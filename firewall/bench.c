@@ -0,0 +1,1060 @@
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lib.h"
+#include "net.h"
+#include "traffic.h"
+
+/**
+ * Micro benchmarks for the firewall packet path.
+ *
+ * Usage: ./bench <benchmark> [args...], run without arguments for a list.
+ * Build with `make bench`, use `make bench IMPL=solution.c` to benchmark the
+ * reference solution.
+ */
+
+#define MAX_PACKET_SIZE 2048
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// xorshift64*, deterministic across runs
+static uint64_t rng_state = 0x2545f4914f6cdd1dULL;
+
+static uint64_t rng_next(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static void rng_fill(uint8_t *buf, size_t len) {
+  for (size_t i = 0; i < len; ++i) buf[i] = (uint8_t)rng_next();
+}
+
+typedef struct {
+  uint8_t *data;  // num_packets slots of MAX_PACKET_SIZE bytes
+  size_t *lens;
+  size_t num_packets;
+} packet_set_t;
+
+static packet_set_t packet_set_create(size_t num_packets) {
+  packet_set_t set = {
+      .data = malloc(num_packets * MAX_PACKET_SIZE),
+      .lens = calloc(num_packets, sizeof(size_t)),
+      .num_packets = num_packets,
+  };
+  if (!set.data || !set.lens) {
+    fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  return set;
+}
+
+static void packet_set_free(packet_set_t *set) {
+  free(set->data);
+  free(set->lens);
+}
+
+static inline uint8_t *packet_at(const packet_set_t *set, size_t i) {
+  return set->data + i * MAX_PACKET_SIZE;
+}
+
+// Replays `set` through `fw` for `rounds` rounds, prints and returns ns/packet
+static double run_packets(const char *label, firewall_t *fw,
+                          const packet_set_t *set, size_t rounds) {
+  size_t drops = 0;
+  uint64_t bytes = 0;
+  uint64_t start = now_ns();
+  for (size_t r = 0; r < rounds; ++r) {
+    for (size_t i = 0; i < set->num_packets; ++i) {
+      drops += firewall_check(fw, packet_at(set, i), set->lens[i]);
+      bytes += set->lens[i];
+    }
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  double packets = (double)rounds * (double)set->num_packets;
+  double ns_per_packet = (double)elapsed / packets;
+  printf("%-28s %8.3f Mpps %8.3f Gbit/s %9.1f ns/pkt  (%zu drops)\n", label,
+         packets / (double)elapsed * 1e3, (double)bytes * 8 / (double)elapsed,
+         ns_per_packet, drops);
+  return ns_per_packet;
+}
+
+// ==========================================
+//          CONTENT RULE SCALING
+// ==========================================
+
+static void bench_content(void) {
+  static const size_t pattern_counts[] = {10, 1000, 100000};
+  const size_t num_packets = 4096;
+  const size_t rounds = 64;
+
+  printf("content rules: %zu packets x %zu rounds, 1/16 matching\n",
+         num_packets, rounds);
+
+  // Patterns and payloads of 4 to 1203 bytes, then the common case of
+  // 4 to 16 byte patterns and MTU sized payloads
+  const size_t num_counts = sizeof(pattern_counts) / sizeof(*pattern_counts);
+  for (size_t run = 0; run < 2 * num_counts; ++run) {
+    size_t num_patterns = pattern_counts[run % num_counts];
+    bool short_patterns = run >= num_counts;
+    firewall_t *fw = firewall_create();
+
+    uint8_t **patterns = malloc(num_patterns * sizeof(uint8_t *));
+    size_t *pattern_lens = malloc(num_patterns * sizeof(size_t));
+    for (size_t i = 0; i < num_patterns; ++i) {
+      pattern_lens[i] = 4 + rng_next() % (short_patterns ? 13 : 1200);
+      patterns[i] = malloc(pattern_lens[i]);
+      rng_fill(patterns[i], pattern_lens[i]);
+      firewall_add_content_rule(fw, (const char *)patterns[i],
+                                pattern_lens[i]);
+    }
+
+    packet_set_t set = packet_set_create(num_packets);
+    uint8_t payload[1400];
+    for (size_t i = 0; i < num_packets; ++i) {
+      const uint8_t *data = payload;
+      size_t len;
+      if (i % 16 == 0) {
+        size_t p = rng_next() % num_patterns;
+        data = patterns[p];
+        len = pattern_lens[p];
+      } else {
+        len = short_patterns ? sizeof(payload) : 4 + rng_next() % 1200;
+        rng_fill(payload, len);
+      }
+      set.lens[i] = traffic_write_frame(
+          packet_at(&set, i), PROTOCOL_UDP, 0x0a000001 + (ipaddr_t)i,
+          0x0a000002, 1000, 53, data, len);
+    }
+
+    char label[64];
+    snprintf(label, sizeof(label), "%zu patterns%s", num_patterns,
+             short_patterns ? ", short" : "");
+    run_packets(label, fw, &set, rounds);
+
+    packet_set_free(&set);
+    for (size_t i = 0; i < num_patterns; ++i) free(patterns[i]);
+    free(patterns);
+    free(pattern_lens);
+    firewall_destroy(fw);
+  }
+}
+
+static void bench_streams(void) {
+  static const size_t pattern_counts[] = {10, 100, 1000};
+  const size_t num_packets = 4096;
+  const size_t rounds = 64;
+
+  printf("stream rules: %zu packets x %zu rounds, 1400 byte TCP segments in "
+         "64 flows\n",
+         num_packets, rounds);
+
+  for (size_t c = 0; c < sizeof(pattern_counts) / sizeof(*pattern_counts);
+       ++c) {
+    size_t num_patterns = pattern_counts[c];
+    firewall_t *fw = firewall_create();
+    uint8_t pattern[16];
+    for (size_t i = 0; i < num_patterns; ++i) {
+      size_t len = 4 + rng_next() % 13;
+      rng_fill(pattern, len);
+      firewall_add_stream_rule(fw, (const char *)pattern, len);
+    }
+
+    // Random bytes, a 4 byte pattern shows up about once per 4GB
+    packet_set_t set = packet_set_create(num_packets);
+    uint8_t payload[1400];
+    for (size_t i = 0; i < num_packets; ++i) {
+      rng_fill(payload, sizeof(payload));
+      set.lens[i] = traffic_write_frame(
+          packet_at(&set, i), PROTOCOL_TCP, 0x0a000001 + (ipaddr_t)(i % 64),
+          0x0a000002, 40000, 443, payload, sizeof(payload));
+    }
+
+    char label[64];
+    snprintf(label, sizeof(label), "%zu patterns", num_patterns);
+    run_packets(label, fw, &set, rounds);
+
+    packet_set_free(&set);
+    firewall_destroy(fw);
+  }
+}
+
+// ==========================================
+//          PREFIX RULE SCALING
+// ==========================================
+
+static void bench_prefixes(void) {
+  static const size_t rule_counts[] = {100, 10000, 100000};
+  const size_t num_packets = 4096;
+  const size_t rounds = 256;
+
+  printf("prefix rules (/8 to /32): %zu packets x %zu rounds\n", num_packets,
+         rounds);
+
+  for (size_t c = 0; c < sizeof(rule_counts) / sizeof(*rule_counts); ++c) {
+    size_t num_rules = rule_counts[c];
+    firewall_t *fw = firewall_create();
+    for (size_t i = 0; i < num_rules; ++i) {
+      uint64_t r = rng_next();
+      firewall_add_blacklist_prefix_rule(
+          fw, PROTOCOL_TCP, (ipaddr_t)r, (uint8_t)(8 + r % 25),
+          (ipaddr_t)(r >> 32), (uint8_t)(8 + (r >> 8) % 25), 80, 80);
+    }
+
+    packet_set_t set = packet_set_create(num_packets);
+    for (size_t i = 0; i < num_packets; ++i) {
+      uint64_t r = rng_next();
+      set.lens[i] = traffic_write_frame(
+          packet_at(&set, i), PROTOCOL_TCP, (ipaddr_t)r, (ipaddr_t)(r >> 32),
+          1000, 80, (const uint8_t *)"", 0);
+    }
+
+    char label[64];
+    snprintf(label, sizeof(label), "%zu prefixes", num_rules);
+    run_packets(label, fw, &set, rounds);
+    // 4k flows, every packet after the first round hits the verdict cache
+    firewall_configure_verdict_cache(fw, 2 * num_packets);
+    snprintf(label, sizeof(label), "%zu prefixes, cached", num_rules);
+    run_packets(label, fw, &set, rounds);
+
+    packet_set_free(&set);
+    firewall_destroy(fw);
+  }
+}
+
+// ==========================================
+//        BATCHED VS PER-PACKET CHECKS
+// ==========================================
+
+// A rule set touching every stage: MAC, blacklist, content and rate limiting
+static firewall_t *create_mixed_firewall(size_t num_rules) {
+  firewall_t *fw = firewall_create();
+  for (size_t i = 0; i < num_rules; ++i) {
+    uint8_t mac[ETH_ALEN];
+    rng_fill(mac, sizeof(mac));
+    if (i % 16 == 0) firewall_add_mac_rule(fw, mac, ACTION_DROP);
+
+    ipaddr_t src = (ipaddr_t)rng_next();
+    ipaddr_t dest = i % 4 == 0 ? 0 : (ipaddr_t)rng_next();
+    port_t start = (port_t)rng_next();
+    firewall_add_blacklist_rule(fw, PROTOCOL_TCP, src, dest, start,
+                                (port_t)(start + rng_next() % 16));
+
+    uint8_t pattern[64];
+    size_t len = 8 + rng_next() % 56;
+    rng_fill(pattern, len);
+    if (i % 4 == 0) firewall_add_content_rule(fw, (const char *)pattern, len);
+  }
+  firewall_configure_ratelimit(fw, 100000000, 1000000);
+  return fw;
+}
+
+// `num_flows` TCP flows with 64 to 1024 bytes of payload
+static packet_set_t create_flow_packets(size_t num_packets, size_t num_flows) {
+  packet_set_t set = packet_set_create(num_packets);
+  uint8_t payload[1024];
+  rng_fill(payload, sizeof(payload));
+  for (size_t i = 0; i < num_packets; ++i) {
+    size_t flow = rng_next() % num_flows;
+    set.lens[i] = traffic_write_frame(
+        packet_at(&set, i), PROTOCOL_TCP, 0x0a000000 + (ipaddr_t)(flow >> 8),
+        0xc0a80001, (port_t)(1024 + (flow & 0xff)), 443, payload,
+        64 + rng_next() % 960);
+  }
+  return set;
+}
+
+static void bench_batch(void) {
+  static const size_t burst_sizes[] = {1, 8, 32, 64, 128, 256};
+  const size_t num_packets = 1 << 16;
+  const size_t rounds = 32;
+
+  firewall_t *fw = create_mixed_firewall(10000);
+  packet_set_t set = create_flow_packets(num_packets, 1 << 16);
+
+  void **pkts = malloc(num_packets * sizeof(void *));
+  action_t *out = malloc(num_packets * sizeof(action_t));
+  for (size_t i = 0; i < num_packets; ++i) pkts[i] = packet_at(&set, i);
+
+  printf("10k rules, 64k flows: %zu packets x %zu rounds\n", num_packets,
+         rounds);
+  run_packets("firewall_check", fw, &set, rounds);
+
+  for (size_t b = 0; b < sizeof(burst_sizes) / sizeof(*burst_sizes); ++b) {
+    size_t burst = burst_sizes[b];
+    uint64_t start = now_ns();
+    for (size_t r = 0; r < rounds; ++r) {
+      for (size_t i = 0; i < num_packets; i += burst) {
+        size_t n = num_packets - i < burst ? num_packets - i : burst;
+        firewall_check_batch(fw, pkts + i, set.lens + i, out + i, n);
+      }
+    }
+    uint64_t elapsed = now_ns() - start;
+    double packets = (double)rounds * (double)num_packets;
+    printf("firewall_check_batch(%3zu)    %8.3f Mpps %9.1f ns/pkt\n", burst,
+           packets / (double)elapsed * 1e3, (double)elapsed / packets);
+  }
+
+  free(pkts);
+  free(out);
+  packet_set_free(&set);
+  firewall_destroy(fw);
+}
+
+// ==========================================
+//          RATE LIMIT FLOW SCALING
+// ==========================================
+
+static void bench_flows(void) {
+  static const size_t flow_counts[] = {1000, 100000, 1000000, 4000000};
+  const size_t num_packets = 1 << 16;
+  const size_t rounds = 64;
+
+  printf("rate limiting only: %zu packets x %zu rounds, 64 byte payloads\n",
+         num_packets, rounds);
+
+  packet_set_t set = packet_set_create(num_packets);
+  uint8_t payload[64];
+  rng_fill(payload, sizeof(payload));
+
+  for (size_t c = 0; c < sizeof(flow_counts) / sizeof(*flow_counts); ++c) {
+    size_t num_flows = flow_counts[c];
+    firewall_t *fw = firewall_create();
+    firewall_configure_ratelimit(fw, 1000000, 10000000);
+
+    // Touch every flow once so that the table holds num_flows entries
+    for (size_t f = 0; f < num_flows; f += num_packets) {
+      for (size_t i = 0; i < num_packets; ++i) {
+        size_t flow = (f + i) % num_flows;
+        set.lens[i] = traffic_write_frame(
+            packet_at(&set, i), PROTOCOL_UDP, 0x0a000000 + (ipaddr_t)flow,
+            0xc0a80001, 4000, 53, payload, sizeof(payload));
+      }
+      for (size_t i = 0; i < num_packets; ++i)
+        firewall_check(fw, packet_at(&set, i), set.lens[i]);
+    }
+
+    for (size_t i = 0; i < num_packets; ++i) {
+      size_t flow = rng_next() % num_flows;
+      set.lens[i] = traffic_write_frame(
+          packet_at(&set, i), PROTOCOL_UDP, 0x0a000000 + (ipaddr_t)flow,
+          0xc0a80001, 4000, 53, payload, sizeof(payload));
+    }
+
+    char label[64];
+    snprintf(label, sizeof(label), "%zu flows", num_flows);
+    run_packets(label, fw, &set, rounds);
+
+    // Same packets with the clock read once per 32, like a NIC poll loop
+    uint64_t start = now_ns();
+    for (size_t r = 0; r < rounds; ++r) {
+      uint64_t now_us = 0;
+      for (size_t i = 0; i < num_packets; ++i) {
+        if (i % 32 == 0) now_us = timestamp_us();
+        firewall_check_at(fw, packet_at(&set, i), set.lens[i], now_us);
+      }
+    }
+    uint64_t elapsed = now_ns() - start;
+    double packets = (double)rounds * (double)num_packets;
+    snprintf(label, sizeof(label), "%zu flows, cached clock", num_flows);
+    printf("%-28s %8.3f Mpps %15s %9.1f ns/pkt\n", label,
+           packets / (double)elapsed * 1e3, "", (double)elapsed / packets);
+    firewall_destroy(fw);
+  }
+
+  // Flood: every packet opens a flow that the bounded table has evicted
+  // since its last round, so each one pays for an eviction
+  firewall_t *fw = firewall_create();
+  firewall_configure_ratelimit(fw, 1000000, 10000000);
+  firewall_configure_flow_limit(fw, 16384, 0);
+  for (size_t i = 0; i < num_packets; ++i) {
+    set.lens[i] = traffic_write_frame(
+        packet_at(&set, i), PROTOCOL_UDP, 0x0a000000 + (ipaddr_t)i,
+        0xc0a80001, 4000, 53, payload, sizeof(payload));
+  }
+  run_packets("flood, 16k flow limit", fw, &set, rounds);
+  firewall_flow_stats_t stats;
+  firewall_flow_stats(fw, &stats);
+  printf("%" PRIu64 " flows, %" PRIu64 " evictions\n", stats.flows,
+         stats.evictions);
+  firewall_destroy(fw);
+
+  // Hierarchical limits: 1M flows of 10k sources, 100 ports each, every
+  // packet checks its flow's and its source's bucket
+  fw = firewall_create();
+  firewall_configure_ratelimit(fw, 1000000, 10000000);
+  firewall_configure_source_ratelimit(fw, 100000000, 0);
+  for (size_t i = 0; i < num_packets; ++i) {
+    size_t flow = rng_next() % 1000000;
+    set.lens[i] = traffic_write_frame(
+        packet_at(&set, i), PROTOCOL_UDP, 0x0a000000 + (ipaddr_t)(flow / 100),
+        0xc0a80001, (port_t)(4000 + flow % 100), 53, payload,
+        sizeof(payload));
+  }
+  for (size_t r = 0; r < 16; ++r)
+    for (size_t i = 0; i < num_packets; ++i)
+      firewall_check(fw, packet_at(&set, i), set.lens[i]);
+  run_packets("1M flows, 10k sources", fw, &set, rounds);
+  firewall_destroy(fw);
+  packet_set_free(&set);
+}
+
+// ==========================================
+//          ZIPFIAN TRAFFIC SCALING
+// ==========================================
+
+static void bench_traffic(size_t num_flows) {
+  static const double skews[] = {0, 0.6, 0.9, 1.1, 1.3};
+  const size_t num_packets = 1 << 18;
+  const size_t rounds = 8;
+  enum { NUM_PATTERNS = 64 };
+
+  // Content rules for 1% of the packets
+  uint8_t pattern_data[NUM_PATTERNS][64];
+  const uint8_t *patterns[NUM_PATTERNS];
+  size_t pattern_lens[NUM_PATTERNS];
+  for (size_t i = 0; i < NUM_PATTERNS; ++i) {
+    pattern_lens[i] = 16 + rng_next() % 48;
+    rng_fill(pattern_data[i], pattern_lens[i]);
+    patterns[i] = pattern_data[i];
+  }
+
+  printf("%zu flows, IMIX payloads, 1%% content matches: %zu packets x %zu "
+         "rounds\n",
+         num_flows, num_packets, rounds);
+
+  packet_set_t set = packet_set_create(num_packets);
+  for (size_t s = 0; s < sizeof(skews) / sizeof(*skews); ++s) {
+    traffic_config_t config = {
+        .num_flows = num_flows,
+        .zipf_skew = skews[s],
+        .udp_share = 0.2,
+        .sizes = traffic_imix,
+        .num_sizes = TRAFFIC_IMIX_SIZES,
+        .patterns = patterns,
+        .pattern_lens = pattern_lens,
+        .num_patterns = NUM_PATTERNS,
+        .pattern_rate = 0.01,
+        .seed = s,
+    };
+    traffic_gen_t *gen = traffic_gen_create(&config);
+    if (!gen) {
+      fprintf(stderr, "traffic_gen_create failed\n");
+      break;
+    }
+    // Share of the packets that belong to the most popular 1% of flows
+    size_t top = 0;
+    for (size_t i = 0; i < num_packets; ++i) {
+      size_t flow;
+      set.lens[i] = traffic_gen_next(gen, packet_at(&set, i), &flow);
+      top += flow < num_flows / 100;
+    }
+    traffic_gen_destroy(gen);
+    printf("skew %.1f: top 1%% of flows carry %.1f%% of packets\n", skews[s],
+           100.0 * (double)top / (double)num_packets);
+
+    firewall_t *fw = firewall_create();
+    firewall_configure_ratelimit(fw, 1000000000, 1000000000);
+    run_packets("  rate limiting only", fw, &set, rounds);
+    firewall_flow_stats_t stats;
+    firewall_flow_stats(fw, &stats);
+    firewall_destroy(fw);
+
+    fw = create_mixed_firewall(10000);
+    for (size_t i = 0; i < NUM_PATTERNS; ++i)
+      firewall_add_content_rule(fw, (const char *)patterns[i],
+                                pattern_lens[i]);
+    run_packets("  10k rules", fw, &set, rounds);
+    firewall_destroy(fw);
+    printf("  %" PRIu64 " flows seen\n", stats.flows);
+  }
+  packet_set_free(&set);
+}
+
+// ==========================================
+//        SHARDED MULTI-THREADED SCALING
+// ==========================================
+
+typedef struct {
+  firewall_t *fw;
+  size_t shard;
+  uint8_t **packets;  // the packets steered to this shard
+  size_t *lens;
+  size_t num_packets;
+  size_t rounds;
+  pthread_barrier_t *start;
+} worker_t;
+
+static void *worker_main(void *arg) {
+  worker_t *w = arg;
+  pthread_barrier_wait(w->start);
+  for (size_t r = 0; r < w->rounds; ++r) {
+    for (size_t i = 0; i < w->num_packets; ++i)
+      firewall_check_shard(w->fw, w->shard, w->packets[i], w->lens[i]);
+  }
+  return NULL;
+}
+
+/**
+ * Driver: steers every packet to the worker owning its shard (what RSS does
+ * in the NIC), then lets the workers replay their queues in parallel.
+ */
+static void bench_threads(size_t max_threads) {
+  const size_t num_packets = 1 << 16;
+  const size_t rounds = 16;
+
+  firewall_t *fw = create_mixed_firewall(1000);
+  packet_set_t set = create_flow_packets(num_packets, 1 << 16);
+
+  uint8_t **queues = malloc(num_packets * sizeof(uint8_t *));
+  size_t *queue_lens = malloc(num_packets * sizeof(size_t));
+  worker_t *workers = calloc(max_threads, sizeof(worker_t));
+  pthread_t *threads = calloc(max_threads, sizeof(pthread_t));
+
+  printf("1k rules, 64k flows: %zu packets x %zu rounds\n", num_packets,
+         rounds);
+  double base_mpps = 0;
+  for (size_t num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+    firewall_configure_shards(fw, num_threads);
+
+    // Counting sort of the packets by shard
+    size_t *counts = calloc(num_threads + 1, sizeof(size_t));
+    for (size_t i = 0; i < num_packets; ++i)
+      ++counts[firewall_flow_shard(fw, packet_at(&set, i), set.lens[i]) + 1];
+    for (size_t t = 0; t < num_threads; ++t) counts[t + 1] += counts[t];
+    for (size_t t = 0; t < num_threads; ++t) {
+      workers[t] = (worker_t){.fw = fw,
+                              .shard = t,
+                              .packets = queues + counts[t],
+                              .lens = queue_lens + counts[t],
+                              .rounds = rounds};
+    }
+    for (size_t i = 0; i < num_packets; ++i) {
+      worker_t *w =
+          &workers[firewall_flow_shard(fw, packet_at(&set, i), set.lens[i])];
+      w->packets[w->num_packets] = packet_at(&set, i);
+      w->lens[w->num_packets++] = set.lens[i];
+    }
+    free(counts);
+
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, (unsigned)num_threads + 1);
+    for (size_t t = 0; t < num_threads; ++t) {
+      workers[t].start = &start;
+      pthread_create(&threads[t], NULL, worker_main, &workers[t]);
+    }
+    pthread_barrier_wait(&start);
+    uint64_t begin = now_ns();
+    for (size_t t = 0; t < num_threads; ++t) pthread_join(threads[t], NULL);
+    uint64_t elapsed = now_ns() - begin;
+    pthread_barrier_destroy(&start);
+
+    double mpps = (double)(num_packets * rounds) / (double)elapsed * 1e3;
+    if (num_threads == 1) base_mpps = mpps;
+    printf("%2zu threads                   %8.3f Mpps  (%.2fx)\n", num_threads,
+           mpps, mpps / base_mpps);
+  }
+
+  free(threads);
+  free(workers);
+  free(queues);
+  free(queue_lens);
+  packet_set_free(&set);
+  firewall_destroy(fw);
+}
+
+// ==========================================
+//             PIPELINED MODE
+// ==========================================
+
+// The same packets through firewall_check on one thread and through the
+// three stage pipeline, fed and drained by this thread
+static void bench_pipeline(void) {
+  const size_t num_packets = 1 << 16;
+  const size_t rounds = 32;
+  const size_t burst = 64;
+
+  packet_set_t set = create_flow_packets(num_packets, 1 << 16);
+  printf("10k rules, 64k flows: %zu packets x %zu rounds\n", num_packets,
+         rounds);
+
+  firewall_t *fw = create_mixed_firewall(10000);
+  run_packets("run to completion", fw, &set, rounds);
+  firewall_destroy(fw);
+
+  fw = create_mixed_firewall(10000);
+  firewall_pipeline_t *pipeline = firewall_pipeline_create(fw, 1024);
+  if (!pipeline) {
+    fprintf(stderr, "firewall_pipeline_create failed\n");
+    packet_set_free(&set);
+    firewall_destroy(fw);
+    return;
+  }
+  void **pkts = malloc(num_packets * sizeof(void *));
+  firewall_verdict_t *out = malloc(burst * sizeof(firewall_verdict_t));
+  for (size_t i = 0; i < num_packets; ++i) pkts[i] = packet_at(&set, i);
+
+  size_t drops = 0;
+  uint64_t bytes = 0;
+  uint64_t start = now_ns();
+  for (size_t r = 0; r < rounds; ++r) {
+    size_t submitted = 0, polled = 0;
+    while (polled < num_packets) {
+      size_t n = num_packets - submitted < burst ? num_packets - submitted
+                                                 : burst;
+      submitted += firewall_pipeline_submit(pipeline, pkts + submitted,
+                                            set.lens + submitted, n);
+      size_t got = firewall_pipeline_poll(pipeline, out, burst);
+      for (size_t k = 0; k < got; ++k) drops += out[k].verdict;
+      polled += got;
+    }
+    for (size_t i = 0; i < num_packets; ++i) bytes += set.lens[i];
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  double packets = (double)rounds * (double)num_packets;
+  printf("%-28s %8.3f Mpps %8.3f Gbit/s %9.1f ns/pkt  (%zu drops)\n",
+         "pipeline, 3 stages", packets / (double)elapsed * 1e3,
+         (double)bytes * 8 / (double)elapsed, (double)elapsed / packets,
+         drops);
+
+  free(pkts);
+  free(out);
+  firewall_pipeline_destroy(pipeline);
+  packet_set_free(&set);
+  firewall_destroy(fw);
+}
+
+// ==========================================
+//         STARTUP FROM COMPILED RULES
+// ==========================================
+
+static double elapsed_ms(uint64_t start) {
+  return (double)(now_ns() - start) / 1e6;
+}
+
+// Adding and compiling `num_rules` rules against loading them from a
+// compiled rule file
+static void bench_startup(size_t num_rules) {
+  const size_t num_packets = 1 << 16;
+  char path[] = "/tmp/firewall-bench-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return;
+  }
+  close(fd);
+
+  printf("%zu rules: 80%% blacklist (half exact, half /16 to /31), 15%% "
+         "content, 5%% MAC\n",
+         num_rules);
+  uint64_t start = now_ns();
+  firewall_t *fw = firewall_create();
+  for (size_t i = 0; i < num_rules; ++i) {
+    uint64_t r = rng_next();
+    if (i % 20 < 16) {
+      bool exact = i % 2 == 0;
+      firewall_add_blacklist_prefix_rule(
+          fw, PROTOCOL_TCP, (ipaddr_t)r, exact ? 32 : (uint8_t)(16 + r % 16),
+          (ipaddr_t)(r >> 32), exact ? 32 : 0, 80, 443);
+    } else if (i % 20 < 19) {
+      uint8_t pattern[32];
+      size_t len = 8 + r % 24;
+      rng_fill(pattern, len);
+      firewall_add_content_rule(fw, (const char *)pattern, len);
+    } else {
+      uint8_t mac[ETH_ALEN];
+      rng_fill(mac, sizeof(mac));
+      firewall_add_mac_rule(fw, mac, ACTION_DROP);
+    }
+  }
+  firewall_commit(fw);
+  printf("%-28s %10.1f ms\n", "add and compile", elapsed_ms(start));
+
+  start = now_ns();
+  if (!firewall_save_rules(fw, path)) {
+    fprintf(stderr, "firewall_save_rules failed\n");
+    firewall_destroy(fw);
+    unlink(path);
+    return;
+  }
+  struct stat st;
+  stat(path, &st);
+  printf("%-28s %10.1f ms  (%.1f MB)\n", "save", elapsed_ms(start),
+         (double)st.st_size / 1e6);
+
+  start = now_ns();
+  firewall_t *loaded = firewall_create();
+  bool ok = firewall_load_rules(loaded, path);
+  printf("%-28s %10.1f ms\n", "load", elapsed_ms(start));
+  if (ok) {
+    // The first packets fault in the pages of the tables they touch
+    packet_set_t set = create_flow_packets(num_packets, 1 << 16);
+    run_packets("first packets, loaded", loaded, &set, 1);
+    run_packets("then, loaded", loaded, &set, 8);
+    run_packets("compiled", fw, &set, 8);
+    packet_set_free(&set);
+  } else {
+    fprintf(stderr, "firewall_load_rules failed\n");
+  }
+  firewall_destroy(loaded);
+  firewall_destroy(fw);
+  unlink(path);
+}
+
+// ==========================================
+//              RULE FILES
+// ==========================================
+
+/**
+ * Loads rules from a text file, one rule per line, '#' starts a comment:
+ *
+ *   mac <aa:bb:cc:dd:ee:ff> <drop|pass>
+ *   blacklist <tcp|udp|other> <srcip[/len]|*> <destip[/len]|*> <port>[-<port>]
+ *   content <hex bytes, e.g. 7669727573>
+ *   stream <hex bytes, matched across TCP segments>
+ *   ratelimit <rate_bps> <timeout_us> [burst_bytes]
+ *   source_ratelimit <rate_bps> [burst_bytes]
+ *
+ * Returns false (after printing the offending line) on a syntax error.
+ */
+// Parses "*", "a.b.c.d" or "a.b.c.d/len", a plain 0.0.0.0 is a wildcard
+static bool parse_prefix(const char *str, ipaddr_t *addr, uint8_t *len) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%s", str);
+  *addr = 0;
+  *len = 0;
+  if (strcmp(buf, "*") == 0) return true;
+
+  char *slash = strchr(buf, '/');
+  unsigned prefix_len = 32;
+  if (slash) {
+    *slash = '\0';
+    char *end;
+    prefix_len = (unsigned)strtoul(slash + 1, &end, 10);
+    if (end == slash + 1 || *end != '\0' || prefix_len > 32) return false;
+  }
+  struct in_addr in;
+  if (inet_pton(AF_INET, buf, &in) != 1) return false;
+  *addr = ntohl(in.s_addr);
+  *len = slash || *addr ? (uint8_t)prefix_len : 0;
+  return true;
+}
+
+static bool load_rules(firewall_t *fw, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    perror(path);
+    return false;
+  }
+
+  char line[4096];
+  size_t lineno = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), file)) {
+    ++lineno;
+    char *comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+
+    char kind[32], a[64], b[64], c[64], d[64];
+    int fields = sscanf(line, "%31s %63s %63s %63s %63s", kind, a, b, c, d);
+    if (fields <= 0) continue;
+
+    if (strcmp(kind, "mac") == 0 && fields == 3) {
+      uint8_t mac[ETH_ALEN];
+      ok = sscanf(a, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0], &mac[1],
+                  &mac[2], &mac[3], &mac[4], &mac[5]) == ETH_ALEN &&
+           (strcmp(b, "drop") == 0 || strcmp(b, "pass") == 0);
+      if (ok)
+        firewall_add_mac_rule(fw, mac,
+                              b[0] == 'd' ? ACTION_DROP : ACTION_PASS);
+    } else if (strcmp(kind, "blacklist") == 0 && fields == 5) {
+      protocol_t proto = strcmp(a, "tcp") == 0   ? PROTOCOL_TCP
+                         : strcmp(a, "udp") == 0 ? PROTOCOL_UDP
+                                                 : PROTOCOL_OTHER;
+      ipaddr_t src, dest;
+      uint8_t src_len, dest_len;
+      unsigned start, end;
+      int ports = sscanf(d, "%u-%u", &start, &end);
+      if (ports == 1) end = start;
+      ok = parse_prefix(b, &src, &src_len) &&
+           parse_prefix(c, &dest, &dest_len) && ports >= 1 &&
+           start <= 65535 && end <= 65535;
+      if (ok)
+        firewall_add_blacklist_prefix_rule(fw, proto, src, src_len, dest,
+                                           dest_len, (port_t)start,
+                                           (port_t)end);
+    } else if ((strcmp(kind, "content") == 0 ||
+                strcmp(kind, "stream") == 0) &&
+               fields == 2) {
+      size_t len = strlen(a) / 2;
+      uint8_t pattern[32];
+      ok = strlen(a) % 2 == 0;
+      for (size_t i = 0; ok && i < len; ++i)
+        ok = isxdigit((unsigned char)a[2 * i]) &&
+             isxdigit((unsigned char)a[2 * i + 1]) &&
+             sscanf(a + 2 * i, "%2hhx", &pattern[i]) == 1;
+      if (ok && kind[0] == 'c')
+        firewall_add_content_rule(fw, (const char *)pattern, len);
+      if (ok && kind[0] == 's')
+        firewall_add_stream_rule(fw, (const char *)pattern, len);
+    } else if (strcmp(kind, "ratelimit") == 0 &&
+               (fields == 3 || fields == 4)) {
+      firewall_configure_ratelimit(fw, (uint32_t)strtoul(a, NULL, 10),
+                                   strtoull(b, NULL, 10));
+      if (fields == 4)
+        firewall_configure_ratelimit_burst(fw, strtoull(c, NULL, 10));
+    } else if (strcmp(kind, "source_ratelimit") == 0 &&
+               (fields == 2 || fields == 3)) {
+      firewall_configure_source_ratelimit(
+          fw, (uint32_t)strtoul(a, NULL, 10),
+          fields == 3 ? strtoull(b, NULL, 10) : 0);
+    } else {
+      ok = false;
+    }
+    if (!ok) fprintf(stderr, "%s:%zu: invalid rule\n", path, lineno);
+  }
+  fclose(file);
+  return ok;
+}
+
+// ==========================================
+//              PCAP REPLAY
+// ==========================================
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+} pcap_header_t;
+
+typedef struct {
+  uint32_t ts_sec;
+  uint32_t ts_frac;
+  uint32_t incl_len;
+  uint32_t orig_len;
+} pcap_record_t;
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Memory-maps a classic pcap file and replays every frame through
+ * firewall_check. Throughput is measured over `rounds` untimed replays, the
+ * latency percentiles over one more replay that times every packet.
+ */
+static int bench_pcap(const char *pcap_path, const char *rules_path,
+                      size_t rounds) {
+  int fd = open(pcap_path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(pcap_path);
+    if (fd >= 0) close(fd);
+    return EXIT_FAILURE;
+  }
+  size_t size = (size_t)st.st_size;
+  if (size < sizeof(pcap_header_t)) {
+    fprintf(stderr, "%s: not a pcap file\n", pcap_path);
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  // Private writable mapping: the firewall gets non-const packets, and any
+  // write would stay in our copy-on-write pages
+  uint8_t *data =
+      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return EXIT_FAILURE;
+  }
+
+  pcap_header_t header;
+  memcpy(&header, data, sizeof(header));
+  bool swapped = header.magic == __builtin_bswap32(PCAP_MAGIC_US) ||
+                 header.magic == __builtin_bswap32(PCAP_MAGIC_NS);
+  uint32_t magic = swapped ? __builtin_bswap32(header.magic) : header.magic;
+  uint32_t linktype =
+      swapped ? __builtin_bswap32(header.linktype) : header.linktype;
+  if ((magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS) ||
+      linktype != PCAP_LINKTYPE_ETHERNET) {
+    fprintf(stderr, "%s: not an Ethernet pcap file\n", pcap_path);
+    munmap(data, size);
+    return EXIT_FAILURE;
+  }
+
+  // Index the frames once so that the replay loop only touches packet data
+  size_t num_packets = 0, capacity = 1024;
+  uint8_t **packets = malloc(capacity * sizeof(uint8_t *));
+  size_t *lens = malloc(capacity * sizeof(size_t));
+  size_t off = sizeof(pcap_header_t);
+  while (off + sizeof(pcap_record_t) <= size) {
+    pcap_record_t rec;
+    memcpy(&rec, data + off, sizeof(rec));
+    size_t len = swapped ? __builtin_bswap32(rec.incl_len) : rec.incl_len;
+    off += sizeof(rec);
+    if (len > size - off) break;  // truncated capture
+    if (num_packets == capacity) {
+      capacity *= 2;
+      packets = realloc(packets, capacity * sizeof(uint8_t *));
+      lens = realloc(lens, capacity * sizeof(size_t));
+    }
+    packets[num_packets] = data + off;
+    lens[num_packets++] = len;
+    off += len;
+  }
+  if (num_packets == 0) {
+    fprintf(stderr, "%s: no packets\n", pcap_path);
+    free(packets);
+    free(lens);
+    munmap(data, size);
+    return EXIT_FAILURE;
+  }
+
+  firewall_t *fw = firewall_create();
+  if (rules_path && !load_rules(fw, rules_path)) {
+    firewall_destroy(fw);
+    free(packets);
+    free(lens);
+    munmap(data, size);
+    return EXIT_FAILURE;
+  }
+
+  uint64_t bytes = 0;
+  for (size_t i = 0; i < num_packets; ++i) bytes += lens[i];
+
+  size_t drops = 0;
+  uint64_t start = now_ns();
+  for (size_t r = 0; r < rounds; ++r) {
+    for (size_t i = 0; i < num_packets; ++i)
+      drops += firewall_check(fw, packets[i], lens[i]);
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  uint64_t *latencies = malloc(num_packets * sizeof(uint64_t));
+  for (size_t i = 0; i < num_packets; ++i) {
+    uint64_t t0 = now_ns();
+    firewall_check(fw, packets[i], lens[i]);
+    latencies[i] = now_ns() - t0;
+  }
+  qsort(latencies, num_packets, sizeof(uint64_t), cmp_u64);
+
+  double total = (double)num_packets * (double)rounds;
+  printf("%s: %zu packets, %.1f MB, %zu rounds, %.2f%% dropped\n", pcap_path,
+         num_packets, (double)bytes / 1e6, rounds,
+         100.0 * (double)drops / total);
+  printf("throughput  %8.3f Mpps %8.3f Gbit/s %9.1f ns/pkt\n",
+         total / (double)elapsed * 1e3,
+         (double)bytes * (double)rounds * 8 / (double)elapsed,
+         (double)elapsed / total);
+  printf("latency     p50 %llu ns, p99 %llu ns, p999 %llu ns\n",
+         (unsigned long long)latencies[num_packets / 2],
+         (unsigned long long)latencies[num_packets * 99 / 100],
+         (unsigned long long)latencies[num_packets * 999 / 1000]);
+
+  // Only available with `make bench STATS=1`
+  firewall_stats_t stats;
+  if (firewall_stats_snapshot(fw, &stats)) {
+    static const char *const stage_names[FIREWALL_NUM_STAGES] = {
+        "parse", "mac", "blacklist", "content", "ratelimit"};
+    for (size_t s = 0; s < FIREWALL_NUM_STAGES; ++s) {
+      if (stats.stage_packets[s] == 0) continue;
+      printf("stage %-10s %12llu packets %9.1f cycles/pkt\n", stage_names[s],
+             (unsigned long long)stats.stage_packets[s],
+             (double)stats.stage_cycles[s] / (double)stats.stage_packets[s]);
+    }
+    firewall_stats_free(&stats);
+  }
+
+  free(latencies);
+  firewall_destroy(fw);
+  free(packets);
+  free(lens);
+  munmap(data, size);
+  return EXIT_SUCCESS;
+}
+
+// ==========================================
+//                  MAIN
+// ==========================================
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s <benchmark> [args...]\n"
+          "  content    content rule throughput at 10, 1k and 100k patterns\n"
+          "  streams    stream rule throughput at 10, 100 and 1k patterns\n"
+          "  prefixes   CIDR blacklist throughput at 100 to 100k prefixes\n"
+          "  batch      firewall_check_batch at burst sizes 1 to 256\n"
+          "  flows      rate limiting with 1k to 4M flows, a flow flood and\n"
+          "             per-source limits\n"
+          "  traffic [flows]  Zipfian traffic at skews 0 to 1.3, 1M flows\n"
+          "  threads [max]  sharded mode with 1, 2, 4, ... max (16) threads\n"
+          "  pipeline   three stage pipeline against run to completion\n"
+          "  startup [rules]  compiling 500k rules against loading them\n"
+          "  pcap <file.pcap> [rules] [rounds]\n"
+          "             replay a capture, rules are loaded from a rule file\n",
+          prog);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (strcmp(argv[1], "content") == 0) {
+    bench_content();
+  } else if (strcmp(argv[1], "streams") == 0) {
+    bench_streams();
+  } else if (strcmp(argv[1], "prefixes") == 0) {
+    bench_prefixes();
+  } else if (strcmp(argv[1], "batch") == 0) {
+    bench_batch();
+  } else if (strcmp(argv[1], "flows") == 0) {
+    bench_flows();
+  } else if (strcmp(argv[1], "traffic") == 0) {
+    bench_traffic(argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000);
+  } else if (strcmp(argv[1], "startup") == 0) {
+    bench_startup(argc > 2 ? strtoul(argv[2], NULL, 10) : 500000);
+  } else if (strcmp(argv[1], "pipeline") == 0) {
+    bench_pipeline();
+  } else if (strcmp(argv[1], "threads") == 0) {
+    bench_threads(argc > 2 ? strtoul(argv[2], NULL, 10) : 16);
+  } else if (strcmp(argv[1], "pcap") == 0 && argc > 2) {
+    return bench_pcap(argv[2], argc > 3 ? argv[3] : NULL,
+                      argc > 4 ? strtoul(argv[4], NULL, 10) : 10);
+  } else {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -22,10 +22,89 @@ void firewall_add_mac_rule(firewall_t *firewall, uint8_t mac[],
 void firewall_add_blacklist_rule(firewall_t *firewall, protocol_t proto,
                                  ipaddr_t srcip, ipaddr_t destip,
                                  port_t start_port, port_t end_port) {}
+void firewall_add_blacklist_prefix_rule(firewall_t *firewall, protocol_t proto,
+                                        ipaddr_t srcip, uint8_t src_len,
+                                        ipaddr_t destip, uint8_t dest_len,
+                                        port_t start_port, port_t end_port) {}
 void firewall_add_content_rule(firewall_t *firewall, const char *pattern,
                                size_t pattern_len) {}
+void firewall_add_stream_rule(firewall_t *firewall, const char *pattern,
+                              size_t pattern_len) {}
 void firewall_configure_ratelimit(firewall_t *firewall, uint32_t rate_bps,
                                   uint64_t timeout_us) {}
+void firewall_configure_ratelimit_burst(firewall_t *firewall,
+                                        uint64_t burst_bytes) {}
+void firewall_configure_source_ratelimit(firewall_t *firewall,
+                                         uint32_t rate_bps,
+                                         uint64_t burst_bytes) {}
+bool firewall_commit(firewall_t *firewall) { return false; }
+bool firewall_save_rules(firewall_t *firewall, const char *path) {
+  return false;
+}
+bool firewall_load_rules(firewall_t *firewall, const char *path) {
+  return false;
+}
 action_t firewall_check(firewall_t *firewall, void *packet, size_t packet_len) {
   return ACTION_PASS;
 }
+action_t firewall_check_at(firewall_t *firewall, void *packet,
+                           size_t packet_len, uint64_t now_us) {
+  return ACTION_PASS;
+}
+void firewall_check_batch(firewall_t *firewall, void **packets, size_t *lens,
+                          action_t *out, size_t n) {}
+void firewall_check_batch_at(firewall_t *firewall, void **packets,
+                             size_t *lens, action_t *out, size_t n,
+                             uint64_t now_us) {}
+bool firewall_configure_shards(firewall_t *firewall, size_t num_shards) {
+  return false;
+}
+size_t firewall_flow_shard(const firewall_t *firewall, const void *packet,
+                           size_t packet_len) {
+  return 0;
+}
+action_t firewall_check_shard(firewall_t *firewall, size_t shard, void *packet,
+                              size_t packet_len) {
+  return ACTION_PASS;
+}
+action_t firewall_check_shard_at(firewall_t *firewall, size_t shard,
+                                 void *packet, size_t packet_len,
+                                 uint64_t now_us) {
+  return ACTION_PASS;
+}
+bool firewall_parse(const void *packet, size_t packet_len,
+                    firewall_packet_t *p) {
+  return false;
+}
+size_t firewall_packet_shard(const firewall_t *firewall,
+                             const firewall_packet_t *p) {
+  return 0;
+}
+action_t firewall_check_parsed(firewall_t *firewall, size_t shard,
+                               const firewall_packet_t *p, uint64_t now_us) {
+  return ACTION_PASS;
+}
+bool firewall_configure_verdict_cache(firewall_t *firewall, size_t entries) {
+  return false;
+}
+void firewall_configure_flow_limit(firewall_t *firewall, size_t max_flows,
+                                   size_t max_bytes) {}
+void firewall_flow_stats(const firewall_t *firewall,
+                         firewall_flow_stats_t *stats) {}
+firewall_pipeline_t *firewall_pipeline_create(firewall_t *firewall,
+                                              size_t ring_size) {
+  return NULL;
+}
+void firewall_pipeline_destroy(firewall_pipeline_t *pipeline) {}
+size_t firewall_pipeline_submit(firewall_pipeline_t *pipeline, void **packets,
+                                size_t *lens, size_t n) {
+  return 0;
+}
+size_t firewall_pipeline_poll(firewall_pipeline_t *pipeline,
+                              firewall_verdict_t *out, size_t max) {
+  return 0;
+}
+bool firewall_stats_snapshot(firewall_t *firewall, firewall_stats_t *stats) {
+  return false;
+}
+void firewall_stats_free(firewall_stats_t *stats) {}
@@ -41,6 +41,17 @@ void firewall_add_blacklist_rule(firewall_t *firewall, protocol_t proto,
                                  ipaddr_t srcip, ipaddr_t destip,
                                  port_t start_port, port_t end_port);
 
+/**
+ * Same as firewall_add_blacklist_rule, but srcip and destip are CIDR prefixes
+ * of src_len and dest_len bits: only the upper src_len bits of the source
+ * address (dest_len bits of the destination) are compared, so a length of 0
+ * matches any address and 32 a single one. Lengths above 32 are treated as 32.
+ */
+void firewall_add_blacklist_prefix_rule(firewall_t *firewall, protocol_t proto,
+                                        ipaddr_t srcip, uint8_t src_len,
+                                        ipaddr_t destip, uint8_t dest_len,
+                                        port_t start_port, port_t end_port);
+
 /**
  * Drop packets that contain a payload that matches "pattern" _exactly_.
  * This rule applies to both UDP and TCP.
@@ -50,6 +61,19 @@ void firewall_add_blacklist_rule(firewall_t *firewall, protocol_t proto,
 void firewall_add_content_rule(firewall_t *firewall, const char *pattern,
                                size_t pattern_len);
 
+/**
+ * Drop TCP segments that complete an occurrence of "pattern" in the byte
+ * stream of their flow (one direction of a connection, by 4-tuple), also
+ * when the pattern is split across segments. There is no reassembly:
+ * segments are matched in the order they arrive and a flow keeps only a
+ * small matcher state between them, dropped after a minute of inactivity.
+ * Once new stream rules take effect every flow's stream starts over.
+ * Empty patterns never match. The pattern is copied, like for
+ * firewall_add_content_rule.
+ */
+void firewall_add_stream_rule(firewall_t *firewall, const char *pattern,
+                              size_t pattern_len);
+
 /**
  * Configures the firewall to apply a Leaky Bucket rate limit on individual
  * flows.
@@ -69,11 +93,296 @@ void firewall_add_content_rule(firewall_t *firewall, const char *pattern,
  * microseconds.
  *
  * You can get the current timestamp with the provided timestamp_us()
- * method.
+ * method. The *_at variants of the checks take it from the caller instead.
  */
 void firewall_configure_ratelimit(firewall_t *firewall, uint32_t rate_bps,
                                   uint64_t timeout_us);
 
+/**
+ * Hierarchical rate limiting, on top of or instead of the per-flow buckets.
+ *
+ * firewall_configure_ratelimit_burst sets the size of every flow's bucket to
+ * burst_bytes instead of R, one second of traffic; 0 restores that default.
+ *
+ * firewall_configure_source_ratelimit nests the flows of each source IP in
+ * an aggregate Leaky Bucket B_S that drains at rate_bps and holds burst_bytes
+ * (0 again meaning one second of traffic), so that a source can't evade the
+ * limit by opening more flows. A packet passes only if its IP payload fits
+ * into both B_F and B_S, and then is added to both. A rate_bps of 0 (the
+ * default) disables it. Checking both levels costs O(1) per packet.
+ *
+ * Sources need no timeout: an empty bucket is forgotten. In sharded mode
+ * every shard gets an equal share of a source's rate and burst, as the flows
+ * of a source are spread over the shards. The flow limit (see
+ * firewall_configure_flow_limit) bounds the sources of each shard as well.
+ */
+void firewall_configure_ratelimit_burst(firewall_t *firewall,
+                                        uint64_t burst_bytes);
+void firewall_configure_source_ratelimit(firewall_t *firewall,
+                                         uint32_t rate_bps,
+                                         uint64_t burst_bytes);
+
+/**
+ * Publishes the rules added and the rate limit configured since the last
+ * commit. They are compiled into a new immutable rule set that replaces the
+ * current one with a single atomic pointer swap, so checks running on other
+ * threads see either the old or the new rules, and never wait on a lock. The
+ * old rule set is freed once no check can still be using it.
+ *
+ * After the first call, staged rules only take effect at the next commit.
+ * Before it, the next check commits them itself, which is only safe while a
+ * single thread uses the firewall.
+ *
+ * Rule updates (firewall_add_*, firewall_configure_ratelimit* and this
+ * function) must come from one thread at a time. Returns false if compiling
+ * the rules runs out of memory, in which case the current rules stay in
+ * place.
+ */
+bool firewall_commit(firewall_t *firewall);
+
+/**
+ * Compiled rule files, for fast restarts with large rule sets.
+ * firewall_save_rules commits staged rules (without switching to explicit
+ * commits) and writes the compiled rule set, the rules as added and the rate
+ * limit configuration to `path`, replacing it atomically.
+ * firewall_load_rules memory-maps such a file and uses the compiled tables
+ * in place, without parsing or compiling anything but the prefix length
+ * tables of CIDR rules, then publishes them like firewall_commit. The loaded
+ * rules replace all rules of the firewall, including staged ones; rules added
+ * afterwards are compiled together with them. Flow state is kept, but
+ * streams start over (see firewall_add_stream_rule) and rule counters restart
+ * at zero.
+ *
+ * Files are only portable between identical builds of the firewall and the
+ * loader only validates their structure, so they must come from a trusted
+ * source. The mapping stays in use until the firewall is destroyed or loads
+ * another file. Both are rule updates, see firewall_commit, and return false
+ * on I/O errors, allocation failure or (for loads) a file that this build
+ * did not write, in which case the current rules stay in place.
+ */
+bool firewall_save_rules(firewall_t *firewall, const char *path);
+bool firewall_load_rules(firewall_t *firewall, const char *path);
+
 action_t firewall_check(firewall_t *firewall, void *packet, size_t packet_len);
 
+/**
+ * Same as firewall_check, but rate limiting uses `now_us` (on the
+ * timestamp_us() clock) instead of reading the clock. A caller polling a NIC
+ * can read it once per burst. A timestamp older than the last packet of a
+ * flow drains nothing from its bucket.
+ */
+action_t firewall_check_at(firewall_t *firewall, void *packet,
+                           size_t packet_len, uint64_t now_us);
+
+/**
+ * Checks a burst of n packets, writing the verdict of packets[i] (of length
+ * lens[i]) to out[i]. The verdicts are the same as calling firewall_check on
+ * each packet in order, but the work of the burst is amortized: headers are
+ * parsed up front and every rule stage runs across the whole burst.
+ */
+void firewall_check_batch(firewall_t *firewall, void **packets, size_t *lens,
+                          action_t *out, size_t n);
+
+/**
+ * Same as firewall_check_batch with one timestamp for the whole burst, see
+ * firewall_check_at. firewall_check_batch also reads the clock at most once
+ * per burst.
+ */
+void firewall_check_batch_at(firewall_t *firewall, void **packets,
+                             size_t *lens, action_t *out, size_t n,
+                             uint64_t now_us);
+
+/**
+ * Sharded mode for multi-core packet processing. The rate limit flow state is
+ * split into num_shards independent shards (discarding the current state) and
+ * each flow belongs to the shard returned by firewall_flow_shard, a symmetric
+ * hash of its 4-tuple. The rule tables are shared read-only by all shards.
+ *
+ * Typically worker thread i owns shard i and only receives the packets
+ * steered to it. firewall_check_shard never takes a lock, so a shard must
+ * not be used by two threads at the same time, and while workers are
+ * running rules only change through firewall_commit. firewall_check keeps
+ * working and picks the shard itself. firewall_check_shard_at takes the
+ * timestamp from the caller, like firewall_check_at.
+ *
+ * Returns false if num_shards is 0 or on allocation failure.
+ */
+bool firewall_configure_shards(firewall_t *firewall, size_t num_shards);
+size_t firewall_flow_shard(const firewall_t *firewall, const void *packet,
+                           size_t packet_len);
+action_t firewall_check_shard(firewall_t *firewall, size_t shard, void *packet,
+                              size_t packet_len);
+action_t firewall_check_shard_at(firewall_t *firewall, size_t shard,
+                                 void *packet, size_t packet_len,
+                                 uint64_t now_us);
+
+/**
+ * Header fields of a packet, validated and converted to host byte order once
+ * by firewall_parse. The descriptor points into the packet buffer, which must
+ * stay valid while it is used. Offsets are from the start of the Ethernet
+ * header and come from the IHL and TCP data offset fields; l4_off and
+ * payload_off are 0 unless is_ip.
+ */
+typedef struct {
+  const uint8_t *bytes;
+  uint32_t len;
+  uint16_t l4_off;
+  uint16_t payload_off;  // payload_off == len means no payload
+  ipaddr_t srcip;
+  ipaddr_t destip;
+  port_t srcport;
+  port_t destport;
+  uint8_t proto;  // protocol_t
+  bool is_ip;     // the other fields are only set for IPv4 packets
+} firewall_packet_t;
+
+/**
+ * Parse-once path for sharded mode: a dispatcher parses each packet, steers
+ * it with firewall_packet_shard and hands the descriptor to the worker owning
+ * that shard, which checks it with firewall_check_parsed without touching the
+ * headers again. Same rules as firewall_check_shard_at otherwise.
+ *
+ * firewall_parse returns false for malformed packets, which firewall_check
+ * would drop.
+ */
+bool firewall_parse(const void *packet, size_t packet_len,
+                    firewall_packet_t *p);
+size_t firewall_packet_shard(const firewall_t *firewall,
+                             const firewall_packet_t *p);
+action_t firewall_check_parsed(firewall_t *firewall, size_t shard,
+                               const firewall_packet_t *p, uint64_t now_us);
+
+/**
+ * Optional verdict cache: remembers the outcome of the MAC and blacklist
+ * rules per source MAC and 5-tuple (protocol, addresses and ports), so that
+ * the next packets of a flow skip those rules. Content rules and rate
+ * limiting still run on every packet. Every shard gets a direct mapped cache
+ * of `entries` slots, rounded up to a power of two; 0 disables it. Commits
+ * that change MAC or blacklist rules invalidate all cached verdicts.
+ *
+ * Like firewall_configure_shards, must not be called while checks run.
+ * Returns false on allocation failure, in which case the caches stay as they
+ * were.
+ */
+bool firewall_configure_verdict_cache(firewall_t *firewall, size_t entries);
+
+/**
+ * Bounds the per-flow state of rate limiting and of stream rules, so that a
+ * flood of new flows (e.g. from spoofed sources) can't grow it without limit.
+ * At most max_flows flows are tracked and at most max_bytes bytes are used
+ * for them, about 80 bytes per flow; 0 leaves a bound out, and both 0 (the
+ * default) means unbounded. The limit applies to rate limiting, source
+ * buckets and stream rules separately, and is split evenly between the
+ * shards. A new flow in a full shard evicts one of the least recently seen
+ * flows, which starts over with an empty bucket or matcher state if it
+ * comes back; a new source evicts one of the emptiest source buckets. Shards
+ * holding more flows or sources than their new share are emptied.
+ *
+ * Like firewall_configure_shards, must not be called while checks run.
+ */
+void firewall_configure_flow_limit(firewall_t *firewall, size_t max_flows,
+                                   size_t max_bytes);
+
+typedef struct {
+  uint64_t flows;      // currently tracked
+  uint64_t evictions;  // flows evicted to make room for new ones
+  size_t max_flows;    // the configured limit in flows, 0 if unbounded
+} firewall_flow_stats_t;
+
+/**
+ * Reads the flow counters. Unlike firewall_stats_snapshot these are always
+ * available, and they can be read while checks run (but not while the
+ * firewall is being configured).
+ */
+void firewall_flow_stats(const firewall_t *firewall,
+                         firewall_flow_stats_t *stats);
+
+/**
+ * Pipelined mode, for when one core can't keep up with whole checks: three
+ * threads run parsing, then the MAC, blacklist, content and stream rules,
+ * then rate limiting, handing packet descriptors forward over lock-free
+ * single-producer single-consumer rings of `ring_size` entries (rounded up
+ * to a power of two).
+ *
+ * One application thread submits packets, one (possibly the same) polls the
+ * verdicts, which come back in submission order with the packet they belong
+ * to. Submit returns how many packets fit into the first ring, poll at most
+ * `max` verdicts; neither blocks. Packet buffers must stay valid until their
+ * verdict has been polled.
+ *
+ * Creating a pipeline configures three shards (see firewall_configure_shards,
+ * this discards the rate limit state) and must not happen while checks run.
+ * While the pipeline exists, packets must only be checked through it and
+ * rules only change through firewall_commit. Destroying it stops the threads
+ * and drops the packets still in flight. Returns NULL on allocation or thread
+ * creation failure, or if ring_size is 0.
+ */
+typedef struct firewall_pipeline firewall_pipeline_t;
+
+typedef struct {
+  void *packet;
+  action_t verdict;
+} firewall_verdict_t;
+
+firewall_pipeline_t *firewall_pipeline_create(firewall_t *firewall,
+                                              size_t ring_size);
+void firewall_pipeline_destroy(firewall_pipeline_t *pipeline);
+size_t firewall_pipeline_submit(firewall_pipeline_t *pipeline, void **packets,
+                                size_t *lens, size_t n);
+size_t firewall_pipeline_poll(firewall_pipeline_t *pipeline,
+                              firewall_verdict_t *out, size_t max);
+
+typedef enum {
+  FIREWALL_STAGE_PARSE = 0,
+  FIREWALL_STAGE_MAC,
+  FIREWALL_STAGE_BLACKLIST,
+  FIREWALL_STAGE_CONTENT,
+  FIREWALL_STAGE_RATELIMIT,
+  FIREWALL_NUM_STAGES,
+} firewall_stage_t;
+
+typedef struct {
+  uint64_t packets;
+  uint64_t bytes;  // whole packets, headers included
+} firewall_counter_t;
+
+typedef struct {
+  // One counter per rule, in the order the rules of each kind were added
+  firewall_counter_t *mac_rules;
+  size_t num_mac_rules;
+  firewall_counter_t *blacklist_rules;
+  size_t num_blacklist_rules;
+  firewall_counter_t *content_rules;
+  size_t num_content_rules;
+  firewall_counter_t *stream_rules;
+  size_t num_stream_rules;
+  firewall_counter_t ratelimit_drops;
+  // Cycles (TSC ticks where available, nanoseconds otherwise) spent in each
+  // stage, and the number of packets that went through it
+  uint64_t stage_cycles[FIREWALL_NUM_STAGES];
+  uint64_t stage_packets[FIREWALL_NUM_STAGES];
+} firewall_stats_t;
+
+/**
+ * Statistics are only collected when the firewall is built with
+ * FIREWALL_STATS defined (`make STATS=1`), otherwise they cost nothing and
+ * this returns false.
+ *
+ * A packet is counted on the MAC rule matching its source address, then on
+ * the blacklist, content or stream rule that drops it, if any: once a
+ * packet is dropped its remaining stages are skipped. When several blacklist
+ * rules match, one of them is counted. Duplicate content patterns count on
+ * the first one added, and a stream match on the first added pattern ending
+ * there; stream rules are timed as part of the content stage. Verdict cache
+ * hits count on the same rules as the packet that filled the entry, and
+ * their time goes to the MAC stage.
+ *
+ * Fills `stats` with the totals so far, to be released with
+ * firewall_stats_free. Counters are read while checks keep running, so the
+ * snapshot is not atomic across counters. Must be called from the thread
+ * updating the rules. Returns false on allocation failure.
+ */
+bool firewall_stats_snapshot(firewall_t *firewall, firewall_stats_t *stats);
+void firewall_stats_free(firewall_stats_t *stats);
+
 #endif  // LIB_H
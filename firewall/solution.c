@@ -0,0 +1,3957 @@
+#include "lib.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define INITIAL_CAPACITY 16
+
+// Members and statements that only exist in builds with statistics, see
+// STATISTICS
+#ifdef FIREWALL_STATS
+#define STATS(...) __VA_ARGS__
+#else
+#define STATS(...)
+#endif
+
+// ==========================================
+//                 HELPERS
+// ==========================================
+
+// Grows `*arr` so that it can hold at least `needed` elements. Returns false
+// (leaving the array untouched) if the allocation fails.
+static bool ensure_capacity(void **arr, size_t *capacity, size_t needed,
+                            size_t elem_size) {
+  if (needed <= *capacity) return true;
+
+  size_t new_capacity = *capacity ? *capacity : INITIAL_CAPACITY;
+  while (new_capacity < needed) new_capacity *= 2;
+
+  void *new_arr = realloc(*arr, new_capacity * elem_size);
+  if (!new_arr) return false;
+
+  *arr = new_arr;
+  *capacity = new_capacity;
+  return true;
+}
+
+// 64 bit finalizer from MurmurHash3, good enough to spread packed keys
+static inline uint64_t mix64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+static inline ipaddr_t prefix_mask(uint8_t len) {
+  return len == 0 ? 0 : ~(ipaddr_t)0 << (32 - len);
+}
+
+// ==========================================
+//                  RULES
+// ==========================================
+
+typedef struct {
+  protocol_t proto;
+  ipaddr_t srcip;
+  ipaddr_t destip;
+  uint8_t src_len;  // prefix length, 0 for wildcard
+  uint8_t dest_len;
+  port_t start_port;
+  port_t end_port;
+  uint32_t id;  // position in the order the rules were added
+} blacklist_rule_t;
+
+typedef struct {
+  uint8_t *data;
+  size_t len;
+} content_rule_t;
+
+static void pattern_rules_free(content_rule_t *rules, size_t num_rules) {
+  for (size_t i = 0; i < num_rules; ++i) free(rules[i].data);
+  free(rules);
+}
+
+// ==========================================
+//           MAC RULE TABLE
+// ==========================================
+
+/**
+ * MAC rules live in an open-addressing table of packed 64 bit slots: the 48
+ * bit address in the low bits, then a used bit and the action. A lookup is
+ * one hash and (at load factor <= 0.5) usually a single slot read. Adding a
+ * rule for an address that already has one overwrites its action, which
+ * implements "the most recently added rule wins".
+ */
+
+#define MAC_TABLE_INITIAL_SLOTS 64
+#define MAC_ADDR_MASK ((UINT64_C(1) << 48) - 1)
+#define MAC_USED (UINT64_C(1) << 48)
+#define MAC_DROP (UINT64_C(1) << 49)
+
+typedef struct {
+  uint64_t *slots;         // 0 for an empty slot
+  STATS(uint32_t *rules;)  // id of the rule in every slot
+  size_t slot_mask;
+  size_t size;
+} mac_table_t;
+
+static inline uint64_t mac_pack(const uint8_t *mac) {
+  return (uint64_t)mac[0] << 40 | (uint64_t)mac[1] << 32 |
+         (uint64_t)mac[2] << 24 | (uint64_t)mac[3] << 16 |
+         (uint64_t)mac[4] << 8 | (uint64_t)mac[5];
+}
+
+static void mac_table_free(mac_table_t *table) {
+  free(table->slots);
+  STATS(free(table->rules);)
+  memset(table, 0, sizeof(*table));
+}
+
+// Returns the slot holding `addr`, or the empty slot where it belongs
+static inline size_t mac_table_find(const mac_table_t *table, uint64_t addr) {
+  size_t slot = mix64(addr) & table->slot_mask;
+  while (table->slots[slot] && (table->slots[slot] & MAC_ADDR_MASK) != addr)
+    slot = (slot + 1) & table->slot_mask;
+  return slot;
+}
+
+static bool mac_table_grow(mac_table_t *table) {
+  size_t num_slots =
+      table->slots ? 2 * (table->slot_mask + 1) : MAC_TABLE_INITIAL_SLOTS;
+  mac_table_t grown = {
+      .slots = calloc(num_slots, sizeof(uint64_t)),
+      STATS(.rules = malloc(num_slots * sizeof(uint32_t)), )
+      .slot_mask = num_slots - 1,
+      .size = table->size,
+  };
+  if (!grown.slots STATS(|| !grown.rules)) {
+    mac_table_free(&grown);
+    return false;
+  }
+
+  for (size_t i = 0; table->slots && i <= table->slot_mask; ++i) {
+    uint64_t slot = table->slots[i];
+    if (!slot) continue;
+    size_t to = mac_table_find(&grown, slot & MAC_ADDR_MASK);
+    grown.slots[to] = slot;
+    STATS(grown.rules[to] = table->rules[i];)
+  }
+  mac_table_free(table);
+  *table = grown;
+  return true;
+}
+
+// Returns false (leaving the table untouched) if the allocation fails
+static bool mac_table_put(mac_table_t *table, const uint8_t *mac,
+                          action_t action, uint32_t rule) {
+  // Load factor <= 0.5, this also allocates the first slots
+  if (2 * (table->size + 1) > table->slot_mask + 1 && !mac_table_grow(table))
+    return false;
+
+  uint64_t addr = mac_pack(mac);
+  size_t slot = mac_table_find(table, addr);
+  if (!table->slots[slot]) ++table->size;
+  table->slots[slot] =
+      addr | MAC_USED | (action == ACTION_DROP ? MAC_DROP : 0);
+  STATS(table->rules[slot] = rule;)
+  (void)rule;  // only kept for statistics
+  return true;
+}
+
+static bool mac_table_clone(mac_table_t *dst, const mac_table_t *src) {
+  *dst = *src;
+  if (!src->slots) return true;
+  dst->slots = malloc((src->slot_mask + 1) * sizeof(uint64_t));
+  if (!dst->slots) return false;
+  memcpy(dst->slots, src->slots, (src->slot_mask + 1) * sizeof(uint64_t));
+#ifdef FIREWALL_STATS
+  dst->rules = malloc((src->slot_mask + 1) * sizeof(uint32_t));
+  if (!dst->rules) {
+    mac_table_free(dst);
+    return false;
+  }
+  memcpy(dst->rules, src->rules, (src->slot_mask + 1) * sizeof(uint32_t));
+#endif
+  return true;
+}
+
+// Returns the slot of the rule for `mac`, or NULL if there is none
+static inline const uint64_t *mac_table_lookup(const mac_table_t *table,
+                                               const uint8_t *mac) {
+  if (table->size == 0) return NULL;
+  const uint64_t *slot = &table->slots[mac_table_find(table, mac_pack(mac))];
+  return *slot ? slot : NULL;
+}
+
+static inline action_t mac_slot_action(const uint64_t *slot) {
+  return slot && (*slot & MAC_DROP) ? ACTION_DROP : ACTION_PASS;
+}
+
+// ==========================================
+//      PREFIX LENGTH LOOKUP (DIR-24-8)
+// ==========================================
+
+/**
+ * For every address dimension, a DIR-24-8 table maps an address to the set of
+ * prefix lengths for which some rule prefix contains that address. The
+ * classifier only probes the tuples whose lengths are in both sets, so the
+ * cost of a lookup no longer grows with the number of distinct lengths.
+ *
+ * tbl24 is indexed by the upper 24 address bits. An entry is either a class
+ * id, or (with LPM_GROUP set) the index of a 256 entry tbl8 group indexed by
+ * the low 8 bits, which only exists below prefixes longer than /24. A class
+ * id indexes the small array of distinct length sets, so a lookup is one or
+ * two table accesses plus a read of a cache resident array.
+ *
+ * /0 and /32 are left out of the table and present in every set: a /0
+ * contains every address, and probing a /32 tuple is a single exact lookup.
+ * A dimension without other lengths has no table at all. A table keeps the
+ * prefixes it was built from, so that a commit whose rules leave them alone
+ * can reuse the table instead of building another 32 MB tbl24.
+ */
+
+#define LPM_GROUP 0x8000
+#define LPM_MAX_IDS 0x8000  // class ids and group indices have 15 bits
+#define LPM_INTERN_SLOTS (2 * LPM_MAX_IDS)
+#define LPM_INTERN_EMPTY UINT16_MAX
+#define LPM_GROUP_SIZE 256
+#define LPM_BASE_LENS ((uint64_t)1 | (uint64_t)1 << 32)
+#define LPM_ALL_LENS (((uint64_t)1 << 33) - 1)
+
+typedef struct {
+  ipaddr_t addr;
+  uint8_t len;
+} lpm_prefix_t;
+
+typedef struct {
+  lpm_prefix_t *prefixes;  // sorted and unique, see lpm_build
+  size_t num_prefixes;
+  uint16_t *tbl24;  // NULL if the dimension has no prefix of length 1 to 31
+  uint16_t *tbl8;
+  size_t num_groups;
+  size_t groups_capacity;
+  uint64_t *classes;  // bit i is set if a /i prefix contains the address
+  size_t num_classes;
+  size_t classes_capacity;
+} lpm_t;
+
+static void lpm_free(lpm_t *lpm) {
+  free(lpm->prefixes);
+  free(lpm->tbl24);
+  free(lpm->tbl8);
+  free(lpm->classes);
+  memset(lpm, 0, sizeof(*lpm));
+}
+
+static inline uint64_t lpm_lookup(const lpm_t *lpm, ipaddr_t addr) {
+  if (!lpm->tbl24) return LPM_ALL_LENS;
+  uint16_t e = lpm->tbl24[addr >> 8];
+  if (e & LPM_GROUP)
+    e = lpm->tbl8[(size_t)(e & ~LPM_GROUP) * LPM_GROUP_SIZE + (addr & 0xff)];
+  return lpm->classes[e];
+}
+
+// Returns the id of the class with length set `lens`, creating it if needed,
+// or -1 if there are too many classes. `intern` maps lens to class ids.
+static int32_t lpm_intern(lpm_t *lpm, uint16_t *intern, uint64_t lens) {
+  size_t slot = mix64(lens) & (LPM_INTERN_SLOTS - 1);
+  while (intern[slot] != LPM_INTERN_EMPTY) {
+    if (lpm->classes[intern[slot]] == lens) return intern[slot];
+    slot = (slot + 1) & (LPM_INTERN_SLOTS - 1);
+  }
+
+  if (lpm->num_classes == LPM_MAX_IDS ||
+      !ensure_capacity((void **)&lpm->classes, &lpm->classes_capacity,
+                       lpm->num_classes + 1, sizeof(uint64_t)))
+    return -1;
+  lpm->classes[lpm->num_classes] = lens;
+  intern[slot] = (uint16_t)lpm->num_classes;
+  return (int32_t)lpm->num_classes++;
+}
+
+// Adds the length bit `len` to the class of `count` entries
+static bool lpm_paint(lpm_t *lpm, uint16_t *intern, uint16_t *entries,
+                      size_t count, uint8_t len) {
+  // Runs of equal entries are the common case, remember the last mapping
+  uint16_t last_old = LPM_INTERN_EMPTY;
+  uint16_t last_new = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (entries[i] != last_old) {
+      last_old = entries[i];
+      int32_t id =
+          lpm_intern(lpm, intern, lpm->classes[last_old] | (uint64_t)1 << len);
+      if (id < 0) return false;
+      last_new = (uint16_t)id;
+    }
+    entries[i] = last_new;
+  }
+  return true;
+}
+
+static bool lpm_insert(lpm_t *lpm, uint16_t *intern, lpm_prefix_t p) {
+  if (p.len <= 24)
+    return lpm_paint(lpm, intern, &lpm->tbl24[p.addr >> 8],
+                     (size_t)1 << (24 - p.len), p.len);
+
+  uint16_t *e = &lpm->tbl24[p.addr >> 8];
+  if (!(*e & LPM_GROUP)) {
+    if (lpm->num_groups == LPM_MAX_IDS ||
+        !ensure_capacity((void **)&lpm->tbl8, &lpm->groups_capacity,
+                         (lpm->num_groups + 1) * LPM_GROUP_SIZE,
+                         sizeof(uint16_t)))
+      return false;
+    uint16_t *group = &lpm->tbl8[lpm->num_groups * LPM_GROUP_SIZE];
+    for (size_t i = 0; i < LPM_GROUP_SIZE; ++i) group[i] = *e;
+    *e = (uint16_t)(LPM_GROUP | lpm->num_groups++);
+  }
+  uint16_t *group = &lpm->tbl8[(size_t)(*e & ~LPM_GROUP) * LPM_GROUP_SIZE];
+  return lpm_paint(lpm, intern, &group[p.addr & 0xff],
+                   (size_t)1 << (32 - p.len), p.len);
+}
+
+// Builds `lpm` from `n` unique prefixes sorted by lpm_prefix_cmp, with
+// lengths between 1 and 31 and masked addresses. Takes over the malloc'ed
+// `prefixes`. Returns false on allocation failure or if the prefixes need
+// more than LPM_MAX_IDS classes or groups, in which case `lpm` is left empty
+// and matches every length.
+static bool lpm_build(lpm_t *lpm, lpm_prefix_t *prefixes, size_t n) {
+  memset(lpm, 0, sizeof(*lpm));
+  if (n == 0) {
+    free(prefixes);
+    return true;
+  }
+
+  uint16_t *intern = malloc(LPM_INTERN_SLOTS * sizeof(uint16_t));
+  lpm->tbl24 = calloc((size_t)1 << 24, sizeof(uint16_t));
+  if (!intern || !lpm->tbl24) goto fail;
+  memset(intern, 0xff, LPM_INTERN_SLOTS * sizeof(uint16_t));
+  if (lpm_intern(lpm, intern, LPM_BASE_LENS) != 0) goto fail;
+
+  // Shorter prefixes first: a longer prefix only ever adds its bit to the
+  // classes painted by the prefixes containing it.
+  for (size_t i = 0; i < n; ++i)
+    if (!lpm_insert(lpm, intern, prefixes[i])) goto fail;
+
+  free(intern);
+  lpm->prefixes = prefixes;
+  lpm->num_prefixes = n;
+  return true;
+
+fail:
+  free(intern);
+  free(prefixes);
+  lpm_free(lpm);
+  return false;
+}
+
+static int lpm_prefix_cmp(const void *a, const void *b) {
+  const lpm_prefix_t *x = a;
+  const lpm_prefix_t *y = b;
+  if (x->len != y->len) return x->len < y->len ? -1 : 1;
+  if (x->addr != y->addr) return x->addr < y->addr ? -1 : 1;
+  return 0;
+}
+
+// ==========================================
+//     BLACKLIST CLASSIFIER (TUPLE SPACE)
+// ==========================================
+
+/**
+ * Blacklist rules are compiled into a tuple space: rules are grouped by their
+ * (source prefix length, destination prefix length) pair, and every group is
+ * an exact-match hash table keyed by (proto, masked srcip, masked destip).
+ * The port ranges of all rules sharing a key are merged into sorted, disjoint
+ * intervals, so a lookup is one probe per tuple plus a binary search.
+ *
+ * Since every blacklist rule drops, the sequential semantics ("drop if any
+ * rule matches") do not depend on rule order and the merge is exact.
+ */
+
+typedef struct {
+  port_t lo;
+  port_t hi;
+} port_range_t;
+
+// Unmerged port range of one rule, to attribute hits to rules
+typedef struct {
+  port_range_t range;
+  uint32_t rule;
+} rule_ref_t;
+
+typedef struct {
+  ipaddr_t src;
+  ipaddr_t dest;
+  uint8_t proto;
+  bool used;
+  uint32_t ranges_start;  // index into classifier_t.ranges
+  uint32_t ranges_count;
+  STATS(uint32_t refs_start; uint32_t refs_count;)  // into classifier_t.refs
+} tuple_entry_t;
+
+typedef struct {
+  uint8_t src_len;
+  uint8_t dest_len;
+  ipaddr_t src_mask;
+  ipaddr_t dest_mask;
+  size_t slots_start;  // index into classifier_t.slots
+  size_t slot_mask;    // number of slots - 1, slot count is a power of two
+} tuple_t;
+
+typedef struct {
+  tuple_t *tuples;
+  size_t num_tuples;
+  tuple_entry_t *slots;  // of all tuples, one after the other
+  size_t num_slots;
+  port_range_t *ranges;
+  size_t num_ranges;
+  STATS(rule_ref_t *refs; size_t num_refs;)
+  lpm_t src_lpm;  // prunes the tuples to probe, see lpm_t
+  lpm_t dest_lpm;
+  uint64_t src_lens;  // bit i is set if some tuple has src_len i
+  uint64_t dest_lens;
+  int32_t tuple_of[33][33];  // (src_len, dest_len) -> tuple index or -1
+} classifier_t;
+
+static inline uint64_t tuple_hash(uint8_t proto, ipaddr_t src, ipaddr_t dest) {
+  return mix64(((uint64_t)src << 32 | dest) ^ ((uint64_t)proto << 56) ^
+               (uint64_t)proto);
+}
+
+// Frees everything but the prefix length tables, which rule sets free
+// separately since they may share them (see RULE SETS)
+static void classifier_free(classifier_t *cls) {
+  free(cls->tuples);
+  free(cls->slots);
+  free(cls->ranges);
+  STATS(free(cls->refs);)
+  memset(cls, 0, sizeof(*cls));
+}
+
+static int blacklist_rule_cmp(const void *a, const void *b) {
+  const blacklist_rule_t *x = a;
+  const blacklist_rule_t *y = b;
+  if (x->src_len != y->src_len) return x->src_len < y->src_len ? -1 : 1;
+  if (x->dest_len != y->dest_len) return x->dest_len < y->dest_len ? -1 : 1;
+  if (x->proto != y->proto) return x->proto < y->proto ? -1 : 1;
+  if (x->srcip != y->srcip) return x->srcip < y->srcip ? -1 : 1;
+  if (x->destip != y->destip) return x->destip < y->destip ? -1 : 1;
+  if (x->start_port != y->start_port)
+    return x->start_port < y->start_port ? -1 : 1;
+  return 0;
+}
+
+static bool same_key(const blacklist_rule_t *a, const blacklist_rule_t *b) {
+  return a->src_len == b->src_len && a->dest_len == b->dest_len &&
+         a->proto == b->proto && a->srcip == b->srcip &&
+         a->destip == b->destip;
+}
+
+// Builds the prefix length table of the source (or destination) addresses of
+// the normalized `rules`, or copies `prev` if that was built from the same
+// prefixes. Failing to build it only disables the pruning.
+static bool classifier_build_lpm(lpm_t *lpm, const blacklist_rule_t *rules,
+                                 size_t n, bool src, const lpm_t *prev) {
+  memset(lpm, 0, sizeof(*lpm));
+  lpm_prefix_t *prefixes = malloc((n ? n : 1) * sizeof(*prefixes));
+  if (!prefixes) return false;
+
+  size_t num_prefixes = 0;
+  for (size_t i = 0; i < n; ++i) {
+    lpm_prefix_t p = src ? (lpm_prefix_t){rules[i].srcip, rules[i].src_len}
+                         : (lpm_prefix_t){rules[i].destip, rules[i].dest_len};
+    if (p.len > 0 && p.len < 32) prefixes[num_prefixes++] = p;
+  }
+  qsort(prefixes, num_prefixes, sizeof(*prefixes), lpm_prefix_cmp);
+
+  size_t unique = 0;
+  for (size_t i = 0; i < num_prefixes; ++i)
+    if (unique == 0 || lpm_prefix_cmp(&prefixes[unique - 1], &prefixes[i]))
+      prefixes[unique++] = prefixes[i];
+
+  if (unique && unique == prev->num_prefixes &&
+      memcmp(prefixes, prev->prefixes, unique * sizeof(*prefixes)) == 0) {
+    free(prefixes);
+    *lpm = *prev;
+    return true;
+  }
+  return lpm_build(lpm, prefixes, unique);
+}
+
+// Builds `cls` from `rules`, reusing the prefix length tables of `prev` that
+// did not change. Returns false on allocation failure, in which case `cls` is
+// left empty.
+static bool classifier_build(classifier_t *cls, const blacklist_rule_t *rules,
+                             size_t num_rules, const classifier_t *prev) {
+  memset(cls, 0, sizeof(*cls));
+  if (num_rules == 0) return true;
+
+  // Normalize (mask addresses, drop empty ranges) and sort so that rules
+  // sharing a tuple and a key are adjacent.
+  blacklist_rule_t *sorted = malloc(num_rules * sizeof(*sorted));
+  if (!sorted) return false;
+  size_t n = 0;
+  for (size_t i = 0; i < num_rules; ++i) {
+    blacklist_rule_t r = rules[i];
+    if (r.start_port > r.end_port) continue;  // never matches
+    if (r.src_len > 32) r.src_len = 32;
+    if (r.dest_len > 32) r.dest_len = 32;
+    r.srcip &= prefix_mask(r.src_len);
+    r.destip &= prefix_mask(r.dest_len);
+    sorted[n++] = r;
+  }
+  qsort(sorted, n, sizeof(*sorted), blacklist_rule_cmp);
+
+  // Upper bounds: at most one tuple and one range per rule
+  memset(cls->tuple_of, 0xff, sizeof(cls->tuple_of));
+  cls->tuples = calloc(n ? n : 1, sizeof(tuple_t));
+  cls->ranges = malloc((n ? n : 1) * sizeof(port_range_t));
+  STATS(cls->refs = malloc((n ? n : 1) * sizeof(rule_ref_t));)
+  if (!cls->tuples || !cls->ranges STATS(|| !cls->refs)) goto fail;
+
+  size_t slots_capacity = 0;
+  size_t i = 0;
+  while (i < n) {
+    // [i, tuple_end) share the same (src_len, dest_len)
+    size_t tuple_end = i;
+    size_t num_keys = 0;
+    while (tuple_end < n && sorted[tuple_end].src_len == sorted[i].src_len &&
+           sorted[tuple_end].dest_len == sorted[i].dest_len) {
+      if (tuple_end == i ||
+          !same_key(&sorted[tuple_end - 1], &sorted[tuple_end]))
+        ++num_keys;
+      ++tuple_end;
+    }
+
+    cls->tuple_of[sorted[i].src_len][sorted[i].dest_len] =
+        (int32_t)cls->num_tuples;
+    cls->src_lens |= (uint64_t)1 << sorted[i].src_len;
+    cls->dest_lens |= (uint64_t)1 << sorted[i].dest_len;
+    tuple_t *t = &cls->tuples[cls->num_tuples++];
+    t->src_len = sorted[i].src_len;
+    t->dest_len = sorted[i].dest_len;
+    t->src_mask = prefix_mask(t->src_len);
+    t->dest_mask = prefix_mask(t->dest_len);
+    size_t num_slots = 4;
+    while (num_slots < 2 * num_keys) num_slots *= 2;  // load factor <= 0.5
+    if (!ensure_capacity((void **)&cls->slots, &slots_capacity,
+                         cls->num_slots + num_slots, sizeof(tuple_entry_t)))
+      goto fail;
+    memset(&cls->slots[cls->num_slots], 0, num_slots * sizeof(tuple_entry_t));
+    t->slots_start = cls->num_slots;
+    t->slot_mask = num_slots - 1;
+    cls->num_slots += num_slots;
+    tuple_entry_t *slots = &cls->slots[t->slots_start];
+
+    while (i < tuple_end) {
+      size_t key_end = i + 1;
+      while (key_end < tuple_end && same_key(&sorted[i], &sorted[key_end]))
+        ++key_end;
+
+      // Merge overlapping/adjacent ranges, input is sorted by start_port
+      uint32_t start = (uint32_t)cls->num_ranges;
+      for (size_t k = i; k < key_end; ++k) {
+        port_range_t *last = cls->num_ranges > start
+                                 ? &cls->ranges[cls->num_ranges - 1]
+                                 : NULL;
+        if (last && (uint32_t)sorted[k].start_port <= (uint32_t)last->hi + 1) {
+          if (sorted[k].end_port > last->hi) last->hi = sorted[k].end_port;
+        } else {
+          cls->ranges[cls->num_ranges++] =
+              (port_range_t){sorted[k].start_port, sorted[k].end_port};
+        }
+      }
+
+      uint64_t h = tuple_hash((uint8_t)sorted[i].proto, sorted[i].srcip,
+                              sorted[i].destip);
+      size_t slot = h & t->slot_mask;
+      while (slots[slot].used) slot = (slot + 1) & t->slot_mask;
+      slots[slot] = (tuple_entry_t){
+          .src = sorted[i].srcip,
+          .dest = sorted[i].destip,
+          .proto = (uint8_t)sorted[i].proto,
+          .used = true,
+          .ranges_start = start,
+          .ranges_count = (uint32_t)cls->num_ranges - start,
+          STATS(.refs_start = (uint32_t)i,
+                .refs_count = (uint32_t)(key_end - i), )
+      };
+      STATS(for (size_t k = i; k < key_end; ++k) cls->refs[k] = (rule_ref_t){
+                {sorted[k].start_port, sorted[k].end_port}, sorted[k].id};)
+      i = key_end;
+    }
+  }
+
+  STATS(cls->num_refs = n;)
+  classifier_build_lpm(&cls->src_lpm, sorted, n, true, &prev->src_lpm);
+  classifier_build_lpm(&cls->dest_lpm, sorted, n, false, &prev->dest_lpm);
+  free(sorted);
+  return true;
+
+fail:
+  free(sorted);
+  classifier_free(cls);
+  return false;
+}
+
+static bool ranges_contain(const port_range_t *ranges, size_t count,
+                           port_t port) {
+  size_t lo = 0, hi = count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (port < ranges[mid].lo) {
+      hi = mid;
+    } else if (port > ranges[mid].hi) {
+      lo = mid + 1;
+    } else {
+      return true;
+    }
+  }
+  return false;
+}
+
+static inline size_t tuple_slot(const tuple_t *t, protocol_t proto,
+                                ipaddr_t src, ipaddr_t dest) {
+  return tuple_hash((uint8_t)proto, src & t->src_mask, dest & t->dest_mask) &
+         t->slot_mask;
+}
+
+// Probes tuple `t` starting at `slot` (see tuple_slot), returns the matching
+// entry or NULL
+static const tuple_entry_t *tuple_match(const classifier_t *cls,
+                                        const tuple_t *t, size_t slot,
+                                        protocol_t proto, ipaddr_t src,
+                                        ipaddr_t dest, port_t dest_port) {
+  ipaddr_t s = src & t->src_mask;
+  ipaddr_t d = dest & t->dest_mask;
+  const tuple_entry_t *slots = &cls->slots[t->slots_start];
+  while (slots[slot].used) {
+    const tuple_entry_t *e = &slots[slot];
+    if (e->src == s && e->dest == d && e->proto == (uint8_t)proto) {
+      // Keys are unique within a tuple
+      return ranges_contain(&cls->ranges[e->ranges_start], e->ranges_count,
+                            dest_port)
+                 ? e
+                 : NULL;
+    }
+    slot = (slot + 1) & t->slot_mask;
+  }
+  return NULL;
+}
+
+#ifdef FIREWALL_STATS
+// Returns the first added rule of the matching entry `e` containing `port`
+static uint32_t tuple_entry_rule(const classifier_t *cls,
+                                 const tuple_entry_t *e, port_t port) {
+  uint32_t rule = UINT32_MAX;
+  for (uint32_t i = e->refs_start; i < e->refs_start + e->refs_count; ++i) {
+    const rule_ref_t *ref = &cls->refs[i];
+    if (ref->range.lo <= port && port <= ref->range.hi && ref->rule < rule)
+      rule = ref->rule;
+  }
+  return rule;
+}
+#endif
+
+// Whether some rule prefix of tuple `t` may contain the addresses whose
+// length sets (see lpm_lookup) are `src_lens` and `dest_lens`
+static inline bool tuple_candidate(const tuple_t *t, uint64_t src_lens,
+                                   uint64_t dest_lens) {
+  return (src_lens >> t->src_len & dest_lens >> t->dest_len & 1) != 0;
+}
+
+static const tuple_entry_t *classifier_match(const classifier_t *cls,
+                                             protocol_t proto, ipaddr_t src,
+                                             ipaddr_t dest, port_t dest_port) {
+  if (cls->num_tuples == 0) return NULL;
+
+  // Only visit the (src_len, dest_len) pairs allowed by both length sets
+  uint64_t src_lens = lpm_lookup(&cls->src_lpm, src) & cls->src_lens;
+  uint64_t dest_lens = lpm_lookup(&cls->dest_lpm, dest) & cls->dest_lens;
+  for (; src_lens; src_lens &= src_lens - 1) {
+    const int32_t *row = cls->tuple_of[__builtin_ctzll(src_lens)];
+    for (uint64_t d = dest_lens; d; d &= d - 1) {
+      int32_t i = row[__builtin_ctzll(d)];
+      if (i < 0) continue;
+      const tuple_t *t = &cls->tuples[i];
+      const tuple_entry_t *e = tuple_match(
+          cls, t, tuple_slot(t, proto, src, dest), proto, src, dest, dest_port);
+      if (e) return e;
+    }
+  }
+  return NULL;
+}
+
+// ==========================================
+//         CONTENT MATCHER (HASH SET)
+// ==========================================
+
+/**
+ * Content rules match when the whole payload equals a pattern, so the set of
+ * patterns is compiled into a flat open-addressing table of
+ * (hash, length, offset) slots pointing into one contiguous byte pool. A
+ * payload is hashed exactly once and then verified with a single memcmp,
+ * whatever the number of patterns.
+ *
+ * Only a payload as long as some pattern can match, so a bitmap of the
+ * pattern lengths rejects the others before they are hashed. Patterns are
+ * typically a few bytes long and most payloads are not, which leaves the
+ * hash to the few packets that may match.
+ */
+
+typedef struct {
+  uint64_t hash;  // 0 marks an empty slot
+  uint32_t len;
+  uint32_t offset;        // into content_matcher_t.pool
+  STATS(uint32_t rule;)  // first added rule with this pattern
+} content_slot_t;
+
+typedef struct {
+  content_slot_t *slots;
+  size_t slot_mask;
+  uint8_t *pool;
+  uint64_t *len_bits;  // bit n set if some pattern is n bytes long
+  size_t max_len;
+} content_matcher_t;
+
+// Hashes 8 bytes at a time, never returns 0
+static uint64_t hash_bytes(const uint8_t *data, size_t len) {
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    h ^= word * 0xff51afd7ed558ccdULL;
+    h = (h << 27 | h >> 37) * 0x9e3779b97f4a7c15ULL;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, data + i, len - i);
+  h = mix64(h ^ tail);
+  return h ? h : 1;
+}
+
+static void content_matcher_free(content_matcher_t *m) {
+  free(m->slots);
+  free(m->pool);
+  free(m->len_bits);
+  memset(m, 0, sizeof(*m));
+}
+
+// Builds `m` from `rules`. Returns false on allocation failure, in which case
+// `m` is left empty.
+static bool content_matcher_build(content_matcher_t *m,
+                                  const content_rule_t *rules,
+                                  size_t num_rules) {
+  memset(m, 0, sizeof(*m));
+  if (num_rules == 0) return true;
+
+  size_t pool_size = 0;
+  for (size_t i = 0; i < num_rules; ++i) {
+    pool_size += rules[i].len;
+    if (rules[i].len > m->max_len) m->max_len = rules[i].len;
+  }
+  if (pool_size > UINT32_MAX) return false;
+
+  size_t num_slots = 4;
+  while (num_slots < 2 * num_rules) num_slots *= 2;  // load factor <= 0.5
+  m->slots = calloc(num_slots, sizeof(content_slot_t));
+  m->pool = malloc(pool_size ? pool_size : 1);
+  m->len_bits = calloc(m->max_len / 64 + 1, sizeof(uint64_t));
+  if (!m->slots || !m->pool || !m->len_bits) {
+    content_matcher_free(m);
+    return false;
+  }
+  m->slot_mask = num_slots - 1;
+  for (size_t i = 0; i < num_rules; ++i)
+    m->len_bits[rules[i].len / 64] |= (uint64_t)1 << (rules[i].len % 64);
+
+  uint32_t used = 0;
+  for (size_t i = 0; i < num_rules; ++i) {
+    const content_rule_t *rule = &rules[i];
+    uint64_t h = hash_bytes(rule->data, rule->len);
+    size_t slot = h & m->slot_mask;
+    bool duplicate = false;
+    while (m->slots[slot].hash) {
+      const content_slot_t *s = &m->slots[slot];
+      if (s->hash == h && s->len == rule->len &&
+          memcmp(m->pool + s->offset, rule->data, rule->len) == 0) {
+        duplicate = true;
+        break;
+      }
+      slot = (slot + 1) & m->slot_mask;
+    }
+    if (duplicate) continue;
+
+    memcpy(m->pool + used, rule->data, rule->len);
+    m->slots[slot] = (content_slot_t){h, (uint32_t)rule->len, used,
+                                      STATS((uint32_t)i)};
+    used += (uint32_t)rule->len;
+  }
+  return true;
+}
+
+// Whether some pattern is `len` bytes long, false if there are no patterns
+static inline bool content_matcher_candidate(const content_matcher_t *m,
+                                             size_t len) {
+  return m->slots && len <= m->max_len &&
+         (m->len_bits[len / 64] >> (len % 64) & 1);
+}
+
+// Returns the slot of the pattern equal to `payload`, or NULL. `hash` must be
+// hash_bytes(payload, payload_len).
+static const content_slot_t *content_matcher_lookup(const content_matcher_t *m,
+                                                    uint64_t hash,
+                                                    const uint8_t *payload,
+                                                    size_t payload_len) {
+  if (!m->slots || payload_len > UINT32_MAX) return NULL;
+
+  size_t slot = hash & m->slot_mask;
+  while (m->slots[slot].hash) {
+    const content_slot_t *s = &m->slots[slot];
+    if (s->hash == hash && s->len == payload_len &&
+        memcmp(m->pool + s->offset, payload, payload_len) == 0)
+      return s;
+    slot = (slot + 1) & m->slot_mask;
+  }
+  return NULL;
+}
+
+static const content_slot_t *content_matcher_match(const content_matcher_t *m,
+                                                   const uint8_t *payload,
+                                                   size_t payload_len) {
+  if (!content_matcher_candidate(m, payload_len)) return NULL;
+  return content_matcher_lookup(m, hash_bytes(payload, payload_len), payload,
+                                payload_len);
+}
+
+// ==========================================
+//      STREAM MATCHER (AHO-CORASICK)
+// ==========================================
+
+/**
+ * Stream rules match a pattern anywhere in the byte stream of a TCP flow, also
+ * when it is split across segments. The patterns are compiled into an
+ * Aho-Corasick automaton with a dense transition table, so matching is one
+ * table load per byte and the whole per-flow matcher state is the current
+ * state: it carries over between segments without reassembly.
+ *
+ * Bytes that occur in no pattern share one column of the table (byte
+ * classes), which keeps it at states x distinct pattern bytes. States are
+ * stored as row offsets and the states where some pattern ends are numbered
+ * last, so the byte loop is a load and an add, and spotting a match is a
+ * comparison off that dependency chain. The table takes 4 bytes per state
+ * and class, up to 1KB per pattern byte, which suits rule sets of up to a few
+ * thousand patterns.
+ */
+
+#define STREAM_NONE UINT32_MAX
+
+typedef struct {
+  uint32_t *next;  // row offset of the state, plus the byte class
+  uint8_t classes[256];
+  uint32_t num_classes;
+  uint32_t num_states;
+  uint32_t accept_base;    // row offset of the first accepting state
+  uint32_t generation;     // set when published, never 0
+  STATS(uint32_t *rules;)  // per state, first added rule ending there
+} stream_matcher_t;
+
+static void stream_matcher_free(stream_matcher_t *m) {
+  free(m->next);
+  STATS(free(m->rules);)
+  memset(m, 0, sizeof(*m));
+}
+
+// Builds `m` from `rules`, empty patterns never match. Returns false on
+// allocation failure or if the automaton gets too large, in which case `m`
+// is left empty.
+static bool stream_matcher_build(stream_matcher_t *m,
+                                 const content_rule_t *rules,
+                                 size_t num_rules) {
+  memset(m, 0, sizeof(*m));
+  size_t max_states = 1;
+  bool used[256] = {false};
+  for (size_t i = 0; i < num_rules; ++i) {
+    max_states += rules[i].len;
+    for (size_t j = 0; j < rules[i].len; ++j) used[rules[i].data[j]] = true;
+  }
+  if (max_states == 1) return true;
+
+  uint32_t nc = 1;  // class 0 is for the bytes in no pattern
+  for (size_t b = 0; b < 256; ++b) m->classes[b] = used[b] ? nc++ : 0;
+  m->num_classes = nc;
+  if (max_states > (STREAM_NONE - 1) / nc) return false;
+
+  // Trie first, 0 marks a missing child as the root is nobody's child
+  uint32_t *next = calloc(max_states * nc, sizeof(uint32_t));
+  uint32_t *fail = malloc(max_states * sizeof(uint32_t));
+  uint32_t *queue = malloc(max_states * sizeof(uint32_t));
+  bool *accept = calloc(max_states, sizeof(bool));
+  STATS(m->rules = malloc(max_states * sizeof(uint32_t));)
+  bool ok = next && fail && queue && accept STATS(&& m->rules);
+  size_t num_states = 1;
+  for (size_t i = 0; ok && i < num_rules; ++i) {
+    if (rules[i].len == 0) continue;
+    size_t s = 0;
+    for (size_t j = 0; j < rules[i].len; ++j) {
+      uint32_t *child = &next[s * nc + m->classes[rules[i].data[j]]];
+      if (*child == 0) *child = (uint32_t)num_states++;
+      s = *child;
+    }
+    STATS(if (!accept[s]) m->rules[s] = (uint32_t)i;)
+    accept[s] = true;
+  }
+
+  // Breadth first, every state's fail state is shallower and complete. The
+  // missing transitions of a state are those of its fail state.
+  size_t head = 0, tail = 0;
+  for (uint32_t c = 0; ok && c < nc; ++c) {
+    if (next[c] == 0) continue;
+    fail[next[c]] = 0;
+    queue[tail++] = next[c];
+  }
+  while (ok && head < tail) {
+    uint32_t s = queue[head++];
+#ifdef FIREWALL_STATS
+    uint32_t inherited = accept[fail[s]] ? m->rules[fail[s]] : STREAM_NONE;
+    if (!accept[s] || inherited < m->rules[s]) m->rules[s] = inherited;
+#endif
+    accept[s] = accept[s] || accept[fail[s]];
+    for (uint32_t c = 0; c < nc; ++c) {
+      uint32_t *child = &next[s * nc + c];
+      uint32_t via_fail = next[fail[s] * nc + c];
+      if (*child == 0) {
+        *child = via_fail;
+      } else {
+        fail[*child] = via_fail;
+        queue[tail++] = *child;
+      }
+    }
+  }
+
+  // Renumber the states, accepting ones last, and make them row offsets.
+  // The root stays state 0.
+  uint32_t *order = queue;
+  if (ok) {
+    uint32_t id = 0;
+    for (size_t s = 0; s < num_states; ++s)
+      if (!accept[s]) order[s] = id++;
+    m->accept_base = id * nc;
+    for (size_t s = 0; s < num_states; ++s)
+      if (accept[s]) order[s] = id++;
+    m->next = malloc(num_states * nc * sizeof(uint32_t));
+    m->num_states = (uint32_t)num_states;
+    ok = m->next != NULL;
+  }
+  for (size_t s = 0; ok && s < num_states; ++s) {
+    for (uint32_t c = 0; c < nc; ++c)
+      m->next[order[s] * nc + c] = order[next[s * nc + c]] * nc;
+    STATS(fail[order[s]] = m->rules[s];)
+  }
+  if (ok) {
+    STATS(memcpy(m->rules, fail, num_states * sizeof(uint32_t));)
+  } else {
+    stream_matcher_free(m);
+  }
+  free(next);
+  free(fail);
+  free(queue);
+  free(accept);
+  return ok;
+}
+
+// Feeds `len` bytes to the automaton from `*state`, which is updated. Returns
+// the first accepting state reached, or STREAM_NONE.
+static inline uint32_t stream_matcher_feed(const stream_matcher_t *m,
+                                           uint32_t *state,
+                                           const uint8_t *data, size_t len) {
+  uint32_t s = *state;
+  bool seen = false;
+  for (size_t i = 0; i < len; ++i) {
+    s = m->next[s + m->classes[data[i]]];
+    seen |= s >= m->accept_base;
+  }
+  if (!seen) {
+    *state = s;
+    return STREAM_NONE;
+  }
+  // Matches are rare, find the first one again
+  uint32_t end = s;
+  s = *state;
+  *state = end;
+  for (size_t i = 0;; ++i) {
+    s = m->next[s + m->classes[data[i]]];
+    if (s >= m->accept_base) return s;
+  }
+}
+
+#ifdef FIREWALL_STATS
+static inline uint32_t stream_matcher_rule(const stream_matcher_t *m,
+                                           uint32_t state) {
+  return m->rules[state / m->num_classes];
+}
+#endif
+
+// ==========================================
+//          RATE LIMIT FLOW TABLE
+// ==========================================
+
+/**
+ * Flow state lives in a pool of flow_t records that is grown by doubling, so
+ * there is no per-flow malloc and a flow keeps its index for its whole life.
+ * The index is an open-addressing (linear probing) table whose slots hold the
+ * 4-tuple inline next to the pool index, so a lookup compares keys without
+ * touching the pool. Deletions use backward shifting, there are no
+ * tombstones.
+ *
+ * Idle flows are reclaimed by a hierarchical timer wheel (see below) instead
+ * of scanning the table. Stream rules keep their per-flow matcher state in a
+ * second table of the same kind.
+ *
+ * A table can be bounded to max_flows flows. A new flow then takes over the
+ * record of an evicted one: a clock hand sweeps the pool FLOW_EVICT_SAMPLES
+ * records at a time and the least recently seen flow among them goes
+ * (sampled LRU), so eviction costs O(1) whatever the table size. The record
+ * keeps its pending timer, which fires no later than the new flow's deadline
+ * and simply reschedules it. A full bounded table has no released records
+ * (lowering the limit below the records in use drops the table), so every
+ * sampled record is a live flow.
+ */
+
+#define FLOW_NONE UINT32_MAX
+#define FLOW_TABLE_INITIAL_SLOTS 64
+#define FLOW_EVICT_SAMPLES 8
+
+// Upper bound of the memory used per flow: the record plus at most 8/3 index
+// slots, as the index doubles when it gets 3/4 full
+#define FLOW_BYTES (sizeof(flow_t) + 3 * sizeof(flow_slot_t))
+
+// Buckets count bytes in millionths, so that draining rate_bps bytes per
+// second over an elapsed time in microseconds is an exact integer product
+#define BUCKET_SCALE 1000000
+
+// Caps configured bursts so that a bucket plus any packet never overflows
+#define BUCKET_MAX_BURST (UINT64_MAX / 4 / BUCKET_SCALE)
+
+// Hierarchical timer wheel: WHEEL_LEVELS levels of WHEEL_SLOTS slots, level l
+// covers expiries less than WHEEL_SLOTS^(l+1) ticks away. One tick is
+// 2^WHEEL_TICK_SHIFT microseconds (~1ms), so the wheel spans ~4.8 hours;
+// longer timeouts fire early and are rescheduled. Each level keeps a bitmap
+// of its non-empty slots, one bit per slot.
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_TICK_SHIFT 10
+#define WHEEL_MAX_TICKS ((uint64_t)1 << (WHEEL_LEVELS * WHEEL_BITS))
+
+typedef struct {
+  ipaddr_t srcip;
+  ipaddr_t destip;
+  port_t srcport;
+  port_t destport;
+} flow_key_t;
+
+typedef struct {
+  flow_key_t key;
+  uint32_t timer_next;  // next flow in the same wheel slot, or free list
+  union {
+    uint64_t bucket;  // bytes currently in the bucket, times BUCKET_SCALE
+    struct {          // in stream tables, see STREAM MATCHER
+      uint32_t stream_state;
+      uint32_t stream_generation;  // of the matcher the state belongs to
+    };
+  };
+  uint64_t last_us;
+} flow_t;
+
+typedef struct {
+  flow_key_t key;
+  uint32_t flow;  // index into flow_table_t.flows, FLOW_NONE if empty
+} flow_slot_t;
+
+typedef struct {
+  uint32_t heads[WHEEL_LEVELS * WHEEL_SLOTS];
+  uint64_t occupied[WHEEL_LEVELS];  // bit s set if slot s has timers
+  uint64_t now_tick;  // every tick before now_tick has been processed
+  bool started;
+} timer_wheel_t;
+
+typedef struct {
+  flow_slot_t *slots;
+  size_t slot_mask;
+  size_t size;
+
+  flow_t *flows;
+  size_t flows_capacity;
+  size_t flows_used;   // high water mark, flows past it were never used
+  uint32_t free_list;  // released flows, linked through timer_next
+
+  size_t max_flows;     // 0 if unbounded
+  uint32_t clock_hand;  // next record sampled for eviction
+
+  // Written by the owning thread only, for firewall_flow_stats
+  _Atomic uint64_t num_flows;
+  _Atomic uint64_t evictions;
+
+  timer_wheel_t wheel;
+} flow_table_t;
+
+static inline uint64_t flow_hash(const flow_key_t *key) {
+  uint64_t ports = (uint64_t)key->srcport << 16 | key->destport;
+  return mix64(((uint64_t)key->srcip << 32 | key->destip) ^
+               ports * 0x9e3779b97f4a7c15ULL);
+}
+
+static inline bool flow_key_eq(const flow_key_t *a, const flow_key_t *b) {
+  return a->srcip == b->srcip && a->destip == b->destip &&
+         a->srcport == b->srcport && a->destport == b->destport;
+}
+
+// What is left of `bucket` after draining rate_bps bytes per second for
+// elapsed_us microseconds
+static inline uint64_t bucket_drain(uint64_t bucket, uint32_t rate_bps,
+                                    uint64_t elapsed_us) {
+  uint64_t drained;
+  if (__builtin_mul_overflow((uint64_t)rate_bps, elapsed_us, &drained) ||
+      drained >= bucket)
+    return 0;
+  return bucket - drained;
+}
+
+// Capacity of a bucket holding `burst_bytes`, one second of rate_bps if 0
+static inline uint64_t bucket_capacity(uint32_t rate_bps,
+                                       uint64_t burst_bytes) {
+  if (!burst_bytes) burst_bytes = rate_bps;
+  if (burst_bytes > BUCKET_MAX_BURST) burst_bytes = BUCKET_MAX_BURST;
+  return burst_bytes * BUCKET_SCALE;
+}
+
+// Frees all flows, the limit is kept and the eviction counter restarts
+static void flow_table_free(flow_table_t *table) {
+  size_t max_flows = table->max_flows;
+  free(table->slots);
+  free(table->flows);
+  memset(table, 0, sizeof(*table));
+  table->max_flows = max_flows;
+}
+
+static inline void flow_table_publish_size(flow_table_t *table) {
+  atomic_store_explicit(&table->num_flows, table->size, memory_order_relaxed);
+}
+
+static bool flow_table_init(flow_table_t *table) {
+  table->slots = malloc(FLOW_TABLE_INITIAL_SLOTS * sizeof(flow_slot_t));
+  if (!table->slots) return false;
+  for (size_t i = 0; i < FLOW_TABLE_INITIAL_SLOTS; ++i)
+    table->slots[i].flow = FLOW_NONE;
+  table->slot_mask = FLOW_TABLE_INITIAL_SLOTS - 1;
+  table->free_list = FLOW_NONE;
+  for (size_t i = 0; i < WHEEL_LEVELS * WHEEL_SLOTS; ++i)
+    table->wheel.heads[i] = FLOW_NONE;
+  return true;
+}
+
+static bool flow_table_grow_slots(flow_table_t *table) {
+  size_t num_slots = (table->slot_mask + 1) * 2;
+  flow_slot_t *slots = malloc(num_slots * sizeof(flow_slot_t));
+  if (!slots) return false;
+  for (size_t i = 0; i < num_slots; ++i) slots[i].flow = FLOW_NONE;
+
+  for (size_t i = 0; i <= table->slot_mask; ++i) {
+    if (table->slots[i].flow == FLOW_NONE) continue;
+    size_t j = flow_hash(&table->slots[i].key) & (num_slots - 1);
+    while (slots[j].flow != FLOW_NONE) j = (j + 1) & (num_slots - 1);
+    slots[j] = table->slots[i];
+  }
+  free(table->slots);
+  table->slots = slots;
+  table->slot_mask = num_slots - 1;
+  return true;
+}
+
+// Takes a flow record from the free list or the pool. Returns FLOW_NONE on
+// allocation failure.
+static uint32_t flow_table_alloc(flow_table_t *table) {
+  if (table->free_list != FLOW_NONE) {
+    uint32_t idx = table->free_list;
+    table->free_list = table->flows[idx].timer_next;
+    return idx;
+  }
+  if (table->flows_used == FLOW_NONE) return FLOW_NONE;
+  if (table->flows_used == table->flows_capacity) {
+    size_t capacity =
+        table->flows_capacity ? table->flows_capacity * 2 : INITIAL_CAPACITY;
+    // A bounded table never holds more than max_flows records
+    if (table->max_flows && capacity > table->max_flows)
+      capacity = table->max_flows;
+    flow_t *flows = realloc(table->flows, capacity * sizeof(flow_t));
+    if (!flows) return FLOW_NONE;
+    table->flows = flows;
+    table->flows_capacity = capacity;
+  }
+  return (uint32_t)table->flows_used++;
+}
+
+// Removes the index slot of `key`, shifting the following cluster back
+static void flow_table_remove_slot(flow_table_t *table, const flow_key_t *key) {
+  size_t i = flow_hash(key) & table->slot_mask;
+  while (!flow_key_eq(&table->slots[i].key, key))
+    i = (i + 1) & table->slot_mask;
+
+  size_t j = i;
+  for (;;) {
+    j = (j + 1) & table->slot_mask;
+    if (table->slots[j].flow == FLOW_NONE) break;
+    size_t home = flow_hash(&table->slots[j].key) & table->slot_mask;
+    // Move slot j into the hole at i unless its home lies in (i, j]
+    bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+    if (!stays) {
+      table->slots[i] = table->slots[j];
+      i = j;
+    }
+  }
+  table->slots[i].flow = FLOW_NONE;
+  --table->size;
+  flow_table_publish_size(table);
+}
+
+// Evicts one of the least recently seen flows of a full table and returns its
+// record, which is still linked in the wheel
+static uint32_t flow_table_evict(flow_table_t *table) {
+  uint32_t victim = 0;
+  for (size_t n = 0; n < FLOW_EVICT_SAMPLES; ++n) {
+    uint32_t idx = table->clock_hand;
+    table->clock_hand = idx + 1 < table->flows_used ? idx + 1 : 0;
+    if (n == 0 || table->flows[idx].last_us < table->flows[victim].last_us)
+      victim = idx;
+  }
+  flow_table_remove_slot(table, &table->flows[victim].key);
+  atomic_store_explicit(
+      &table->evictions,
+      atomic_load_explicit(&table->evictions, memory_order_relaxed) + 1,
+      memory_order_relaxed);
+  return victim;
+}
+
+// ==========================================
+//              TIMER WHEEL
+// ==========================================
+
+static void wheel_link(flow_table_t *table, uint32_t idx, uint64_t expires) {
+  timer_wheel_t *wheel = &table->wheel;
+  uint64_t now = wheel->now_tick;
+  if (expires < now) expires = now;
+  if (expires - now >= WHEEL_MAX_TICKS) expires = now + WHEEL_MAX_TICKS - 1;
+
+  uint64_t delta = expires - now;
+  int level = 0;
+  while (delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1))) ++level;
+  size_t slot = level * WHEEL_SLOTS +
+                ((expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+
+  // Timers are never cancelled, so singly linked lists are enough
+  table->flows[idx].timer_next = wheel->heads[slot];
+  wheel->heads[slot] = idx;
+  wheel->occupied[level] |= (uint64_t)1 << (slot % WHEEL_SLOTS);
+}
+
+static inline uint64_t flow_expiry_tick(const flow_t *flow,
+                                        uint64_t timeout_us) {
+  uint64_t deadline = flow->last_us + timeout_us;
+  if (deadline < flow->last_us) deadline = UINT64_MAX;  // saturate
+  return (deadline >> WHEEL_TICK_SHIFT) + 1;
+}
+
+// Detaches all flows of a wheel slot and returns the head of that list
+static uint32_t wheel_take(flow_table_t *table, size_t slot) {
+  uint32_t head = table->wheel.heads[slot];
+  table->wheel.heads[slot] = FLOW_NONE;
+  table->wheel.occupied[slot / WHEEL_SLOTS] &=
+      ~((uint64_t)1 << (slot % WHEEL_SLOTS));
+  return head;
+}
+
+static inline uint64_t rotate_right(uint64_t bits, unsigned n) {
+  return n ? bits >> n | bits << (64 - n) : bits;
+}
+
+// The first tick from `tick` on that fires a level 0 slot or cascades a
+// higher one holding timers, UINT64_MAX if the wheel is empty. The ticks
+// before it have nothing to do.
+static uint64_t wheel_next_tick(const timer_wheel_t *wheel, uint64_t tick) {
+  uint64_t next = UINT64_MAX;
+  for (int level = 0; level < WHEEL_LEVELS; ++level) {
+    uint64_t bits = wheel->occupied[level];
+    if (!bits) continue;
+    // Level l takes its slots on the ticks that are multiples of 64^l
+    int shift = WHEEL_BITS * level;
+    uint64_t turn = (tick + ((uint64_t)1 << shift) - 1) >> shift;
+    turn += __builtin_ctzll(rotate_right(bits, turn % WHEEL_SLOTS));
+    if (turn << shift < next) next = turn << shift;
+  }
+  return next;
+}
+
+// Moves the wheel to `tick`, more than a whole span ahead, by linking all its
+// timers anew. Those due by then land in the slot of `tick`.
+static void wheel_jump(flow_table_t *table, uint64_t tick,
+                       uint64_t timeout_us) {
+  uint32_t timers = FLOW_NONE;
+  for (size_t slot = 0; slot < WHEEL_LEVELS * WHEEL_SLOTS; ++slot) {
+    uint32_t idx = wheel_take(table, slot);
+    while (idx != FLOW_NONE) {
+      uint32_t next = table->flows[idx].timer_next;
+      table->flows[idx].timer_next = timers;
+      timers = idx;
+      idx = next;
+    }
+  }
+  table->wheel.now_tick = tick;
+  while (timers != FLOW_NONE) {
+    uint32_t next = table->flows[timers].timer_next;
+    wheel_link(table, timers,
+               flow_expiry_tick(&table->flows[timers], timeout_us));
+    timers = next;
+  }
+}
+
+/**
+ * Advances the wheel to `now`. Timers are not moved when a flow sees traffic,
+ * so a firing timer only means the flow *may* be idle: flows that are idle
+ * for longer than `timeout_us` are released, the others are rescheduled at
+ * their new deadline. Every flow is touched O(1) times per timeout period.
+ * Ticks without timers to fire or cascade are skipped using the occupancy
+ * bitmaps, and a jump past the span of the wheel relinks every timer once,
+ * so the cost does not grow with the time between packets.
+ */
+static void flow_table_expire(flow_table_t *table, uint64_t now,
+                              uint64_t timeout_us) {
+  timer_wheel_t *wheel = &table->wheel;
+  uint64_t target = now >> WHEEL_TICK_SHIFT;
+  if (!wheel->started || table->size == 0) {
+    wheel->now_tick = target;
+    wheel->started = true;
+    return;
+  }
+
+  if (wheel->now_tick <= target && target - wheel->now_tick >= WHEEL_MAX_TICKS)
+    wheel_jump(table, target, timeout_us);
+
+  while (table->size > 0) {
+    uint64_t tick = wheel_next_tick(wheel, wheel->now_tick);
+    if (tick > target) break;
+    wheel->now_tick = tick;
+
+    // Cascade higher levels whose current slot comes due
+    for (int level = 1; level < WHEEL_LEVELS; ++level) {
+      if ((tick >> (WHEEL_BITS * (level - 1))) & (WHEEL_SLOTS - 1)) break;
+      size_t slot = level * WHEEL_SLOTS +
+                    ((tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+      uint32_t idx = wheel_take(table, slot);
+      while (idx != FLOW_NONE) {
+        uint32_t next = table->flows[idx].timer_next;
+        wheel_link(table, idx,
+                   flow_expiry_tick(&table->flows[idx], timeout_us));
+        idx = next;
+      }
+    }
+
+    uint32_t idx = wheel_take(table, tick & (WHEEL_SLOTS - 1));
+    while (idx != FLOW_NONE) {
+      flow_t *flow = &table->flows[idx];
+      uint32_t next = flow->timer_next;
+      if (now > flow->last_us && now - flow->last_us > timeout_us) {
+        flow_table_remove_slot(table, &flow->key);
+        flow->timer_next = table->free_list;
+        table->free_list = idx;
+      } else {
+        wheel_link(table, idx, flow_expiry_tick(flow, timeout_us));
+      }
+      idx = next;
+    }
+    wheel->now_tick = tick + 1;
+  }
+  if (wheel->now_tick <= target) wheel->now_tick = target + 1;
+}
+
+// Returns the flow for `key` (whose flow_hash is `hash`), inserting an empty
+// one if missing, which may evict another flow from a bounded table. Returns
+// NULL on allocation failure. The pointer is only valid until the next
+// insertion.
+static flow_t *flow_table_get(flow_table_t *table, const flow_key_t *key,
+                              uint64_t hash, uint64_t now,
+                              uint64_t timeout_us) {
+  if (!table->slots && !flow_table_init(table)) return NULL;
+
+  size_t i = hash & table->slot_mask;
+  while (table->slots[i].flow != FLOW_NONE) {
+    if (flow_key_eq(&table->slots[i].key, key))
+      return &table->flows[table->slots[i].flow];
+    i = (i + 1) & table->slot_mask;
+  }
+
+  uint32_t idx;
+  bool evicted = table->max_flows && table->size >= table->max_flows;
+  if (evicted) {
+    idx = flow_table_evict(table);
+    // The removal may have shifted the probe sequence of `key`
+    i = hash & table->slot_mask;
+    while (table->slots[i].flow != FLOW_NONE) i = (i + 1) & table->slot_mask;
+  } else {
+    // Keep the load factor below 3/4
+    if ((table->size + 1) * 4 > (table->slot_mask + 1) * 3) {
+      if (!flow_table_grow_slots(table)) return NULL;
+      i = hash & table->slot_mask;
+      while (table->slots[i].flow != FLOW_NONE)
+        i = (i + 1) & table->slot_mask;
+    }
+    idx = flow_table_alloc(table);
+    if (idx == FLOW_NONE) return NULL;
+  }
+  table->slots[i] = (flow_slot_t){*key, idx};
+  ++table->size;
+  flow_table_publish_size(table);
+
+  flow_t *flow = &table->flows[idx];
+  flow->key = *key;
+  flow->bucket = 0;
+  flow->last_us = now;
+  if (!evicted) wheel_link(table, idx, flow_expiry_tick(flow, timeout_us));
+  return flow;
+}
+
+// ==========================================
+//          RATE LIMIT SOURCE TABLE
+// ==========================================
+
+/**
+ * Aggregate buckets per source address, see
+ * firewall_configure_source_ratelimit. They live inline in an open
+ * addressing (linear probing) table keyed by the address alone, 24 bytes per
+ * source, without a pool, an index or timers: a bucket that has drained
+ * empty is the same as a missing one, so idle sources need no expiry. They
+ * stay in place, are reused if the source comes back and are dropped when
+ * the table gets 3/4 full, which rebuilds it at twice the size of the
+ * sources still holding bytes. That costs O(1) amortized per new source.
+ *
+ * A table bounded to max_sources entries makes room for a new source by
+ * removing the emptiest of the SOURCE_EVICT_SAMPLES sources following its
+ * home slot, with backward shifting like the flow index.
+ */
+
+#define SOURCE_TABLE_INITIAL_SLOTS 64
+#define SOURCE_EVICT_SAMPLES 8
+
+typedef struct {
+  ipaddr_t srcip;
+  bool used;
+  uint64_t last_us;
+  uint64_t bucket;  // like flow_t.bucket
+} source_t;
+
+typedef struct {
+  source_t *slots;
+  size_t slot_mask;
+  size_t size;         // used slots, including drained buckets
+  size_t max_sources;  // 0 if unbounded
+} source_table_t;
+
+static inline uint64_t source_hash(ipaddr_t srcip) { return mix64(srcip); }
+
+// Frees all sources, the limit is kept
+static void source_table_free(source_table_t *table) {
+  free(table->slots);
+  table->slots = NULL;
+  table->slot_mask = 0;
+  table->size = 0;
+}
+
+// Bytes left in the bucket of `source` at `now`, times BUCKET_SCALE
+static inline uint64_t source_level(const source_t *source, uint32_t rate_bps,
+                                    uint64_t now) {
+  uint64_t elapsed = now > source->last_us ? now - source->last_us : 0;
+  return bucket_drain(source->bucket, rate_bps, elapsed);
+}
+
+// Moves the sources whose buckets still hold bytes into a new table with
+// room for as many again. Returns false on allocation failure.
+static bool source_table_rebuild(source_table_t *table, uint32_t rate_bps,
+                                 uint64_t now) {
+  size_t live = 0;
+  for (size_t i = 0; table->slots && i <= table->slot_mask; ++i)
+    live += table->slots[i].used &&
+            source_level(&table->slots[i], rate_bps, now) > 0;
+  size_t num_slots = SOURCE_TABLE_INITIAL_SLOTS;
+  while (num_slots < 2 * (live + 1)) num_slots *= 2;
+
+  source_t *slots = calloc(num_slots, sizeof(source_t));
+  if (!slots) return false;
+  for (size_t i = 0; table->slots && i <= table->slot_mask; ++i) {
+    const source_t *source = &table->slots[i];
+    if (!source->used || source_level(source, rate_bps, now) == 0) continue;
+    size_t j = source_hash(source->srcip) & (num_slots - 1);
+    while (slots[j].used) j = (j + 1) & (num_slots - 1);
+    slots[j] = *source;
+  }
+  free(table->slots);
+  table->slots = slots;
+  table->slot_mask = num_slots - 1;
+  table->size = live;
+  return true;
+}
+
+// Empties slot i, shifting the following cluster back
+static void source_table_remove(source_table_t *table, size_t i) {
+  size_t j = i;
+  for (;;) {
+    j = (j + 1) & table->slot_mask;
+    if (!table->slots[j].used) break;
+    size_t home = source_hash(table->slots[j].srcip) & table->slot_mask;
+    // Move slot j into the hole at i unless its home lies in (i, j]
+    bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+    if (!stays) {
+      table->slots[i] = table->slots[j];
+      i = j;
+    }
+  }
+  table->slots[i].used = false;
+  --table->size;
+}
+
+// Removes the emptiest of the sources from slot `start` on
+static void source_table_evict(source_table_t *table, size_t start,
+                               uint32_t rate_bps, uint64_t now) {
+  size_t samples =
+      table->size < SOURCE_EVICT_SAMPLES ? table->size : SOURCE_EVICT_SAMPLES;
+  size_t victim = start;
+  uint64_t lowest = UINT64_MAX;
+  for (size_t i = start, n = 0; n < samples && lowest > 0;
+       i = (i + 1) & table->slot_mask) {
+    if (!table->slots[i].used) continue;
+    uint64_t level = source_level(&table->slots[i], rate_bps, now);
+    if (level < lowest) {
+      lowest = level;
+      victim = i;
+    }
+    ++n;
+  }
+  source_table_remove(table, victim);
+}
+
+// Returns the source `srcip`, inserting an empty one if missing, which may
+// evict another source from a bounded table. Returns NULL on allocation
+// failure. The pointer is only valid until the next insertion.
+static source_t *source_table_get(source_table_t *table, ipaddr_t srcip,
+                                  uint32_t rate_bps, uint64_t now) {
+  uint64_t hash = source_hash(srcip);
+  size_t i = hash & table->slot_mask;
+  while (table->slots && table->slots[i].used) {
+    if (table->slots[i].srcip == srcip) return &table->slots[i];
+    i = (i + 1) & table->slot_mask;
+  }
+
+  if (table->max_sources && table->size >= table->max_sources)
+    source_table_evict(table, hash & table->slot_mask, rate_bps, now);
+  if ((table->size + 1) * 4 > (table->slot_mask + 1) * 3 &&
+      !source_table_rebuild(table, rate_bps, now))
+    return NULL;
+  // Evicting or rebuilding may have moved the probe sequence of `srcip`
+  i = hash & table->slot_mask;
+  while (table->slots[i].used) i = (i + 1) & table->slot_mask;
+
+  ++table->size;
+  table->slots[i] = (source_t){srcip, true, now, 0};
+  return &table->slots[i];
+}
+
+// ==========================================
+//               STATISTICS
+// ==========================================
+
+/**
+ * Builds with FIREWALL_STATS count the packets and bytes decided by every
+ * rule and the cycles spent in every stage. Counters live in per reader slot
+ * (shard) blocks on their own cache lines, and each slot is written by a
+ * single thread, so a relaxed load and store is enough to bump one; the
+ * snapshot reads them with relaxed loads while checks keep running.
+ *
+ * Rule counters belong to the rule set the check used. When a rule set is
+ * retired its counters are folded into the firewall wide totals, which are
+ * only accessed by the thread updating the rules.
+ *
+ * Without FIREWALL_STATS none of this is compiled in.
+ */
+
+#ifdef FIREWALL_STATS
+
+typedef enum {
+  RULE_MAC = 0,
+  RULE_BLACKLIST,
+  RULE_CONTENT,
+  RULE_STREAM,
+  NUM_RULE_KINDS,
+} rule_kind_t;
+
+#define RULE_NONE UINT32_MAX
+
+typedef struct {
+  _Atomic uint64_t packets;
+  _Atomic uint64_t bytes;
+} stats_counter_t;
+
+// Per reader slot counters that don't depend on the rule set
+typedef struct {
+  stats_counter_t ratelimit_drops;
+  _Atomic uint64_t stage_cycles[FIREWALL_NUM_STAGES];
+  _Atomic uint64_t stage_packets[FIREWALL_NUM_STAGES];
+} slot_stats_t;
+
+// Totals of retired rule sets and shards
+typedef struct {
+  firewall_counter_t *rules[NUM_RULE_KINDS];
+  size_t num_rules[NUM_RULE_KINDS];
+  firewall_counter_t ratelimit_drops;
+  uint64_t stage_cycles[FIREWALL_NUM_STAGES];
+  uint64_t stage_packets[FIREWALL_NUM_STAGES];
+} stats_totals_t;
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t stats_now(void) { return __builtin_ia32_rdtsc(); }
+#else
+static inline uint64_t stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+// Only the owning thread writes a counter, no atomic read-modify-write needed
+static inline void stats_bump(_Atomic uint64_t *counter, uint64_t n) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+      memory_order_relaxed);
+}
+
+static inline void stats_count(stats_counter_t *counter, size_t bytes) {
+  stats_bump(&counter->packets, 1);
+  stats_bump(&counter->bytes, bytes);
+}
+
+// Accounts the time since `*start` to `stage` and restarts the clock
+static inline void stats_stage(slot_stats_t *stats, firewall_stage_t stage,
+                               uint64_t *start, size_t packets) {
+  uint64_t now = stats_now();
+  stats_bump(&stats->stage_cycles[stage], now - *start);
+  stats_bump(&stats->stage_packets[stage], packets);
+  *start = now;
+}
+
+static inline void stats_add(firewall_counter_t *total,
+                             const stats_counter_t *counter) {
+  total->packets += atomic_load_explicit(&counter->packets,
+                                         memory_order_relaxed);
+  total->bytes += atomic_load_explicit(&counter->bytes, memory_order_relaxed);
+}
+
+// Grows the rule totals to `num_rules` counters of each kind
+static bool stats_totals_reserve(stats_totals_t *totals,
+                                 const size_t num_rules[NUM_RULE_KINDS]) {
+  for (size_t k = 0; k < NUM_RULE_KINDS; ++k) {
+    if (num_rules[k] <= totals->num_rules[k]) continue;
+    firewall_counter_t *grown =
+        realloc(totals->rules[k], num_rules[k] * sizeof(firewall_counter_t));
+    if (!grown) return false;
+    memset(grown + totals->num_rules[k], 0,
+           (num_rules[k] - totals->num_rules[k]) * sizeof(firewall_counter_t));
+    totals->rules[k] = grown;
+    totals->num_rules[k] = num_rules[k];
+  }
+  return true;
+}
+
+static void stats_add_slot(stats_totals_t *totals, const slot_stats_t *slot) {
+  stats_add(&totals->ratelimit_drops, &slot->ratelimit_drops);
+  for (size_t i = 0; i < FIREWALL_NUM_STAGES; ++i) {
+    totals->stage_cycles[i] +=
+        atomic_load_explicit(&slot->stage_cycles[i], memory_order_relaxed);
+    totals->stage_packets[i] +=
+        atomic_load_explicit(&slot->stage_packets[i], memory_order_relaxed);
+  }
+}
+
+#endif  // FIREWALL_STATS
+
+// ==========================================
+//              VERDICT CACHE
+// ==========================================
+
+/**
+ * Optional exact match cache of the stateless part of the verdict (MAC and
+ * blacklist stages), keyed by source MAC and 5-tuple, like the exact match
+ * cache of Open vSwitch. Long lived flows then skip classification after
+ * their first packet. Content and rate limit stages still run every time.
+ *
+ * The cache is direct mapped: a lookup is one hash and one entry compare, an
+ * insert overwrites whatever was in the slot. Entries are tagged with the
+ * generation of the rule set that computed them, which changes whenever a
+ * commit changes MAC or blacklist rules, so stale entries simply stop
+ * matching. Every reader slot (shard) has its own cache, only written by the
+ * thread checking packets in that slot.
+ */
+
+typedef struct {
+  uint64_t mac_proto;   // source MAC in the low 48 bits, protocol above
+  uint64_t addrs;       // source IP in the high half, destination IP below
+  uint32_t ports;       // source port in the high half, destination below
+  uint32_t generation;  // of the rule set, 0 marks an empty entry
+  uint8_t verdict;      // action_t
+  STATS(uint32_t mac_rule; uint32_t blacklist_rule;)  // RULE_NONE if none
+} verdict_entry_t;
+
+typedef struct {
+  verdict_entry_t *entries;  // NULL while the cache is disabled
+  size_t mask;
+} verdict_cache_t;
+
+static bool verdict_cache_init(verdict_cache_t *cache, size_t num_entries) {
+  cache->mask = 0;
+  cache->entries = NULL;
+  if (num_entries == 0) return true;
+  cache->entries = calloc(num_entries, sizeof(verdict_entry_t));
+  cache->mask = num_entries - 1;
+  return cache->entries != NULL;
+}
+
+static void verdict_cache_free(verdict_cache_t *cache) {
+  free(cache->entries);
+  cache->entries = NULL;
+}
+
+static inline bool verdict_entry_match(const verdict_entry_t *e,
+                                       const verdict_entry_t *key) {
+  return e->mac_proto == key->mac_proto && e->addrs == key->addrs &&
+         e->ports == key->ports && e->generation == key->generation;
+}
+
+// The entry `key` maps to, which holds its verdict if verdict_entry_match
+static inline verdict_entry_t *verdict_cache_slot(const verdict_cache_t *cache,
+                                                  const verdict_entry_t *key) {
+  uint64_t h = mix64(key->mac_proto ^ key->addrs * 0x9e3779b97f4a7c15ULL ^
+                     ((uint64_t)key->ports << 32 | key->generation));
+  return &cache->entries[h & cache->mask];
+}
+
+// ==========================================
+//                 SHARDS
+// ==========================================
+
+/**
+ * The rate-limit flow state is split into shards, a flow belongs to the shard
+ * picked by a symmetric hash of its 4-tuple (both directions of a connection
+ * map to the same shard, like symmetric RSS). Each shard is owned by one
+ * worker thread and sits on its own cache lines, the rule tables are shared
+ * read-only, so the packet path needs no locks.
+ *
+ * A shard is also the reader slot of its worker for rule set updates, see
+ * RULE SETS.
+ */
+
+#define CACHE_LINE_SIZE 64
+
+typedef struct {
+  alignas(CACHE_LINE_SIZE) flow_table_t flows;
+  _Atomic uint64_t reader_epoch;  // 0 while the worker is outside a check
+  verdict_cache_t verdicts;
+  flow_table_t streams;  // stream rule matcher states
+  source_table_t sources;
+  STATS(slot_stats_t stats;)
+} shard_t;
+
+static void shards_free(shard_t *shards, size_t num_shards) {
+  if (!shards) return;
+  for (size_t i = 0; i < num_shards; ++i) {
+    flow_table_free(&shards[i].flows);
+    flow_table_free(&shards[i].streams);
+    source_table_free(&shards[i].sources);
+    verdict_cache_free(&shards[i].verdicts);
+  }
+  free(shards);
+}
+
+// Shards with verdict caches of `cache_entries` entries, 0 for none
+static shard_t *shards_create(size_t num_shards, size_t cache_entries) {
+  shard_t *shards =
+      aligned_alloc(CACHE_LINE_SIZE, num_shards * sizeof(shard_t));
+  if (!shards) return NULL;
+  memset(shards, 0, num_shards * sizeof(shard_t));
+  bool ok = true;
+  for (size_t i = 0; i < num_shards; ++i) {
+    atomic_init(&shards[i].reader_epoch, 0);
+    ok = ok && verdict_cache_init(&shards[i].verdicts, cache_entries);
+  }
+  if (!ok) {
+    shards_free(shards, num_shards);
+    return NULL;
+  }
+  return shards;
+}
+
+// Every shard gets an equal share of a flow limit, at least one flow
+static inline size_t shard_flow_limit(size_t max_flows, size_t num_shards) {
+  if (!max_flows) return 0;
+  return max_flows / num_shards ? max_flows / num_shards : 1;
+}
+
+static inline size_t shard_of(const flow_key_t *key, size_t num_shards) {
+  if (num_shards == 1) return 0;
+  ipaddr_t ip_lo = key->srcip < key->destip ? key->srcip : key->destip;
+  ipaddr_t ip_hi = key->srcip ^ key->destip ^ ip_lo;
+  port_t port_lo = key->srcport < key->destport ? key->srcport : key->destport;
+  port_t port_hi = key->srcport ^ key->destport ^ port_lo;
+  uint64_t ports = (uint64_t)port_lo << 16 | port_hi;
+  uint64_t h =
+      mix64(((uint64_t)ip_lo << 32 | ip_hi) ^ ports * 0x9e3779b97f4a7c15ULL);
+  return (size_t)((h >> 32) * num_shards >> 32);
+}
+
+// ==========================================
+//                RULE SETS
+// ==========================================
+
+/**
+ * Packet checks read the rules through an immutable compiled rule set.
+ * firewall_commit compiles the staged rules into a new rule set and
+ * publishes it with a single atomic pointer swap (RCU style): checks on other
+ * threads never block and see either the old or the new rules.
+ *
+ * Grace periods are tracked with epochs. A check stores the current epoch in
+ * its reader slot before loading the rule set pointer, and clears the slot
+ * when it is done. After the swap the writer bumps the epoch and waits until
+ * every slot is either clear or newer, at which point no check can still use
+ * the old rule set.
+ *
+ * Components that did not change are moved to the new rule set instead of
+ * being rebuilt, `owned` tells which ones a rule set has to free. The prefix
+ * length tables of a rebuilt classifier can still be moved over, if their
+ * prefixes stayed the same.
+ */
+
+#define RULESET_OWNS_MAC (1u << 0)
+#define RULESET_OWNS_CLASSIFIER (1u << 1)
+#define RULESET_OWNS_CONTENT (1u << 2)
+#define RULESET_OWNS_STREAM (1u << 3)
+#define RULESET_OWNS_SRC_LPM (1u << 4)
+#define RULESET_OWNS_DEST_LPM (1u << 5)
+#define RULESET_OWNS_LPMS (RULESET_OWNS_SRC_LPM | RULESET_OWNS_DEST_LPM)
+#define RULESET_OWNS_ALL                                               \
+  (RULESET_OWNS_MAC | RULESET_OWNS_CLASSIFIER | RULESET_OWNS_CONTENT | \
+   RULESET_OWNS_STREAM | RULESET_OWNS_LPMS)
+
+typedef struct {
+  mac_table_t mac_rules;
+  classifier_t classifier;
+  content_matcher_t content_matcher;
+  stream_matcher_t stream_matcher;
+  bool ratelimit_enabled;
+  uint32_t rate_bps;
+  uint64_t burst_bytes;      // as configured, 0 for one second of rate_bps
+  uint64_t bucket_capacity;  // see bucket_capacity
+  uint64_t timeout_us;
+  uint32_t source_rate_bps;  // 0 if sources are not limited
+  uint64_t source_burst_bytes;
+  uint64_t source_capacity;
+  uint32_t generation;  // of the MAC and blacklist rules, see VERDICT CACHE
+  unsigned owned;       // RULESET_OWNS_* bits, only accessed by the writer
+#ifdef FIREWALL_STATS
+  stats_counter_t *counters;  // one block of counters_stride per reader slot
+  size_t counters_stride;
+  size_t num_rules[NUM_RULE_KINDS];  // rules of each kind when compiled
+  size_t rule_base[NUM_RULE_KINDS];  // counter index of the first rule
+#endif
+} ruleset_t;
+
+static void ruleset_free(ruleset_t *rules) {
+  if (!rules) return;
+  STATS(free(rules->counters);)
+  if (rules->owned & RULESET_OWNS_MAC) mac_table_free(&rules->mac_rules);
+  if (rules->owned & RULESET_OWNS_SRC_LPM)
+    lpm_free(&rules->classifier.src_lpm);
+  if (rules->owned & RULESET_OWNS_DEST_LPM)
+    lpm_free(&rules->classifier.dest_lpm);
+  if (rules->owned & RULESET_OWNS_CLASSIFIER)
+    classifier_free(&rules->classifier);
+  if (rules->owned & RULESET_OWNS_CONTENT)
+    content_matcher_free(&rules->content_matcher);
+  if (rules->owned & RULESET_OWNS_STREAM)
+    stream_matcher_free(&rules->stream_matcher);
+  free(rules);
+}
+
+#ifdef FIREWALL_STATS
+// Allocates zeroed rule counters for `num_slots` reader slots
+static bool ruleset_stats_alloc(ruleset_t *rules,
+                                const size_t num_rules[NUM_RULE_KINDS],
+                                size_t num_slots) {
+  size_t total = 0;
+  for (size_t k = 0; k < NUM_RULE_KINDS; ++k) {
+    rules->num_rules[k] = num_rules[k];
+    rules->rule_base[k] = total;
+    total += num_rules[k];
+  }
+  // Whole cache lines per slot, so that slots never share one
+  size_t per_line = CACHE_LINE_SIZE / sizeof(stats_counter_t);
+  rules->counters_stride = (total + per_line - 1) / per_line * per_line;
+  size_t size = rules->counters_stride * num_slots * sizeof(stats_counter_t);
+  rules->counters =
+      aligned_alloc(CACHE_LINE_SIZE, size ? size : CACHE_LINE_SIZE);
+  if (!rules->counters) return false;
+  memset(rules->counters, 0, size);
+  return true;
+}
+
+static inline void ruleset_count(const ruleset_t *rules, size_t slot,
+                                 rule_kind_t kind, uint32_t rule,
+                                 size_t bytes) {
+  stats_count(&rules->counters[slot * rules->counters_stride +
+                               rules->rule_base[kind] + rule],
+              bytes);
+}
+
+// Adds the rule counters of `rules` to `out`, which must be large enough
+static void ruleset_stats_add(firewall_counter_t *out[NUM_RULE_KINDS],
+                              const ruleset_t *rules, size_t num_slots) {
+  for (size_t slot = 0; slot < num_slots; ++slot) {
+    const stats_counter_t *block =
+        &rules->counters[slot * rules->counters_stride];
+    for (size_t k = 0; k < NUM_RULE_KINDS; ++k) {
+      for (size_t i = 0; i < rules->num_rules[k]; ++i)
+        stats_add(&out[k][i], &block[rules->rule_base[k] + i]);
+    }
+  }
+}
+#endif
+
+// Waits until no reader slot holds an epoch older than `epoch`
+static void ruleset_synchronize(shard_t *shards, size_t num_shards,
+                                uint64_t epoch) {
+  for (size_t i = 0; i < num_shards; ++i) {
+    for (;;) {
+      uint64_t seen = atomic_load(&shards[i].reader_epoch);
+      if (seen == 0 || seen >= epoch) break;
+      sched_yield();
+    }
+  }
+}
+
+// ==========================================
+//               RULE FILES
+// ==========================================
+
+/**
+ * firewall_save_rules writes a compiled rule set to a flat file, and
+ * firewall_load_rules maps such a file read-only and uses it in place. Every
+ * table of the MAC table, classifier, content and stream matchers is an
+ * array at a 64 byte aligned offset of the file. Tables refer to each other
+ * by index, never by address, so loading only points the few component
+ * structs at the arrays of the mapping: nothing is parsed or copied, and
+ * pages are faulted in as checks touch them. The one exception are the
+ * prefix length tables, whose tbl24 alone is 32 MB: the file holds their
+ * prefixes, and loading builds the tables again, so that files grow with
+ * the rules.
+ *
+ * The file also holds the rules as they were added, so that rules added
+ * after a load compile together with the loaded ones. They are read back
+ * only when that first happens, see firewall_unpack_rules.
+ *
+ * The arrays have the in-memory layout of this build, so a file only loads
+ * into the same code built for the same ABI, with FIREWALL_STATS on or off
+ * alike. The loader checks the header and that every array lies within the
+ * file, not the contents of the tables: rule files must be trusted.
+ */
+
+#define RULE_FILE_MAGIC "FWRULES"
+#define RULE_FILE_VERSION 3
+#define RULE_FILE_ALIGN 64
+#define RULE_FILE_BYTE_ORDER 0x01020304u
+#define RULE_FILE_STATS (1u << 0)  // written by a FIREWALL_STATS build
+
+typedef struct {
+  uint64_t offset;  // from the start of the file
+  uint64_t count;   // of elements, 0 for an empty (NULL) array
+} rule_file_array_t;
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;  // RULE_FILE_BYTE_ORDER as written
+  uint32_t flags;       // RULE_FILE_* bits
+  uint32_t reserved;
+  uint64_t size;  // of the whole file
+
+  // Compiled rules, the statistics arrays are empty without FIREWALL_STATS
+  rule_file_array_t mac_slots;
+  rule_file_array_t mac_rules;
+  uint64_t mac_size;
+
+  rule_file_array_t tuples;
+  rule_file_array_t tuple_slots;
+  rule_file_array_t ranges;
+  rule_file_array_t refs;
+  rule_file_array_t src_prefixes;  // see lpm_t
+  rule_file_array_t dest_prefixes;
+  uint64_t src_lens;
+  uint64_t dest_lens;
+  int32_t tuple_of[33][33];
+
+  rule_file_array_t content_slots;
+  rule_file_array_t content_pool;
+  rule_file_array_t content_len_bits;
+  uint64_t content_max_len;
+
+  rule_file_array_t stream_next;
+  rule_file_array_t stream_rules;
+  uint8_t stream_classes[256];
+  uint32_t stream_num_classes;
+  uint32_t stream_num_states;
+  uint32_t stream_accept_base;
+
+  uint32_t ratelimit_enabled;
+  uint32_t rate_bps;
+  uint64_t burst_bytes;
+  uint64_t timeout_us;
+  uint64_t source_burst_bytes;
+  uint32_t source_rate_bps;
+
+  // Rules as added, patterns are lengths plus their concatenated bytes
+  uint64_t num_mac_rules;
+  rule_file_array_t blacklist;
+  rule_file_array_t content_lens;
+  rule_file_array_t content_data;
+  rule_file_array_t stream_lens;
+  rule_file_array_t stream_data;
+} rule_file_header_t;
+
+typedef struct {
+  FILE *file;
+  uint64_t size;  // bytes written so far
+  bool ok;        // no write failed
+} rule_file_writer_t;
+
+// A mapped rule file, base is NULL if there is none
+typedef struct {
+  const uint8_t *base;
+  size_t size;
+} rule_file_t;
+
+static void rule_file_write(rule_file_writer_t *w, const void *data,
+                            size_t size) {
+  if (size == 0) return;
+  w->ok = w->ok && fwrite(data, 1, size, w->file) == size;
+  w->size += size;
+}
+
+// Pads the file to the next array offset and returns it
+static uint64_t rule_file_align(rule_file_writer_t *w) {
+  static const uint8_t zeros[RULE_FILE_ALIGN];
+  rule_file_write(w, zeros,
+                  (RULE_FILE_ALIGN - w->size % RULE_FILE_ALIGN) %
+                      RULE_FILE_ALIGN);
+  return w->size;
+}
+
+static rule_file_array_t rule_file_put(rule_file_writer_t *w,
+                                       const void *data, size_t count,
+                                       size_t elem_size) {
+  rule_file_array_t a = {rule_file_align(w), data ? count : 0};
+  rule_file_write(w, data, a.count * elem_size);
+  return a;
+}
+
+// Appends the lengths, then the bytes of pattern rules
+static void rule_file_put_patterns(rule_file_writer_t *w,
+                                   rule_file_array_t *lens,
+                                   rule_file_array_t *data,
+                                   const content_rule_t *rules, size_t n) {
+  *lens = (rule_file_array_t){rule_file_align(w), n};
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t len = rules[i].len;
+    rule_file_write(w, &len, sizeof(len));
+  }
+  *data = (rule_file_array_t){rule_file_align(w), 0};
+  for (size_t i = 0; i < n; ++i) {
+    rule_file_write(w, rules[i].data, rules[i].len);
+    data->count += rules[i].len;
+  }
+}
+
+// Appends the tables of `rules` and fills in their part of the header
+static void rule_file_put_ruleset(rule_file_writer_t *w, rule_file_header_t *h,
+                                  const ruleset_t *rules) {
+  const mac_table_t *mac = &rules->mac_rules;
+  size_t mac_slots = mac->slots ? mac->slot_mask + 1 : 0;
+  h->mac_slots = rule_file_put(w, mac->slots, mac_slots, sizeof(uint64_t));
+  STATS(h->mac_rules =
+            rule_file_put(w, mac->rules, mac_slots, sizeof(uint32_t));)
+  h->mac_size = mac->size;
+
+  const classifier_t *cls = &rules->classifier;
+  h->tuples = rule_file_put(w, cls->tuples, cls->num_tuples, sizeof(tuple_t));
+  h->tuple_slots =
+      rule_file_put(w, cls->slots, cls->num_slots, sizeof(tuple_entry_t));
+  h->ranges =
+      rule_file_put(w, cls->ranges, cls->num_ranges, sizeof(port_range_t));
+  STATS(h->refs = rule_file_put(w, cls->refs, cls->num_refs,
+                                sizeof(rule_ref_t));)
+  h->src_prefixes = rule_file_put(w, cls->src_lpm.prefixes,
+                                  cls->src_lpm.num_prefixes,
+                                  sizeof(lpm_prefix_t));
+  h->dest_prefixes = rule_file_put(w, cls->dest_lpm.prefixes,
+                                   cls->dest_lpm.num_prefixes,
+                                   sizeof(lpm_prefix_t));
+  h->src_lens = cls->src_lens;
+  h->dest_lens = cls->dest_lens;
+  memcpy(h->tuple_of, cls->tuple_of, sizeof(h->tuple_of));
+
+  const content_matcher_t *cm = &rules->content_matcher;
+  size_t content_slots = cm->slots ? cm->slot_mask + 1 : 0;
+  size_t pool_size = 0;
+  for (size_t i = 0; i < content_slots; ++i) {
+    const content_slot_t *s = &cm->slots[i];
+    if (s->hash && s->offset + s->len > pool_size)
+      pool_size = s->offset + s->len;
+  }
+  h->content_slots = rule_file_put(w, cm->slots, content_slots,
+                                   sizeof(content_slot_t));
+  h->content_pool = rule_file_put(w, cm->pool, pool_size, 1);
+  h->content_len_bits = rule_file_put(
+      w, cm->len_bits, cm->slots ? cm->max_len / 64 + 1 : 0,
+      sizeof(uint64_t));
+  h->content_max_len = cm->max_len;
+
+  const stream_matcher_t *sm = &rules->stream_matcher;
+  h->stream_next =
+      rule_file_put(w, sm->next, (size_t)sm->num_states * sm->num_classes,
+                    sizeof(uint32_t));
+  STATS(h->stream_rules = rule_file_put(w, sm->rules, sm->num_states,
+                                        sizeof(uint32_t));)
+  memcpy(h->stream_classes, sm->classes, sizeof(h->stream_classes));
+  h->stream_num_classes = sm->num_classes;
+  h->stream_num_states = sm->num_states;
+  h->stream_accept_base = sm->accept_base;
+
+  h->ratelimit_enabled = rules->ratelimit_enabled;
+  h->rate_bps = rules->rate_bps;
+  h->burst_bytes = rules->burst_bytes;
+  h->timeout_us = rules->timeout_us;
+  h->source_rate_bps = rules->source_rate_bps;
+  h->source_burst_bytes = rules->source_burst_bytes;
+}
+
+// Returns array `a` of the mapped file, NULL if it is empty. Clears `*ok` if
+// it does not lie within the file.
+static void *rule_file_get(const rule_file_t *file, rule_file_array_t a,
+                           size_t elem_size, bool *ok) {
+  if (a.count == 0) return NULL;
+  if (a.offset % RULE_FILE_ALIGN != 0 || a.offset > file->size ||
+      a.count > (file->size - a.offset) / elem_size) {
+    *ok = false;
+    return NULL;
+  }
+  // The mapping is read-only, loaded tables are never written
+  return (void *)(file->base + a.offset);
+}
+
+static inline const rule_file_header_t *rule_file_header(
+    const rule_file_t *file) {
+  return (const rule_file_header_t *)file->base;
+}
+
+static inline bool is_pow2(uint64_t x) { return x && !(x & (x - 1)); }
+
+// Builds a prefix length table from the prefixes of the file, which must be
+// what lpm_build takes. Returns false if they are not. As in
+// classifier_build_lpm, failing to build the table only disables the
+// pruning.
+static bool rule_file_get_lpm(const rule_file_t *file, lpm_t *lpm,
+                              rule_file_array_t a) {
+  memset(lpm, 0, sizeof(*lpm));
+  bool ok = true;
+  const lpm_prefix_t *in = rule_file_get(file, a, sizeof(lpm_prefix_t), &ok);
+  if (!in) return ok;
+  for (size_t i = 0; i < a.count; ++i) {
+    if (in[i].len < 1 || in[i].len > 31 ||
+        (in[i].addr & ~prefix_mask(in[i].len)) ||
+        (i && lpm_prefix_cmp(&in[i - 1], &in[i]) >= 0))
+      return false;
+  }
+
+  lpm_prefix_t *prefixes = malloc(a.count * sizeof(*prefixes));
+  if (prefixes) {
+    memcpy(prefixes, in, a.count * sizeof(*prefixes));
+    lpm_build(lpm, prefixes, a.count);
+  }
+  return true;
+}
+
+// Points the components of `rules` at the tables of `file`, but for the
+// prefix length tables (see rule_file_get_lpm). Returns false if the file is
+// malformed.
+static bool rule_file_get_ruleset(const rule_file_t *file, ruleset_t *rules) {
+  const rule_file_header_t *h = rule_file_header(file);
+  bool ok = true;
+
+  mac_table_t *mac = &rules->mac_rules;
+  mac->slots = rule_file_get(file, h->mac_slots, sizeof(uint64_t), &ok);
+  STATS(mac->rules = rule_file_get(file, h->mac_rules, sizeof(uint32_t), &ok);
+        ok = ok && h->mac_rules.count == h->mac_slots.count;)
+  mac->slot_mask = mac->slots ? h->mac_slots.count - 1 : 0;
+  mac->size = h->mac_size;
+  ok = ok && (!mac->slots || is_pow2(h->mac_slots.count)) &&
+       2 * mac->size <= h->mac_slots.count;
+
+  classifier_t *cls = &rules->classifier;
+  cls->tuples = rule_file_get(file, h->tuples, sizeof(tuple_t), &ok);
+  cls->num_tuples = h->tuples.count;
+  cls->slots = rule_file_get(file, h->tuple_slots, sizeof(tuple_entry_t), &ok);
+  cls->num_slots = h->tuple_slots.count;
+  cls->ranges = rule_file_get(file, h->ranges, sizeof(port_range_t), &ok);
+  cls->num_ranges = h->ranges.count;
+  STATS(cls->refs = rule_file_get(file, h->refs, sizeof(rule_ref_t), &ok);
+        cls->num_refs = h->refs.count;)
+  cls->src_lens = h->src_lens;
+  cls->dest_lens = h->dest_lens;
+  memcpy(cls->tuple_of, h->tuple_of, sizeof(cls->tuple_of));
+  for (size_t i = 0; ok && i < cls->num_tuples; ++i) {
+    const tuple_t *t = &cls->tuples[i];
+    ok = is_pow2(t->slot_mask + 1) && t->slots_start < cls->num_slots &&
+         t->slot_mask < cls->num_slots - t->slots_start;
+  }
+  for (size_t s = 0; ok && s < 33; ++s) {
+    for (size_t d = 0; d < 33; ++d)
+      ok = ok && cls->tuple_of[s][d] < (int64_t)cls->num_tuples;
+  }
+
+  content_matcher_t *cm = &rules->content_matcher;
+  cm->slots =
+      rule_file_get(file, h->content_slots, sizeof(content_slot_t), &ok);
+  cm->slot_mask = cm->slots ? h->content_slots.count - 1 : 0;
+  cm->pool = rule_file_get(file, h->content_pool, 1, &ok);
+  cm->len_bits =
+      rule_file_get(file, h->content_len_bits, sizeof(uint64_t), &ok);
+  cm->max_len = h->content_max_len;
+  ok = ok && (!cm->slots ||
+              (is_pow2(h->content_slots.count) &&
+               h->content_len_bits.count == cm->max_len / 64 + 1));
+
+  stream_matcher_t *sm = &rules->stream_matcher;
+  sm->next = rule_file_get(file, h->stream_next, sizeof(uint32_t), &ok);
+  STATS(sm->rules = rule_file_get(file, h->stream_rules, sizeof(uint32_t), &ok);
+        ok = ok && h->stream_rules.count == h->stream_num_states;)
+  memcpy(sm->classes, h->stream_classes, sizeof(sm->classes));
+  sm->num_classes = h->stream_num_classes;
+  sm->num_states = h->stream_num_states;
+  sm->accept_base = h->stream_accept_base;
+  ok = ok && h->stream_next.count ==
+                 (uint64_t)sm->num_states * sm->num_classes;
+
+  rules->ratelimit_enabled = h->ratelimit_enabled != 0;
+  rules->rate_bps = h->rate_bps;
+  rules->burst_bytes = h->burst_bytes;
+  rules->bucket_capacity = bucket_capacity(h->rate_bps, h->burst_bytes);
+  rules->timeout_us = h->timeout_us;
+  rules->source_rate_bps = h->source_rate_bps;
+  rules->source_burst_bytes = h->source_burst_bytes;
+  rules->source_capacity =
+      bucket_capacity(h->source_rate_bps, h->source_burst_bytes);
+  return ok;
+}
+
+static void rule_file_unmap(rule_file_t *file) {
+  if (file->base) munmap((void *)file->base, file->size);
+  memset(file, 0, sizeof(*file));
+}
+
+// Maps the rule file at `path` and checks its header. Returns false if it
+// can't be read or was not written by this build.
+static bool rule_file_map(rule_file_t *file, const char *path) {
+  memset(file, 0, sizeof(*file));
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  void *base = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (uint64_t)st.st_size >= sizeof(rule_file_header_t))
+    base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return false;
+  file->base = base;
+  file->size = (size_t)st.st_size;
+
+  const rule_file_header_t *h = rule_file_header(file);
+  uint32_t flags = 0;
+  STATS(flags |= RULE_FILE_STATS;)
+  if (memcmp(h->magic, RULE_FILE_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != RULE_FILE_VERSION ||
+      h->byte_order != RULE_FILE_BYTE_ORDER || h->flags != flags ||
+      h->size != file->size) {
+    rule_file_unmap(file);
+    return false;
+  }
+  return true;
+}
+
+// ==========================================
+//                FIREWALL
+// ==========================================
+
+struct firewall {
+  // Staged rules, only accessed by the thread updating the rules
+  mac_table_t mac_rules;
+  size_t num_mac_rules;  // calls to firewall_add_mac_rule
+  bool mac_dirty;        // changed since the last commit
+
+  blacklist_rule_t *blacklist_rules;
+  size_t num_blacklist_rules;
+  size_t blacklist_rules_capacity;
+  bool blacklist_dirty;
+
+  content_rule_t *content_rules;
+  size_t num_content_rules;
+  size_t content_rules_capacity;
+  bool content_dirty;
+
+  content_rule_t *stream_rules;
+  size_t num_stream_rules;
+  size_t stream_rules_capacity;
+  bool stream_dirty;
+
+  bool ratelimit_enabled;
+  uint32_t rate_bps;
+  uint64_t burst_bytes;
+  uint64_t timeout_us;
+  uint32_t source_rate_bps;
+  uint64_t source_burst_bytes;
+  bool ratelimit_dirty;
+
+  // Set by firewall_commit, from then on checks don't commit staged rules
+  atomic_bool manual_commit;
+
+  _Atomic(ruleset_t *) rules;  // published rule set, never NULL
+  _Atomic uint64_t epoch;      // starts at 1, 0 marks an idle reader slot
+
+  shard_t *shards;
+  size_t num_shards;
+  size_t verdict_cache_entries;  // per shard, 0 if disabled
+  uint32_t generation;           // of the last published MAC/blacklist rules
+  uint32_t stream_generation;    // of the last built stream matcher
+  size_t max_flows;              // across all shards, 0 if unbounded
+  uint64_t retired_evictions;    // of the flow tables of replaced shards
+
+  rule_file_t file;    // mapped by the last firewall_load_rules
+  bool rules_in_file;  // the staged rules are still only in `file`
+
+  STATS(stats_totals_t stats;)
+};
+
+firewall_t *firewall_create(void) {
+  firewall_t *firewall = calloc(1, sizeof(firewall_t));
+  if (!firewall) return NULL;
+
+  ruleset_t *rules = calloc(1, sizeof(ruleset_t));
+  firewall->shards = shards_create(1, 0);
+  if (!rules || !firewall->shards
+      STATS(|| !ruleset_stats_alloc(rules, (size_t[NUM_RULE_KINDS]){0}, 1))) {
+    ruleset_free(rules);
+    free(firewall->shards);
+    free(firewall);
+    return NULL;
+  }
+  rules->owned = RULESET_OWNS_ALL;
+  rules->generation = firewall->generation = 1;
+  firewall->num_shards = 1;
+  atomic_init(&firewall->manual_commit, false);
+  atomic_init(&firewall->rules, rules);
+  atomic_init(&firewall->epoch, 1);
+  return firewall;
+}
+
+void firewall_destroy(firewall_t *firewall) {
+  if (!firewall) return;
+
+  mac_table_free(&firewall->mac_rules);
+  free(firewall->blacklist_rules);
+  pattern_rules_free(firewall->content_rules, firewall->num_content_rules);
+  pattern_rules_free(firewall->stream_rules, firewall->num_stream_rules);
+  ruleset_free(atomic_load(&firewall->rules));
+  rule_file_unmap(&firewall->file);
+  shards_free(firewall->shards, firewall->num_shards);
+  STATS(for (size_t k = 0; k < NUM_RULE_KINDS; ++k)
+            free(firewall->stats.rules[k]);)
+  free(firewall);
+}
+
+// Appends a copy of `pattern` to a pattern rule array. Returns false on
+// allocation failure.
+static bool pattern_rules_add(content_rule_t **rules, size_t *num_rules,
+                              size_t *capacity, const char *pattern,
+                              size_t pattern_len) {
+  if (!ensure_capacity((void **)rules, capacity, *num_rules + 1,
+                       sizeof(content_rule_t)))
+    return false;
+
+  uint8_t *data = malloc(pattern_len ? pattern_len : 1);
+  if (!data) return false;
+  memcpy(data, pattern, pattern_len);
+
+  content_rule_t *rule = &(*rules)[(*num_rules)++];
+  rule->data = data;
+  rule->len = pattern_len;
+  return true;
+}
+
+// Appends the patterns of a rule file to a pattern rule array. Returns false
+// on allocation failure or if the lengths overrun the pattern bytes.
+static bool pattern_rules_unpack(content_rule_t **rules, size_t *num_rules,
+                                 size_t *capacity, const rule_file_t *file,
+                                 rule_file_array_t lens_array,
+                                 rule_file_array_t data_array) {
+  bool ok = true;
+  const uint64_t *lens = rule_file_get(file, lens_array, sizeof(uint64_t), &ok);
+  const char *data = rule_file_get(file, data_array, 1, &ok);
+  uint64_t used = 0;
+  for (size_t i = 0; ok && i < lens_array.count; ++i) {
+    ok = lens[i] <= data_array.count - used &&
+         pattern_rules_add(rules, num_rules, capacity,
+                           lens[i] ? data + used : "", (size_t)lens[i]);
+    used += lens[i];
+  }
+  return ok;
+}
+
+// Reads the rules added before firewall_save_rules back into the staged
+// rules, the first time rules are added after a firewall_load_rules. Until
+// then they only exist in the file, which keeps loading free of per-rule
+// work. Returns false on allocation failure, leaving them in the file.
+static bool firewall_unpack_rules(firewall_t *firewall) {
+  if (!firewall->rules_in_file) return true;
+  const rule_file_t *file = &firewall->file;
+  const rule_file_header_t *h = rule_file_header(file);
+
+  ruleset_t view;
+  memset(&view, 0, sizeof(view));
+  bool ok = rule_file_get_ruleset(file, &view);
+  mac_table_t mac;
+  memset(&mac, 0, sizeof(mac));
+  ok = ok && mac_table_clone(&mac, &view.mac_rules);
+
+  blacklist_rule_t *blacklist = NULL;
+  size_t blacklist_capacity = 0;
+  const blacklist_rule_t *loaded =
+      rule_file_get(file, h->blacklist, sizeof(blacklist_rule_t), &ok);
+  if (ok && loaded) {
+    ok = ensure_capacity((void **)&blacklist, &blacklist_capacity,
+                         h->blacklist.count, sizeof(blacklist_rule_t));
+    if (ok) memcpy(blacklist, loaded, h->blacklist.count * sizeof(*loaded));
+  }
+
+  content_rule_t *content = NULL, *stream = NULL;
+  size_t num_content = 0, content_capacity = 0;
+  size_t num_stream = 0, stream_capacity = 0;
+  ok = ok &&
+       pattern_rules_unpack(&content, &num_content, &content_capacity, file,
+                            h->content_lens, h->content_data) &&
+       pattern_rules_unpack(&stream, &num_stream, &stream_capacity, file,
+                            h->stream_lens, h->stream_data);
+  if (!ok) {
+    mac_table_free(&mac);
+    free(blacklist);
+    pattern_rules_free(content, num_content);
+    pattern_rules_free(stream, num_stream);
+    return false;
+  }
+
+  firewall->mac_rules = mac;
+  firewall->num_mac_rules = (size_t)h->num_mac_rules;
+  firewall->blacklist_rules = blacklist;
+  firewall->num_blacklist_rules = (size_t)h->blacklist.count;
+  firewall->blacklist_rules_capacity = blacklist_capacity;
+  firewall->content_rules = content;
+  firewall->num_content_rules = num_content;
+  firewall->content_rules_capacity = content_capacity;
+  firewall->stream_rules = stream;
+  firewall->num_stream_rules = num_stream;
+  firewall->stream_rules_capacity = stream_capacity;
+  firewall->rules_in_file = false;
+  return true;
+}
+
+#ifdef FIREWALL_STATS
+// Rules of every kind, also while they are only in a loaded rule file
+static void firewall_num_rules(const firewall_t *firewall,
+                               size_t num_rules[NUM_RULE_KINDS]) {
+  if (firewall->rules_in_file) {
+    const rule_file_header_t *h = rule_file_header(&firewall->file);
+    num_rules[RULE_MAC] = (size_t)h->num_mac_rules;
+    num_rules[RULE_BLACKLIST] = (size_t)h->blacklist.count;
+    num_rules[RULE_CONTENT] = (size_t)h->content_lens.count;
+    num_rules[RULE_STREAM] = (size_t)h->stream_lens.count;
+  } else {
+    num_rules[RULE_MAC] = firewall->num_mac_rules;
+    num_rules[RULE_BLACKLIST] = firewall->num_blacklist_rules;
+    num_rules[RULE_CONTENT] = firewall->num_content_rules;
+    num_rules[RULE_STREAM] = firewall->num_stream_rules;
+  }
+}
+#endif
+
+void firewall_add_mac_rule(firewall_t *firewall, uint8_t mac[],
+                           action_t action) {
+  if (firewall_unpack_rules(firewall) &&
+      mac_table_put(&firewall->mac_rules, mac, action,
+                    (uint32_t)firewall->num_mac_rules)) {
+    ++firewall->num_mac_rules;
+    firewall->mac_dirty = true;
+  }
+}
+
+void firewall_add_blacklist_rule(firewall_t *firewall, protocol_t proto,
+                                 ipaddr_t srcip, ipaddr_t destip,
+                                 port_t start_port, port_t end_port) {
+  firewall_add_blacklist_prefix_rule(firewall, proto, srcip, srcip ? 32 : 0,
+                                     destip, destip ? 32 : 0, start_port,
+                                     end_port);
+}
+
+void firewall_add_blacklist_prefix_rule(firewall_t *firewall, protocol_t proto,
+                                        ipaddr_t srcip, uint8_t src_len,
+                                        ipaddr_t destip, uint8_t dest_len,
+                                        port_t start_port, port_t end_port) {
+  if (!firewall_unpack_rules(firewall) ||
+      !ensure_capacity((void **)&firewall->blacklist_rules,
+                       &firewall->blacklist_rules_capacity,
+                       firewall->num_blacklist_rules + 1,
+                       sizeof(blacklist_rule_t)))
+    return;
+
+  firewall->blacklist_rules[firewall->num_blacklist_rules] =
+      (blacklist_rule_t){
+          .proto = proto,
+          .srcip = srcip,
+          .destip = destip,
+          .src_len = src_len,
+          .dest_len = dest_len,
+          .start_port = start_port,
+          .end_port = end_port,
+          .id = (uint32_t)firewall->num_blacklist_rules,
+      };
+  ++firewall->num_blacklist_rules;
+  firewall->blacklist_dirty = true;
+}
+
+void firewall_add_content_rule(firewall_t *firewall, const char *pattern,
+                               size_t pattern_len) {
+  if (firewall_unpack_rules(firewall) &&
+      pattern_rules_add(&firewall->content_rules,
+                        &firewall->num_content_rules,
+                        &firewall->content_rules_capacity, pattern,
+                        pattern_len))
+    firewall->content_dirty = true;
+}
+
+void firewall_add_stream_rule(firewall_t *firewall, const char *pattern,
+                              size_t pattern_len) {
+  if (firewall_unpack_rules(firewall) &&
+      pattern_rules_add(&firewall->stream_rules, &firewall->num_stream_rules,
+                        &firewall->stream_rules_capacity, pattern,
+                        pattern_len))
+    firewall->stream_dirty = true;
+}
+
+void firewall_configure_ratelimit(firewall_t *firewall, uint32_t rate_bps,
+                                  uint64_t timeout_us) {
+  firewall->ratelimit_enabled = true;
+  firewall->rate_bps = rate_bps;
+  firewall->timeout_us = timeout_us;
+  firewall->ratelimit_dirty = true;
+}
+
+void firewall_configure_ratelimit_burst(firewall_t *firewall,
+                                        uint64_t burst_bytes) {
+  firewall->burst_bytes = burst_bytes;
+  firewall->ratelimit_dirty = true;
+}
+
+void firewall_configure_source_ratelimit(firewall_t *firewall,
+                                         uint32_t rate_bps,
+                                         uint64_t burst_bytes) {
+  firewall->source_rate_bps = rate_bps;
+  firewall->source_burst_bytes = burst_bytes;
+  firewall->ratelimit_dirty = true;
+}
+
+static bool firewall_pending(const firewall_t *firewall) {
+  return firewall->mac_dirty || firewall->blacklist_dirty ||
+         firewall->content_dirty || firewall->stream_dirty ||
+         firewall->ratelimit_dirty;
+}
+
+// The prefix length tables that the classifier of `rules` reuses from `old`,
+// as RULESET_OWNS_* bits
+static unsigned ruleset_shared_lpms(const ruleset_t *rules,
+                                    const ruleset_t *old) {
+  const classifier_t *cls = &rules->classifier;
+  const classifier_t *prev = &old->classifier;
+  return (cls->src_lpm.tbl24 && cls->src_lpm.tbl24 == prev->src_lpm.tbl24
+              ? RULESET_OWNS_SRC_LPM
+              : 0) |
+         (cls->dest_lpm.tbl24 && cls->dest_lpm.tbl24 == prev->dest_lpm.tbl24
+              ? RULESET_OWNS_DEST_LPM
+              : 0);
+}
+
+// Publishes `rules`, which holds the components that changed since the last
+// commit, moves the others over from the current rule set and frees that
+// after a grace period
+static void firewall_install(firewall_t *firewall, ruleset_t *rules) {
+  ruleset_t *old = atomic_load_explicit(&firewall->rules, memory_order_relaxed);
+  if (!firewall->mac_dirty) rules->mac_rules = old->mac_rules;
+  if (!firewall->blacklist_dirty) rules->classifier = old->classifier;
+  if (!firewall->content_dirty)
+    rules->content_matcher = old->content_matcher;
+  if (!firewall->stream_dirty) rules->stream_matcher = old->stream_matcher;
+  unsigned kept = (firewall->mac_dirty ? 0 : RULESET_OWNS_MAC) |
+                  (firewall->blacklist_dirty
+                       ? ruleset_shared_lpms(rules, old)
+                       : RULESET_OWNS_CLASSIFIER | RULESET_OWNS_LPMS) |
+                  (firewall->content_dirty ? 0 : RULESET_OWNS_CONTENT) |
+                  (firewall->stream_dirty ? 0 : RULESET_OWNS_STREAM);
+  unsigned moved = old->owned & kept;
+  rules->owned |= moved;
+  old->owned &= ~moved;
+  rules->ratelimit_enabled = firewall->ratelimit_enabled;
+  rules->rate_bps = firewall->rate_bps;
+  rules->burst_bytes = firewall->burst_bytes;
+  rules->bucket_capacity =
+      bucket_capacity(firewall->rate_bps, firewall->burst_bytes);
+  rules->timeout_us = firewall->timeout_us;
+  rules->source_rate_bps = firewall->source_rate_bps;
+  rules->source_burst_bytes = firewall->source_burst_bytes;
+  rules->source_capacity = bucket_capacity(firewall->source_rate_bps,
+                                           firewall->source_burst_bytes);
+  rules->generation = old->generation;
+  if (firewall->mac_dirty || firewall->blacklist_dirty) {
+    // Invalidates every cached verdict, 0 marks empty cache entries
+    if (++firewall->generation == 0) ++firewall->generation;
+    rules->generation = firewall->generation;
+  }
+
+  atomic_store(&firewall->rules, rules);
+  uint64_t epoch = atomic_fetch_add(&firewall->epoch, 1) + 1;
+  ruleset_synchronize(firewall->shards, firewall->num_shards, epoch);
+  STATS(ruleset_stats_add(firewall->stats.rules, old, firewall->num_shards);)
+  ruleset_free(old);
+
+  firewall->mac_dirty = false;
+  firewall->blacklist_dirty = false;
+  firewall->content_dirty = false;
+  firewall->stream_dirty = false;
+  firewall->ratelimit_dirty = false;
+}
+
+// Compiles the components that changed since the last commit into a new rule
+// set and installs it. On allocation failure nothing changes.
+static bool firewall_publish(firewall_t *firewall) {
+  const ruleset_t *old =
+      atomic_load_explicit(&firewall->rules, memory_order_relaxed);
+  ruleset_t *rules = calloc(1, sizeof(ruleset_t));
+  if (!rules) return false;
+
+  bool ok = true;
+  if (firewall->mac_dirty) {
+    ok = mac_table_clone(&rules->mac_rules, &firewall->mac_rules);
+    if (ok) rules->owned |= RULESET_OWNS_MAC;
+  }
+  if (ok && firewall->blacklist_dirty) {
+    ok = classifier_build(&rules->classifier, firewall->blacklist_rules,
+                          firewall->num_blacklist_rules, &old->classifier);
+    if (ok)
+      rules->owned |= RULESET_OWNS_CLASSIFIER |
+                      (RULESET_OWNS_LPMS & ~ruleset_shared_lpms(rules, old));
+  }
+  if (ok && firewall->content_dirty) {
+    ok = content_matcher_build(&rules->content_matcher,
+                               firewall->content_rules,
+                               firewall->num_content_rules);
+    if (ok) rules->owned |= RULESET_OWNS_CONTENT;
+  }
+  if (ok && firewall->stream_dirty) {
+    ok = stream_matcher_build(&rules->stream_matcher, firewall->stream_rules,
+                              firewall->num_stream_rules);
+    if (ok) {
+      rules->owned |= RULESET_OWNS_STREAM;
+      // States of the previous matcher start over, see check_stream
+      if (++firewall->stream_generation == 0) ++firewall->stream_generation;
+      rules->stream_matcher.generation = firewall->stream_generation;
+    }
+  }
+#ifdef FIREWALL_STATS
+  size_t num_rules[NUM_RULE_KINDS];
+  firewall_num_rules(firewall, num_rules);
+  ok = ok && stats_totals_reserve(&firewall->stats, num_rules) &&
+       ruleset_stats_alloc(rules, num_rules, firewall->num_shards);
+#endif
+  if (!ok) {
+    ruleset_free(rules);
+    return false;
+  }
+  firewall_install(firewall, rules);
+  return true;
+}
+
+bool firewall_commit(firewall_t *firewall) {
+  atomic_store_explicit(&firewall->manual_commit, true, memory_order_relaxed);
+  return firewall_publish(firewall);
+}
+
+bool firewall_save_rules(firewall_t *firewall, const char *path) {
+  if (!firewall_unpack_rules(firewall) ||
+      (firewall_pending(firewall) && !firewall_publish(firewall)))
+    return false;
+
+  // Written next to `path` and renamed over it: a firewall that mapped the
+  // old file keeps using it, and a failed save leaves it alone
+  size_t path_len = strlen(path);
+  char *tmp_path = malloc(path_len + sizeof(".tmp"));
+  if (!tmp_path) return false;
+  memcpy(tmp_path, path, path_len);
+  memcpy(tmp_path + path_len, ".tmp", sizeof(".tmp"));
+  FILE *f = fopen(tmp_path, "wb");
+  if (!f) {
+    free(tmp_path);
+    return false;
+  }
+
+  rule_file_header_t h;
+  memset(&h, 0, sizeof(h));
+  rule_file_writer_t w = {f, 0, true};
+  rule_file_write(&w, &h, sizeof(h));  // filled in below
+  rule_file_put_ruleset(
+      &w, &h, atomic_load_explicit(&firewall->rules, memory_order_relaxed));
+  h.num_mac_rules = firewall->num_mac_rules;
+  h.blacklist = rule_file_put(&w, firewall->blacklist_rules,
+                              firewall->num_blacklist_rules,
+                              sizeof(blacklist_rule_t));
+  rule_file_put_patterns(&w, &h.content_lens, &h.content_data,
+                         firewall->content_rules, firewall->num_content_rules);
+  rule_file_put_patterns(&w, &h.stream_lens, &h.stream_data,
+                         firewall->stream_rules, firewall->num_stream_rules);
+
+  memcpy(h.magic, RULE_FILE_MAGIC, sizeof(h.magic));
+  h.version = RULE_FILE_VERSION;
+  h.byte_order = RULE_FILE_BYTE_ORDER;
+  STATS(h.flags |= RULE_FILE_STATS;)
+  h.size = w.size;
+  w.ok = w.ok && fseek(f, 0, SEEK_SET) == 0;
+  rule_file_write(&w, &h, sizeof(h));
+
+  bool ok = fclose(f) == 0 && w.ok && rename(tmp_path, path) == 0;
+  if (!ok) remove(tmp_path);
+  free(tmp_path);
+  return ok;
+}
+
+bool firewall_load_rules(firewall_t *firewall, const char *path) {
+  rule_file_t file;
+  if (!rule_file_map(&file, path)) return false;
+  const rule_file_header_t *h = rule_file_header(&file);
+
+  // Components of a loaded rule set are not owned, the file holds them. Only
+  // the prefix length tables are built anew.
+  ruleset_t *rules = calloc(1, sizeof(ruleset_t));
+  if (rules) rules->owned = RULESET_OWNS_LPMS;
+  bool ok = rules && rule_file_get_ruleset(&file, rules) &&
+            rule_file_get_lpm(&file, &rules->classifier.src_lpm,
+                              h->src_prefixes) &&
+            rule_file_get_lpm(&file, &rules->classifier.dest_lpm,
+                              h->dest_prefixes);
+  rule_file_get(&file, h->blacklist, sizeof(blacklist_rule_t), &ok);
+  rule_file_get(&file, h->content_lens, sizeof(uint64_t), &ok);
+  rule_file_get(&file, h->content_data, 1, &ok);
+  rule_file_get(&file, h->stream_lens, sizeof(uint64_t), &ok);
+  rule_file_get(&file, h->stream_data, 1, &ok);
+#ifdef FIREWALL_STATS
+  size_t num_rules[NUM_RULE_KINDS] = {
+      (size_t)h->num_mac_rules, (size_t)h->blacklist.count,
+      (size_t)h->content_lens.count, (size_t)h->stream_lens.count};
+  ok = ok && stats_totals_reserve(&firewall->stats, num_rules) &&
+       ruleset_stats_alloc(rules, num_rules, firewall->num_shards);
+#endif
+  if (!ok) {
+    ruleset_free(rules);
+    rule_file_unmap(&file);
+    return false;
+  }
+
+  // The file's rules replace the staged ones, which firewall_unpack_rules
+  // reads back when needed
+  mac_table_free(&firewall->mac_rules);
+  firewall->num_mac_rules = 0;
+  free(firewall->blacklist_rules);
+  firewall->blacklist_rules = NULL;
+  firewall->num_blacklist_rules = firewall->blacklist_rules_capacity = 0;
+  pattern_rules_free(firewall->content_rules, firewall->num_content_rules);
+  firewall->content_rules = NULL;
+  firewall->num_content_rules = firewall->content_rules_capacity = 0;
+  pattern_rules_free(firewall->stream_rules, firewall->num_stream_rules);
+  firewall->stream_rules = NULL;
+  firewall->num_stream_rules = firewall->stream_rules_capacity = 0;
+  firewall->ratelimit_enabled = rules->ratelimit_enabled;
+  firewall->rate_bps = rules->rate_bps;
+  firewall->burst_bytes = rules->burst_bytes;
+  firewall->timeout_us = rules->timeout_us;
+  firewall->source_rate_bps = rules->source_rate_bps;
+  firewall->source_burst_bytes = rules->source_burst_bytes;
+
+  // Every component changes, none is moved over from the current rule set
+  firewall->mac_dirty = firewall->blacklist_dirty = true;
+  firewall->content_dirty = firewall->stream_dirty = true;
+  if (++firewall->stream_generation == 0) ++firewall->stream_generation;
+  rules->stream_matcher.generation = firewall->stream_generation;
+  firewall_install(firewall, rules);
+
+  // Only the rule set just installed can use the previous file, if any
+  rule_file_unmap(&firewall->file);
+  firewall->file = file;
+  firewall->rules_in_file = true;
+#ifdef FIREWALL_STATS
+  // Counters of the replaced rules would be attributed to the loaded ones
+  for (size_t k = 0; k < NUM_RULE_KINDS; ++k) {
+    memset(firewall->stats.rules[k], 0,
+           firewall->stats.num_rules[k] * sizeof(firewall_counter_t));
+  }
+#endif
+  return true;
+}
+
+// Until the first firewall_commit, checks publish staged rules themselves. On
+// allocation failure the old rules stay and the next packet retries.
+static void firewall_auto_commit(firewall_t *firewall) {
+  if (!atomic_load_explicit(&firewall->manual_commit, memory_order_relaxed) &&
+      firewall_pending(firewall))
+    firewall_publish(firewall);
+}
+
+// Enters a read-side critical section in the reader slot of `shard` and
+// returns the rule set to use until ruleset_exit
+static inline const ruleset_t *ruleset_enter(firewall_t *firewall,
+                                             shard_t *shard) {
+  // Both sequentially consistent: the slot must be visible to the writer
+  // before the pointer is read.
+  atomic_store(&shard->reader_epoch, atomic_load(&firewall->epoch));
+  return atomic_load(&firewall->rules);
+}
+
+static inline void ruleset_exit(shard_t *shard) {
+  atomic_store_explicit(&shard->reader_epoch, 0, memory_order_release);
+}
+
+static inline bool ruleset_ratelimits(const ruleset_t *rules) {
+  return rules->ratelimit_enabled || rules->source_rate_bps;
+}
+
+/**
+ * Checks a packet against the bucket of its flow and the aggregate bucket of
+ * its source, both O(1). It passes only if it fits into both, and only then
+ * fills them, so a packet dropped by one level uses up nothing of the other.
+ *
+ * A source's traffic is split over `num_shards` shards, each of which gets
+ * an equal share of the source's rate and burst. Filling the shard's bucket
+ * with num_shards times the bytes against the whole burst is the same.
+ */
+static action_t check_ratelimit(const ruleset_t *rules, shard_t *shard,
+                                const flow_key_t *key, uint64_t hash,
+                                size_t payload_len, size_t num_shards,
+                                uint64_t now) {
+  uint64_t added = (uint64_t)payload_len * BUCKET_SCALE;
+  flow_t *flow = NULL;
+  if (rules->ratelimit_enabled) {
+    flow_table_t *flows = &shard->flows;
+    flow_table_expire(flows, now, rules->timeout_us);
+    flow = flow_table_get(flows, key, hash, now, rules->timeout_us);
+    if (!flow) return ACTION_DROP;
+
+    // Caller supplied clocks may step back a little, that drains nothing
+    uint64_t elapsed = now > flow->last_us ? now - flow->last_us : 0;
+    if (elapsed > rules->timeout_us)
+      flow->bucket = 0;  // flow terminated, start over
+    else
+      flow->bucket = bucket_drain(flow->bucket, rules->rate_bps, elapsed);
+    if (elapsed > 0) flow->last_us = now;
+    if (flow->bucket + added > rules->bucket_capacity) return ACTION_DROP;
+  }
+
+  if (rules->source_rate_bps) {
+    source_t *source = source_table_get(&shard->sources, key->srcip,
+                                        rules->source_rate_bps, now);
+    if (!source) return ACTION_DROP;
+    source->bucket = source_level(source, rules->source_rate_bps, now);
+    if (now > source->last_us) source->last_us = now;
+    uint64_t share = added * num_shards;
+    if (source->bucket + share > rules->source_capacity) return ACTION_DROP;
+    source->bucket += share;
+  }
+
+  if (flow) flow->bucket += added;
+  return ACTION_PASS;
+}
+
+// Idle time after which the matcher state of a stream is dropped
+#define STREAM_TIMEOUT_US (60 * UINT64_C(1000000))
+
+// Feeds a TCP payload to the matcher state of its flow. Returns the first
+// accepting state reached, or STREAM_NONE. When the state can't be stored the
+// segment is matched on its own.
+static uint32_t check_stream(const stream_matcher_t *m, flow_table_t *streams,
+                             const flow_key_t *key, uint64_t hash,
+                             const uint8_t *payload, size_t payload_len,
+                             uint64_t now) {
+  flow_table_expire(streams, now, STREAM_TIMEOUT_US);
+  flow_t *flow = flow_table_get(streams, key, hash, now, STREAM_TIMEOUT_US);
+  uint32_t state = 0;
+  if (flow) {
+    // Like a rate limit bucket, the state of a stream idle for too long but
+    // not reclaimed yet starts over
+    if (now > flow->last_us) {
+      if (now - flow->last_us > STREAM_TIMEOUT_US) flow->stream_state = 0;
+      flow->last_us = now;
+    }
+    // A state of an older automaton means nothing in this one
+    if (flow->stream_generation == m->generation) state = flow->stream_state;
+  }
+  uint32_t accepted = stream_matcher_feed(m, &state, payload, payload_len);
+  if (flow) {
+    flow->stream_state = state;
+    flow->stream_generation = m->generation;
+  }
+  return accepted;
+}
+
+// ==========================================
+//              PACKET PARSING
+// ==========================================
+
+// Validates the headers once and fills the descriptor every rule stage reads
+// (see firewall_packet_t). Returns false if the packet is shorter than its
+// headers imply.
+static bool parse_packet(const uint8_t *bytes, size_t packet_len,
+                         firewall_packet_t *p) {
+  memset(p, 0, sizeof(*p));
+  p->bytes = bytes;
+  if (packet_len < sizeof(ethhdr_t) || packet_len > UINT32_MAX) return false;
+  p->len = (uint32_t)packet_len;
+  const ethhdr_t *eth = (const ethhdr_t *)bytes;
+
+  // Only IPv4 carries the fields the remaining rules look at
+  if (be16toh(eth->proto) != ETH_P_IP) return true;
+  p->is_ip = true;
+
+  size_t ip_off = sizeof(ethhdr_t);
+  if (packet_len < ip_off + sizeof(iphdr_t)) return false;
+  const iphdr_t *ip = (const iphdr_t *)(bytes + ip_off);
+  size_t ip_len = (size_t)ip->ihl * 4;
+  if (ip->ihl < 5 || packet_len < ip_off + ip_len) return false;
+
+  p->srcip = be32toh(ip->saddr);
+  p->destip = be32toh(ip->daddr);
+  size_t l4_off = ip_off + ip_len;
+
+  size_t payload_off;
+  if (ip->protocol == IP_P_TCP) {
+    if (packet_len < l4_off + sizeof(tcphdr_t)) return false;
+    const tcphdr_t *tcp = (const tcphdr_t *)(bytes + l4_off);
+    size_t tcp_len = (size_t)tcp->doff * 4;
+    if (tcp->doff < 5 || packet_len < l4_off + tcp_len) return false;
+    p->proto = PROTOCOL_TCP;
+    p->srcport = be16toh(tcp->source);
+    p->destport = be16toh(tcp->dest);
+    payload_off = l4_off + tcp_len;
+  } else if (ip->protocol == IP_P_UDP) {
+    if (packet_len < l4_off + sizeof(udphdr_t)) return false;
+    const udphdr_t *udp = (const udphdr_t *)(bytes + l4_off);
+    p->proto = PROTOCOL_UDP;
+    p->srcport = be16toh(udp->source);
+    p->destport = be16toh(udp->dest);
+    payload_off = l4_off + sizeof(udphdr_t);
+  } else {
+    p->proto = PROTOCOL_OTHER;
+    payload_off = l4_off;
+  }
+
+  // Both at most 14 + 60 + 60 bytes
+  p->l4_off = (uint16_t)l4_off;
+  p->payload_off = (uint16_t)payload_off;
+  return true;
+}
+
+static inline const uint8_t *packet_src_mac(const firewall_packet_t *p) {
+  return p->bytes + offsetof(ethhdr_t, src);
+}
+
+static inline const uint8_t *packet_payload(const firewall_packet_t *p) {
+  return p->bytes + p->payload_off;
+}
+
+static inline size_t packet_payload_len(const firewall_packet_t *p) {
+  return p->len - p->payload_off;
+}
+
+static inline flow_key_t packet_flow_key(const firewall_packet_t *p) {
+  return (flow_key_t){p->srcip, p->destip, p->srcport, p->destport};
+}
+
+// Verdict cache key of an IPv4 packet under rule set `generation`
+static inline verdict_entry_t packet_verdict_key(const firewall_packet_t *p,
+                                                 uint32_t generation) {
+  return (verdict_entry_t){
+      .mac_proto = mac_pack(packet_src_mac(p)) | (uint64_t)p->proto << 48,
+      .addrs = (uint64_t)p->srcip << 32 | p->destip,
+      .ports = (uint32_t)p->srcport << 16 | p->destport,
+      .generation = generation,
+  };
+}
+
+// ==========================================
+//              PACKET CHECKS
+// ==========================================
+
+// Picks the shard from the flow's 4-tuple
+#define SHARD_AUTO SIZE_MAX
+
+// The time packets are checked at: supplied by the caller, or read from the
+// clock once the first packet reaches the rate limit stage, so that packets
+// decided earlier never pay for it. Every uint64_t is a valid timestamp, so
+// whether it is known yet is a separate flag.
+typedef struct {
+  uint64_t us;
+  bool known;
+} timestamp_t;
+
+#define TIMESTAMP_LAZY ((timestamp_t){0, false})
+
+static inline timestamp_t timestamp_at(uint64_t us) {
+  return (timestamp_t){us, true};
+}
+
+static inline uint64_t timestamp_resolve(timestamp_t *now) {
+  if (!now->known) *now = timestamp_at(timestamp_us());
+  return now->us;
+}
+
+#ifdef FIREWALL_STATS
+// Counts a packet on the rules a cached verdict came from
+static inline void verdict_entry_count(const ruleset_t *rules, size_t slot,
+                                       const verdict_entry_t *e,
+                                       size_t bytes) {
+  if (e->mac_rule != RULE_NONE)
+    ruleset_count(rules, slot, RULE_MAC, e->mac_rule, bytes);
+  if (e->blacklist_rule != RULE_NONE)
+    ruleset_count(rules, slot, RULE_BLACKLIST, e->blacklist_rule, bytes);
+}
+#endif
+
+// Runs the rule stages of `rules` but rate limiting on a parsed packet,
+// stopping at the first stage that drops it. Only the stream table of `shard`
+// is modified, `slot` is the reader slot of the calling thread.
+static action_t check_rules(const firewall_t *firewall,
+                            const ruleset_t *rules,
+                            const firewall_packet_t *p, size_t shard,
+                            size_t slot, timestamp_t *now) {
+  STATS(slot_stats_t *stats = &firewall->shards[slot].stats;
+        uint64_t clock = stats_now();)
+
+  const verdict_cache_t *cache = &firewall->shards[slot].verdicts;
+  verdict_entry_t key;
+  verdict_entry_t *cached = NULL;
+  if (cache->entries && p->is_ip) {
+    key = packet_verdict_key(p, rules->generation);
+    cached = verdict_cache_slot(cache, &key);
+  }
+
+  if (cached && verdict_entry_match(cached, &key)) {
+    // Hits are accounted to the MAC stage
+    STATS(verdict_entry_count(rules, slot, cached, p->len);
+          stats_stage(stats, FIREWALL_STAGE_MAC, &clock, 1);)
+    if (cached->verdict == ACTION_DROP) return ACTION_DROP;
+  } else {
+    const uint64_t *mac =
+        mac_table_lookup(&rules->mac_rules, packet_src_mac(p));
+    STATS(uint32_t mac_rule =
+              mac ? rules->mac_rules.rules[mac - rules->mac_rules.slots]
+                  : RULE_NONE;
+          if (mac) ruleset_count(rules, slot, RULE_MAC, mac_rule, p->len);
+          stats_stage(stats, FIREWALL_STAGE_MAC, &clock, 1);
+          uint32_t blacklist_rule = RULE_NONE;)
+    action_t verdict = mac_slot_action(mac);
+
+    if (verdict == ACTION_PASS && p->is_ip) {
+      const tuple_entry_t *entry =
+          classifier_match(&rules->classifier, (protocol_t)p->proto, p->srcip,
+                           p->destip, p->destport);
+      STATS(if (entry) {
+              blacklist_rule =
+                  tuple_entry_rule(&rules->classifier, entry, p->destport);
+              ruleset_count(rules, slot, RULE_BLACKLIST, blacklist_rule,
+                            p->len);
+            }
+            stats_stage(stats, FIREWALL_STAGE_BLACKLIST, &clock, 1);)
+      if (entry) verdict = ACTION_DROP;
+    }
+
+    if (cached) {
+      key.verdict = (uint8_t)verdict;
+      STATS(key.mac_rule = mac_rule; key.blacklist_rule = blacklist_rule;)
+      *cached = key;
+    }
+    if (verdict == ACTION_DROP) return ACTION_DROP;
+    if (!p->is_ip) return ACTION_PASS;
+  }
+
+  // Content and rate limiting only apply to TCP and UDP
+  if (p->proto == PROTOCOL_OTHER) return ACTION_PASS;
+
+  const content_slot_t *content = content_matcher_match(
+      &rules->content_matcher, packet_payload(p), packet_payload_len(p));
+  STATS(if (content)
+            ruleset_count(rules, slot, RULE_CONTENT, content->rule, p->len);
+        stats_stage(stats, FIREWALL_STAGE_CONTENT, &clock, 1);)
+  if (content) return ACTION_DROP;
+
+  if (!rules->stream_matcher.next || p->proto != PROTOCOL_TCP ||
+      packet_payload_len(p) == 0)
+    return ACTION_PASS;
+  flow_key_t flow_key = packet_flow_key(p);
+  if (shard == SHARD_AUTO) shard = shard_of(&flow_key, firewall->num_shards);
+  uint32_t accepted = check_stream(
+      &rules->stream_matcher, &firewall->shards[shard].streams, &flow_key,
+      flow_hash(&flow_key), packet_payload(p), packet_payload_len(p),
+      timestamp_resolve(now));
+  STATS(if (accepted != STREAM_NONE)
+            ruleset_count(rules, slot, RULE_STREAM,
+                          stream_matcher_rule(&rules->stream_matcher,
+                                              accepted),
+                          p->len);
+        stats_stage(stats, FIREWALL_STAGE_CONTENT, &clock, 0);)
+  return accepted != STREAM_NONE ? ACTION_DROP : ACTION_PASS;
+}
+
+// Rate limit stage of a packet that passed check_rules. Only the flow table
+// of `shard` is modified.
+static action_t check_flow(const firewall_t *firewall, const ruleset_t *rules,
+                           const firewall_packet_t *p, size_t shard,
+                           size_t slot, timestamp_t *now) {
+  if (!ruleset_ratelimits(rules) || !p->is_ip || p->proto == PROTOCOL_OTHER)
+    return ACTION_PASS;
+  STATS(slot_stats_t *stats = &firewall->shards[slot].stats;
+        uint64_t clock = stats_now();)
+  (void)slot;
+
+  flow_key_t flow_key = packet_flow_key(p);
+  if (shard == SHARD_AUTO) shard = shard_of(&flow_key, firewall->num_shards);
+  action_t verdict = check_ratelimit(
+      rules, &firewall->shards[shard], &flow_key, flow_hash(&flow_key),
+      packet_payload_len(p), firewall->num_shards, timestamp_resolve(now));
+  STATS(if (verdict == ACTION_DROP)
+            stats_count(&stats->ratelimit_drops, p->len);
+        stats_stage(stats, FIREWALL_STAGE_RATELIMIT, &clock, 1);)
+  return verdict;
+}
+
+// All rule stages of `rules` on a parsed packet, see check_rules
+static action_t check_parsed(const firewall_t *firewall,
+                             const ruleset_t *rules,
+                             const firewall_packet_t *p, size_t shard,
+                             size_t slot, timestamp_t now) {
+  if (check_rules(firewall, rules, p, shard, slot, &now) == ACTION_DROP)
+    return ACTION_DROP;
+  return check_flow(firewall, rules, p, shard, slot, &now);
+}
+
+static action_t check_packet(const firewall_t *firewall,
+                             const ruleset_t *rules, const uint8_t *packet,
+                             size_t packet_len, size_t shard, size_t slot,
+                             timestamp_t now) {
+  STATS(uint64_t clock = stats_now();)
+  firewall_packet_t p;
+  bool parsed = parse_packet(packet, packet_len, &p);
+  STATS(stats_stage(&firewall->shards[slot].stats, FIREWALL_STAGE_PARSE,
+                    &clock, 1);)
+  if (!parsed) return ACTION_DROP;
+  return check_parsed(firewall, rules, &p, shard, slot, now);
+}
+
+// firewall_check and firewall_check_batch may touch any shard, they use the
+// reader slot of the first one.
+static action_t check_one(firewall_t *firewall, void *packet,
+                          size_t packet_len, timestamp_t now) {
+  firewall_auto_commit(firewall);
+  shard_t *reader = &firewall->shards[0];
+  const ruleset_t *rules = ruleset_enter(firewall, reader);
+  action_t verdict =
+      check_packet(firewall, rules, packet, packet_len, SHARD_AUTO, 0, now);
+  ruleset_exit(reader);
+  return verdict;
+}
+
+action_t firewall_check(firewall_t *firewall, void *packet, size_t packet_len) {
+  return check_one(firewall, packet, packet_len, TIMESTAMP_LAZY);
+}
+
+action_t firewall_check_at(firewall_t *firewall, void *packet,
+                           size_t packet_len, uint64_t now_us) {
+  return check_one(firewall, packet, packet_len, timestamp_at(now_us));
+}
+
+/**
+ * Batches are processed in chunks of BATCH_CHUNK_SIZE packets. Every stage
+ * runs over the whole chunk before the next one starts: a first pass computes
+ * the hashes of all packets and prefetches the table slots they will probe,
+ * a second pass does the probes, so the cache misses of one chunk overlap
+ * instead of being paid one after the other.
+ *
+ * Packets that are already dropped skip the remaining stages, which doesn't
+ * change their verdict. The clock is read once per chunk.
+ */
+#define BATCH_CHUNK_SIZE 64
+
+static void check_chunk(firewall_t *firewall, const ruleset_t *rules,
+                        void **packets, const size_t *lens, action_t *out,
+                        size_t n, timestamp_t *now) {
+  firewall_packet_t info[BATCH_CHUNK_SIZE];
+  size_t slots[BATCH_CHUNK_SIZE];
+  uint64_t hashes[BATCH_CHUNK_SIZE];
+  // Indices of the packets that still need the L3/L4 stages
+  size_t pending[BATCH_CHUNK_SIZE];
+  size_t num_pending = 0;
+  STATS(slot_stats_t *stats = &firewall->shards[0].stats;
+        uint64_t clock = stats_now(); size_t num_parsed = 0;)
+
+  // Verdict cache slot of every IPv4 packet, and whether it holds its verdict
+  const verdict_cache_t *cache = &firewall->shards[0].verdicts;
+  verdict_entry_t *cached[BATCH_CHUNK_SIZE];
+  bool hit[BATCH_CHUNK_SIZE];
+  STATS(uint32_t mac_rules[BATCH_CHUNK_SIZE];
+        uint32_t blacklist_rules[BATCH_CHUNK_SIZE];)
+
+  // Parse stage
+  for (size_t i = 0; i < n; ++i) {
+    cached[i] = NULL;
+    hit[i] = false;
+    if (!parse_packet(packets[i], lens[i], &info[i])) {
+      out[i] = ACTION_DROP;
+      continue;
+    }
+    out[i] = ACTION_PASS;
+    pending[num_pending++] = i;
+  }
+  STATS(stats_stage(stats, FIREWALL_STAGE_PARSE, &clock, n);
+        num_parsed = num_pending;)
+
+  if (cache->entries) {
+    for (size_t k = 0; k < num_pending; ++k) {
+      size_t i = pending[k];
+      if (!info[i].is_ip) continue;
+      verdict_entry_t key = packet_verdict_key(&info[i], rules->generation);
+      cached[i] = verdict_cache_slot(cache, &key);
+      __builtin_prefetch(cached[i]);
+    }
+  }
+
+  // MAC stage, verdict cache hits skip it and the blacklist stage
+  size_t num_ip = 0;
+  STATS(size_t num_classified = 0;)
+  for (size_t k = 0; k < num_pending; ++k) {
+    size_t i = pending[k];
+    if (cached[i]) {
+      verdict_entry_t key = packet_verdict_key(&info[i], rules->generation);
+      hit[i] = verdict_entry_match(cached[i], &key);
+    }
+    if (hit[i]) {
+      STATS(verdict_entry_count(rules, 0, cached[i], lens[i]);)
+      out[i] = cached[i]->verdict;
+    } else {
+      const uint64_t *mac =
+          mac_table_lookup(&rules->mac_rules, packet_src_mac(&info[i]));
+      STATS(mac_rules[i] =
+                mac ? rules->mac_rules.rules[mac - rules->mac_rules.slots]
+                    : RULE_NONE;
+            blacklist_rules[i] = RULE_NONE;
+            if (mac) ruleset_count(rules, 0, RULE_MAC, mac_rules[i], lens[i]);)
+      out[i] = mac_slot_action(mac);
+    }
+    if (out[i] == ACTION_PASS && info[i].is_ip) {
+      pending[num_ip++] = i;
+      STATS(num_classified += !hit[i];)
+    }
+  }
+  STATS(stats_stage(stats, FIREWALL_STAGE_MAC, &clock, num_parsed);)
+  num_pending = num_ip;
+
+  // Blacklist stage, one tuple at a time across the chunk. Like
+  // classifier_match, only the tuples whose lengths are in the length sets
+  // of some packet are visited.
+  const classifier_t *cls = &rules->classifier;
+  uint64_t src_lens[BATCH_CHUNK_SIZE];
+  uint64_t dest_lens[BATCH_CHUNK_SIZE];
+  uint64_t chunk_src_lens = 0;
+  uint64_t chunk_dest_lens = 0;
+  if (cls->num_tuples > 0) {
+    for (size_t k = 0; k < num_pending; ++k) {
+      // Empty length sets for cache hits, no tuple is a candidate then
+      size_t i = pending[k];
+      if (hit[i]) {
+        src_lens[k] = dest_lens[k] = 0;
+        continue;
+      }
+      src_lens[k] = lpm_lookup(&cls->src_lpm, info[i].srcip) & cls->src_lens;
+      dest_lens[k] =
+          lpm_lookup(&cls->dest_lpm, info[i].destip) & cls->dest_lens;
+      chunk_src_lens |= src_lens[k];
+      chunk_dest_lens |= dest_lens[k];
+    }
+  }
+  for (uint64_t sl = chunk_src_lens; sl; sl &= sl - 1) {
+    const int32_t *row = cls->tuple_of[__builtin_ctzll(sl)];
+    for (uint64_t dl = chunk_dest_lens; dl; dl &= dl - 1) {
+      int32_t t = row[__builtin_ctzll(dl)];
+      if (t < 0) continue;
+      const tuple_t *tuple = &cls->tuples[t];
+      for (size_t k = 0; k < num_pending; ++k) {
+        if (!tuple_candidate(tuple, src_lens[k], dest_lens[k])) continue;
+        const firewall_packet_t *p = &info[pending[k]];
+        slots[k] =
+            tuple_slot(tuple, (protocol_t)p->proto, p->srcip, p->destip);
+        __builtin_prefetch(&cls->slots[tuple->slots_start + slots[k]]);
+      }
+      for (size_t k = 0; k < num_pending; ++k) {
+        size_t i = pending[k];
+        if (out[i] == ACTION_DROP ||
+            !tuple_candidate(tuple, src_lens[k], dest_lens[k]))
+          continue;
+        const tuple_entry_t *entry =
+            tuple_match(cls, tuple, slots[k], (protocol_t)info[i].proto,
+                        info[i].srcip, info[i].destip, info[i].destport);
+        if (!entry) continue;
+        STATS(blacklist_rules[i] =
+                  tuple_entry_rule(cls, entry, info[i].destport);
+              ruleset_count(rules, 0, RULE_BLACKLIST, blacklist_rules[i],
+                            lens[i]);)
+        out[i] = ACTION_DROP;
+      }
+    }
+  }
+  STATS(stats_stage(stats, FIREWALL_STAGE_BLACKLIST, &clock, num_classified);)
+
+  // Remember the verdicts of the misses
+  for (size_t i = 0; i < n; ++i) {
+    if (!cached[i] || hit[i]) continue;
+    verdict_entry_t key = packet_verdict_key(&info[i], rules->generation);
+    key.verdict = (uint8_t)out[i];
+    STATS(key.mac_rule = mac_rules[i];
+          key.blacklist_rule = blacklist_rules[i];)
+    *cached[i] = key;
+  }
+
+  // Content and rate limiting only apply to TCP and UDP
+  size_t num_l4 = 0;
+  for (size_t k = 0; k < num_pending; ++k) {
+    size_t i = pending[k];
+    if (out[i] != ACTION_DROP && info[i].proto != PROTOCOL_OTHER)
+      pending[num_l4++] = i;
+  }
+  num_pending = num_l4;
+
+  // Content stage
+  const content_matcher_t *m = &rules->content_matcher;
+  if (m->slots) {
+    // Only payloads as long as some pattern are hashed, slots[] holds them
+    size_t num_candidates = 0;
+    for (size_t k = 0; k < num_pending; ++k) {
+      const firewall_packet_t *p = &info[pending[k]];
+      if (!content_matcher_candidate(m, packet_payload_len(p))) continue;
+      uint64_t h = hash_bytes(packet_payload(p), packet_payload_len(p));
+      __builtin_prefetch(&m->slots[h & m->slot_mask]);
+      hashes[num_candidates] = h;
+      slots[num_candidates++] = pending[k];
+    }
+    for (size_t c = 0; c < num_candidates; ++c) {
+      size_t i = slots[c];
+      const content_slot_t *content = content_matcher_lookup(
+          m, hashes[c], packet_payload(&info[i]), packet_payload_len(&info[i]));
+      if (!content) continue;
+      STATS(ruleset_count(rules, 0, RULE_CONTENT, content->rule, lens[i]);)
+      out[i] = ACTION_DROP;
+    }
+  }
+
+  // Stream rules, in packet order as segments of a flow depend on each other
+  const stream_matcher_t *sm = &rules->stream_matcher;
+  if (sm->next) {
+    size_t num_segments = 0;
+    for (size_t k = 0; k < num_pending; ++k) {
+      const firewall_packet_t *p = &info[pending[k]];
+      if (out[pending[k]] == ACTION_DROP || p->proto != PROTOCOL_TCP ||
+          packet_payload_len(p) == 0)
+        continue;
+      flow_key_t key = packet_flow_key(p);
+      hashes[num_segments] = flow_hash(&key);
+      size_t shard = shard_of(&key, firewall->num_shards);
+      const flow_table_t *streams = &firewall->shards[shard].streams;
+      if (streams->slots) {
+        __builtin_prefetch(
+            &streams->slots[hashes[num_segments] & streams->slot_mask]);
+      }
+      slots[num_segments++] = pending[k];
+    }
+    if (num_segments > 0) timestamp_resolve(now);
+    for (size_t c = 0; c < num_segments; ++c) {
+      size_t i = slots[c];
+      flow_key_t key = packet_flow_key(&info[i]);
+      size_t shard = shard_of(&key, firewall->num_shards);
+      uint32_t accepted = check_stream(
+          sm, &firewall->shards[shard].streams, &key, hashes[c],
+          packet_payload(&info[i]), packet_payload_len(&info[i]), now->us);
+      if (accepted == STREAM_NONE) continue;
+      STATS(ruleset_count(rules, 0, RULE_STREAM,
+                          stream_matcher_rule(sm, accepted), lens[i]);)
+      out[i] = ACTION_DROP;
+    }
+  }
+  STATS(stats_stage(stats, FIREWALL_STAGE_CONTENT, &clock, num_pending);)
+
+  // Rate limit stage, in packet order so that flows see their packets in
+  // the same order as with firewall_check
+  if (!ruleset_ratelimits(rules)) return;
+  size_t num_passed = 0;
+  for (size_t k = 0; k < num_pending; ++k) {
+    if (out[pending[k]] != ACTION_DROP) pending[num_passed++] = pending[k];
+  }
+  num_pending = num_passed;
+  for (size_t k = 0; k < num_pending; ++k) {
+    flow_key_t key = packet_flow_key(&info[pending[k]]);
+    hashes[k] = flow_hash(&key);
+    slots[k] = shard_of(&key, firewall->num_shards);
+    const flow_table_t *flows = &firewall->shards[slots[k]].flows;
+    if (flows->slots)
+      __builtin_prefetch(&flows->slots[hashes[k] & flows->slot_mask]);
+  }
+  timestamp_resolve(now);
+  for (size_t k = 0; k < num_pending; ++k) {
+    size_t i = pending[k];
+    flow_key_t key = packet_flow_key(&info[i]);
+    out[i] = check_ratelimit(rules, &firewall->shards[slots[k]], &key,
+                             hashes[k], packet_payload_len(&info[i]),
+                             firewall->num_shards, now->us);
+    STATS(if (out[i] == ACTION_DROP)
+              stats_count(&stats->ratelimit_drops, lens[i]);)
+  }
+  STATS(stats_stage(stats, FIREWALL_STAGE_RATELIMIT, &clock, num_pending);)
+}
+
+static void check_batch(firewall_t *firewall, void **packets, size_t *lens,
+                        action_t *out, size_t n, timestamp_t now) {
+  firewall_auto_commit(firewall);
+  shard_t *reader = &firewall->shards[0];
+  for (size_t base = 0; base < n; base += BATCH_CHUNK_SIZE) {
+    size_t count = n - base < BATCH_CHUNK_SIZE ? n - base : BATCH_CHUNK_SIZE;
+    // One critical section per chunk keeps grace periods short
+    const ruleset_t *rules = ruleset_enter(firewall, reader);
+    check_chunk(firewall, rules, packets + base, lens + base, out + base,
+                count, &now);
+    ruleset_exit(reader);
+  }
+}
+
+void firewall_check_batch(firewall_t *firewall, void **packets,
+                          size_t *lens, action_t *out, size_t n) {
+  check_batch(firewall, packets, lens, out, n, TIMESTAMP_LAZY);
+}
+
+void firewall_check_batch_at(firewall_t *firewall, void **packets,
+                             size_t *lens, action_t *out, size_t n,
+                             uint64_t now_us) {
+  check_batch(firewall, packets, lens, out, n, timestamp_at(now_us));
+}
+
+bool firewall_configure_shards(firewall_t *firewall, size_t num_shards) {
+  if (num_shards == 0) return false;
+
+  shard_t *shards = shards_create(num_shards, firewall->verdict_cache_entries);
+  if (!shards) return false;
+  size_t flow_limit = shard_flow_limit(firewall->max_flows, num_shards);
+  for (size_t i = 0; i < num_shards; ++i) {
+    shards[i].flows.max_flows = flow_limit;
+    shards[i].streams.max_flows = flow_limit;
+    shards[i].sources.max_sources = flow_limit;
+  }
+
+#ifdef FIREWALL_STATS
+  // Counters are per reader slot: retire the current ones into the totals
+  ruleset_t *rules =
+      atomic_load_explicit(&firewall->rules, memory_order_relaxed);
+  ruleset_t resized;
+  if (!ruleset_stats_alloc(&resized, rules->num_rules, num_shards)) {
+    shards_free(shards, num_shards);
+    return false;
+  }
+  ruleset_stats_add(firewall->stats.rules, rules, firewall->num_shards);
+  for (size_t i = 0; i < firewall->num_shards; ++i)
+    stats_add_slot(&firewall->stats, &firewall->shards[i].stats);
+  free(rules->counters);
+  rules->counters = resized.counters;
+  rules->counters_stride = resized.counters_stride;
+#endif
+
+  for (size_t i = 0; i < firewall->num_shards; ++i) {
+    const shard_t *shard = &firewall->shards[i];
+    firewall->retired_evictions +=
+        atomic_load_explicit(&shard->flows.evictions, memory_order_relaxed) +
+        atomic_load_explicit(&shard->streams.evictions, memory_order_relaxed);
+  }
+  shards_free(firewall->shards, firewall->num_shards);
+  firewall->shards = shards;
+  firewall->num_shards = num_shards;
+
+  // Workers never commit staged rules, do it now
+  firewall_auto_commit(firewall);
+  return true;
+}
+
+bool firewall_configure_verdict_cache(firewall_t *firewall, size_t entries) {
+  if (entries > SIZE_MAX / 2 / sizeof(verdict_entry_t)) return false;
+  size_t num_entries = entries ? 1 : 0;
+  while (num_entries < entries) num_entries *= 2;
+
+  // Build all the caches first so that a failure changes nothing
+  verdict_cache_t *caches =
+      calloc(firewall->num_shards, sizeof(verdict_cache_t));
+  bool ok = caches != NULL;
+  for (size_t i = 0; ok && i < firewall->num_shards; ++i)
+    ok = verdict_cache_init(&caches[i], num_entries);
+  if (!ok) {
+    for (size_t i = 0; caches && i < firewall->num_shards; ++i)
+      verdict_cache_free(&caches[i]);
+    free(caches);
+    return false;
+  }
+
+  for (size_t i = 0; i < firewall->num_shards; ++i) {
+    verdict_cache_free(&firewall->shards[i].verdicts);
+    firewall->shards[i].verdicts = caches[i];
+  }
+  free(caches);
+  firewall->verdict_cache_entries = num_entries;
+  return true;
+}
+
+void firewall_configure_flow_limit(firewall_t *firewall, size_t max_flows,
+                                   size_t max_bytes) {
+  if (max_bytes && (!max_flows || max_bytes / FLOW_BYTES < max_flows))
+    max_flows = max_bytes / FLOW_BYTES ? max_bytes / FLOW_BYTES : 1;
+  firewall->max_flows = max_flows;
+
+  size_t limit = shard_flow_limit(max_flows, firewall->num_shards);
+  for (size_t i = 0; i < 2 * firewall->num_shards; ++i) {
+    shard_t *shard = &firewall->shards[i / 2];
+    flow_table_t *table = i % 2 ? &shard->streams : &shard->flows;
+    table->max_flows = limit;
+    // Keeps released records out of full tables, see flow_table_evict
+    if (limit && table->flows_used > limit) {
+      firewall->retired_evictions +=
+          atomic_load_explicit(&table->evictions, memory_order_relaxed);
+      flow_table_free(table);
+    }
+  }
+  for (size_t i = 0; i < firewall->num_shards; ++i) {
+    source_table_t *sources = &firewall->shards[i].sources;
+    sources->max_sources = limit;
+    if (limit && sources->size > limit) source_table_free(sources);
+  }
+}
+
+void firewall_flow_stats(const firewall_t *firewall,
+                         firewall_flow_stats_t *stats) {
+  stats->flows = 0;
+  stats->evictions = firewall->retired_evictions;
+  stats->max_flows = firewall->max_flows;
+  for (size_t i = 0; i < 2 * firewall->num_shards; ++i) {
+    const shard_t *shard = &firewall->shards[i / 2];
+    const flow_table_t *table = i % 2 ? &shard->streams : &shard->flows;
+    stats->flows += atomic_load_explicit(&table->num_flows,
+                                         memory_order_relaxed);
+    stats->evictions += atomic_load_explicit(&table->evictions,
+                                             memory_order_relaxed);
+  }
+}
+
+size_t firewall_flow_shard(const firewall_t *firewall, const void *packet,
+                           size_t packet_len) {
+  firewall_packet_t p;
+  if (!parse_packet(packet, packet_len, &p)) return 0;
+  return firewall_packet_shard(firewall, &p);
+}
+
+bool firewall_parse(const void *packet, size_t packet_len,
+                    firewall_packet_t *p) {
+  return parse_packet(packet, packet_len, p);
+}
+
+size_t firewall_packet_shard(const firewall_t *firewall,
+                             const firewall_packet_t *p) {
+  if (!p->is_ip) return 0;
+  flow_key_t key = packet_flow_key(p);
+  return shard_of(&key, firewall->num_shards);
+}
+
+static action_t check_shard(firewall_t *firewall, size_t shard, void *packet,
+                            size_t packet_len, timestamp_t now) {
+  shard_t *reader = &firewall->shards[shard];
+  const ruleset_t *rules = ruleset_enter(firewall, reader);
+  action_t verdict =
+      check_packet(firewall, rules, packet, packet_len, shard, shard, now);
+  ruleset_exit(reader);
+  return verdict;
+}
+
+action_t firewall_check_shard(firewall_t *firewall, size_t shard, void *packet,
+                              size_t packet_len) {
+  return check_shard(firewall, shard, packet, packet_len, TIMESTAMP_LAZY);
+}
+
+action_t firewall_check_shard_at(firewall_t *firewall, size_t shard,
+                                 void *packet, size_t packet_len,
+                                 uint64_t now_us) {
+  return check_shard(firewall, shard, packet, packet_len,
+                     timestamp_at(now_us));
+}
+
+action_t firewall_check_parsed(firewall_t *firewall, size_t shard,
+                               const firewall_packet_t *p, uint64_t now_us) {
+  shard_t *reader = &firewall->shards[shard];
+  const ruleset_t *rules = ruleset_enter(firewall, reader);
+  action_t verdict =
+      check_parsed(firewall, rules, p, shard, shard, timestamp_at(now_us));
+  ruleset_exit(reader);
+  return verdict;
+}
+
+bool firewall_stats_snapshot(firewall_t *firewall, firewall_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+#ifdef FIREWALL_STATS
+  const stats_totals_t *totals = &firewall->stats;
+  size_t num_rules[NUM_RULE_KINDS];
+  firewall_num_rules(firewall, num_rules);
+  firewall_counter_t *counters[NUM_RULE_KINDS];
+  bool ok = true;
+  for (size_t k = 0; k < NUM_RULE_KINDS; ++k) {
+    counters[k] = calloc(num_rules[k] ? num_rules[k] : 1,
+                         sizeof(firewall_counter_t));
+    ok = ok && counters[k];
+  }
+  if (!ok) {
+    for (size_t k = 0; k < NUM_RULE_KINDS; ++k) free(counters[k]);
+    return false;
+  }
+
+  // Staged rules can outnumber the totals, never the other way around
+  for (size_t k = 0; k < NUM_RULE_KINDS; ++k) {
+    if (totals->num_rules[k] > 0)
+      memcpy(counters[k], totals->rules[k],
+             totals->num_rules[k] * sizeof(firewall_counter_t));
+  }
+  ruleset_stats_add(counters, atomic_load(&firewall->rules),
+                    firewall->num_shards);
+
+  stats_totals_t slots = {
+      .ratelimit_drops = totals->ratelimit_drops,
+  };
+  memcpy(slots.stage_cycles, totals->stage_cycles, sizeof(slots.stage_cycles));
+  memcpy(slots.stage_packets, totals->stage_packets,
+         sizeof(slots.stage_packets));
+  for (size_t i = 0; i < firewall->num_shards; ++i)
+    stats_add_slot(&slots, &firewall->shards[i].stats);
+
+  stats->mac_rules = counters[RULE_MAC];
+  stats->num_mac_rules = num_rules[RULE_MAC];
+  stats->blacklist_rules = counters[RULE_BLACKLIST];
+  stats->num_blacklist_rules = num_rules[RULE_BLACKLIST];
+  stats->content_rules = counters[RULE_CONTENT];
+  stats->num_content_rules = num_rules[RULE_CONTENT];
+  stats->stream_rules = counters[RULE_STREAM];
+  stats->num_stream_rules = num_rules[RULE_STREAM];
+  stats->ratelimit_drops = slots.ratelimit_drops;
+  memcpy(stats->stage_cycles, slots.stage_cycles, sizeof(slots.stage_cycles));
+  memcpy(stats->stage_packets, slots.stage_packets,
+         sizeof(slots.stage_packets));
+  return true;
+#else
+  (void)firewall;
+  return false;
+#endif
+}
+
+void firewall_stats_free(firewall_stats_t *stats) {
+  free(stats->mac_rules);
+  free(stats->blacklist_rules);
+  free(stats->content_rules);
+  free(stats->stream_rules);
+  memset(stats, 0, sizeof(*stats));
+}
+
+// ==========================================
+//                PIPELINE
+// ==========================================
+
+/**
+ * Pipelined mode spreads a check over three threads: stage 0 parses, stage 1
+ * runs the MAC, blacklist, content and stream rules, stage 2 the rate limit.
+ * Consecutive stages are connected by single-producer single-consumer rings
+ * of packet descriptors. The application fills the first ring and drains the
+ * last one, so packets keep their order end to end and a flow sees its
+ * packets in the same order as with firewall_check.
+ *
+ * The head and tail of a ring sit on their own cache lines. Each side keeps a
+ * private copy of the other side's index and only reloads it when the ring
+ * looks full (or empty), so a burst normally costs one store per side and no
+ * cache line bouncing besides the descriptors themselves.
+ *
+ * Stage i uses shard i as its reader slot (and statistics slot). Stage 1
+ * owns the stream tables and stage 2 the rate limit flow tables of all
+ * shards.
+ */
+
+#define PIPELINE_STAGES 3
+#define PIPELINE_BURST 32
+
+typedef struct {
+  const void *packet;
+  size_t len;
+  firewall_packet_t p;  // set by stage 0
+  action_t verdict;
+} pipeline_item_t;
+
+typedef struct {
+  alignas(CACHE_LINE_SIZE) _Atomic size_t head;  // written by the consumer
+  size_t tail_cache;  // the consumer's copy of tail
+  alignas(CACHE_LINE_SIZE) _Atomic size_t tail;  // written by the producer
+  size_t head_cache;  // the producer's copy of head
+  alignas(CACHE_LINE_SIZE) pipeline_item_t *items;
+  size_t mask;
+} spsc_ring_t;
+
+typedef struct {
+  firewall_pipeline_t *pipeline;
+  size_t index;
+} pipeline_stage_t;
+
+struct firewall_pipeline {
+  // Ring i feeds stage i, the last one holds the verdicts
+  spsc_ring_t rings[PIPELINE_STAGES + 1];
+  firewall_t *firewall;
+  pipeline_stage_t stages[PIPELINE_STAGES];
+  pthread_t threads[PIPELINE_STAGES];
+  atomic_bool stop;
+};
+
+static inline pipeline_item_t *ring_item(const spsc_ring_t *ring,
+                                         size_t index) {
+  return &ring->items[index & ring->mask];
+}
+
+// Consumer side: number of items ready to read, at most `max`, starting at
+// index `*head`
+static size_t ring_readable(spsc_ring_t *ring, size_t max, size_t *head) {
+  *head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t n = ring->tail_cache - *head;
+  if (n < max) {
+    ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    n = ring->tail_cache - *head;
+  }
+  return n < max ? n : max;
+}
+
+static inline void ring_consume(spsc_ring_t *ring, size_t head, size_t n) {
+  atomic_store_explicit(&ring->head, head + n, memory_order_release);
+}
+
+// Producer side: number of free slots, at most `max`, starting at index
+// `*tail`
+static size_t ring_writable(spsc_ring_t *ring, size_t max, size_t *tail) {
+  *tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t n = ring->mask + 1 - (*tail - ring->head_cache);
+  if (n < max) {
+    ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+    n = ring->mask + 1 - (*tail - ring->head_cache);
+  }
+  return n < max ? n : max;
+}
+
+static inline void ring_produce(spsc_ring_t *ring, size_t tail, size_t n) {
+  atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+}
+
+static void pipeline_run_item(firewall_t *firewall, const ruleset_t *rules,
+                              size_t stage, pipeline_item_t *item,
+                              timestamp_t *now) {
+  switch (stage) {
+    case 0: {
+      STATS(uint64_t clock = stats_now();)
+      bool parsed = parse_packet(item->packet, item->len, &item->p);
+      STATS(stats_stage(&firewall->shards[0].stats, FIREWALL_STAGE_PARSE,
+                        &clock, 1);)
+      item->verdict = parsed ? ACTION_PASS : ACTION_DROP;
+      break;
+    }
+    case 1:
+      if (item->verdict == ACTION_PASS)
+        item->verdict =
+            check_rules(firewall, rules, &item->p, SHARD_AUTO, 1, now);
+      break;
+    default:
+      if (item->verdict == ACTION_PASS)
+        item->verdict =
+            check_flow(firewall, rules, &item->p, SHARD_AUTO, 2, now);
+      break;
+  }
+}
+
+static void *pipeline_stage_main(void *arg) {
+  const pipeline_stage_t *stage = arg;
+  firewall_pipeline_t *pipeline = stage->pipeline;
+  firewall_t *firewall = pipeline->firewall;
+  spsc_ring_t *in = &pipeline->rings[stage->index];
+  spsc_ring_t *out = &pipeline->rings[stage->index + 1];
+  shard_t *reader = &firewall->shards[stage->index];
+
+  while (!atomic_load_explicit(&pipeline->stop, memory_order_relaxed)) {
+    size_t head, tail;
+    size_t n = ring_readable(in, PIPELINE_BURST, &head);
+    if (n > 0) n = ring_writable(out, n, &tail);
+    if (n == 0) {
+      sched_yield();
+      continue;
+    }
+
+    // One critical section and one clock read per burst, stage 0 reads no
+    // rules
+    timestamp_t now = TIMESTAMP_LAZY;
+    const ruleset_t *rules =
+        stage->index > 0 ? ruleset_enter(firewall, reader) : NULL;
+    for (size_t k = 0; k < n; ++k) {
+      pipeline_item_t *item = ring_item(in, head + k);
+      pipeline_run_item(firewall, rules, stage->index, item, &now);
+      *ring_item(out, tail + k) = *item;
+    }
+    if (rules) ruleset_exit(reader);
+    ring_consume(in, head, n);
+    ring_produce(out, tail, n);
+  }
+  return NULL;
+}
+
+static void pipeline_free(firewall_pipeline_t *pipeline) {
+  for (size_t i = 0; i <= PIPELINE_STAGES; ++i)
+    free(pipeline->rings[i].items);
+  free(pipeline);
+}
+
+firewall_pipeline_t *firewall_pipeline_create(firewall_t *firewall,
+                                              size_t ring_size) {
+  if (ring_size == 0 || ring_size > SIZE_MAX / 2 / sizeof(pipeline_item_t))
+    return NULL;
+  size_t num_items = 1;
+  while (num_items < ring_size) num_items *= 2;
+
+  firewall_pipeline_t *pipeline =
+      aligned_alloc(CACHE_LINE_SIZE, sizeof(firewall_pipeline_t));
+  if (!pipeline) return NULL;
+  memset(pipeline, 0, sizeof(*pipeline));
+  bool ok = true;
+  for (size_t i = 0; i <= PIPELINE_STAGES; ++i) {
+    spsc_ring_t *ring = &pipeline->rings[i];
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->items = malloc(num_items * sizeof(pipeline_item_t));
+    ring->mask = num_items - 1;
+    ok = ok && ring->items;
+  }
+  if (!ok || !firewall_configure_shards(firewall, PIPELINE_STAGES)) {
+    pipeline_free(pipeline);
+    return NULL;
+  }
+  pipeline->firewall = firewall;
+  atomic_init(&pipeline->stop, false);
+
+  size_t started = 0;
+  for (; started < PIPELINE_STAGES; ++started) {
+    pipeline->stages[started] = (pipeline_stage_t){pipeline, started};
+    if (pthread_create(&pipeline->threads[started], NULL, pipeline_stage_main,
+                       &pipeline->stages[started]) != 0)
+      break;
+  }
+  if (started < PIPELINE_STAGES) {
+    atomic_store(&pipeline->stop, true);
+    for (size_t i = 0; i < started; ++i)
+      pthread_join(pipeline->threads[i], NULL);
+    pipeline_free(pipeline);
+    return NULL;
+  }
+  return pipeline;
+}
+
+void firewall_pipeline_destroy(firewall_pipeline_t *pipeline) {
+  if (!pipeline) return;
+  atomic_store(&pipeline->stop, true);
+  for (size_t i = 0; i < PIPELINE_STAGES; ++i)
+    pthread_join(pipeline->threads[i], NULL);
+  pipeline_free(pipeline);
+}
+
+size_t firewall_pipeline_submit(firewall_pipeline_t *pipeline, void **packets,
+                                size_t *lens, size_t n) {
+  spsc_ring_t *ring = &pipeline->rings[0];
+  size_t tail;
+  n = ring_writable(ring, n, &tail);
+  for (size_t k = 0; k < n; ++k) {
+    pipeline_item_t *item = ring_item(ring, tail + k);
+    item->packet = packets[k];
+    item->len = lens[k];
+  }
+  ring_produce(ring, tail, n);
+  return n;
+}
+
+size_t firewall_pipeline_poll(firewall_pipeline_t *pipeline,
+                              firewall_verdict_t *out, size_t max) {
+  spsc_ring_t *ring = &pipeline->rings[PIPELINE_STAGES];
+  size_t head;
+  size_t n = ring_readable(ring, max, &head);
+  for (size_t k = 0; k < n; ++k) {
+    const pipeline_item_t *item = ring_item(ring, head + k);
+    out[k] = (firewall_verdict_t){(void *)item->packet, item->verdict};
+  }
+  ring_consume(ring, head, n);
+  return n;
+}
@@ -1,11 +1,14 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <float.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "../greatest.h"
@@ -262,6 +265,41 @@ TEST test_mac_pass_before_drop() {
   PASS();
 }
 
+TEST test_mac_many_rules() {
+  // Rule i drops or passes 02:00:00:xx:xx:xx, every third address gets a
+  // second, conflicting rule that must win.
+  enum { NUM_MACS = 5000 };
+  firewall_t *fw = firewall_create();
+  for (int i = 0; i < NUM_MACS; i++) {
+    uint8_t mac[6] = {0x02, 0, 0, (uint8_t)(i >> 16), (uint8_t)(i >> 8),
+                      (uint8_t)i};
+    firewall_add_mac_rule(fw, mac, i % 2 ? ACTION_DROP : ACTION_PASS);
+  }
+  for (int i = 0; i < NUM_MACS; i += 3) {
+    uint8_t mac[6] = {0x02, 0, 0, (uint8_t)(i >> 16), (uint8_t)(i >> 8),
+                      (uint8_t)i};
+    firewall_add_mac_rule(fw, mac, i % 2 ? ACTION_PASS : ACTION_DROP);
+  }
+
+  uint8_t raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  for (int i = 0; i < NUM_MACS + 100; i++) {
+    char mac[18];
+    snprintf(mac, sizeof(mac), "02:00:00:%02x:%02x:%02x", (i >> 16) & 0xff,
+             (i >> 8) & 0xff, i & 0xff);
+    size_t len = build_packet(raw, &pkt, mac, "ff:ff:ff:ff:ff:ff", "1.2.3.4",
+                              "5.6.7.8", PROTOCOL_TCP, 80, 80, NULL);
+
+    bool drop = i % 2 != 0;
+    if (i % 3 == 0) drop = !drop;
+    if (i >= NUM_MACS) drop = false;  // no rule
+    ASSERT_EQ(drop ? ACTION_DROP : ACTION_PASS, firewall_check(fw, pkt, len));
+  }
+
+  firewall_destroy(fw);
+  PASS();
+}
+
 // ==========================================
 //        FEATURE 2: BLACKLIST RULES
 // ==========================================
@@ -459,6 +497,250 @@ TEST test_blacklist_max_port() {
   PASS();
 }
 
+TEST test_blacklist_many_rules() {
+  // Large rule sets must keep the "any rule matches -> DROP" semantics.
+  // Rule i blocks TCP from 10.0.x.y to 20.0.x.y on ports [i % 1000, +10].
+  firewall_t *fw = firewall_create();
+  for (int i = 0; i < 20000; i++) {
+    ipaddr_t src = (10u << 24) | (uint32_t)i;
+    ipaddr_t dst = (20u << 24) | (uint32_t)i;
+    port_t start = (port_t)(i % 1000);
+    firewall_add_blacklist_rule(fw, PROTOCOL_TCP, src, dst, start, start + 10);
+  }
+  // Wildcard source rule on a high port
+  firewall_add_blacklist_rule(fw, PROTOCOL_UDP, 0, 0, 50000, 50010);
+
+  uint8_t raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  for (int i = 0; i < 20000; i += 997) {
+    char src[32], dst[32];
+    snprintf(src, sizeof(src), "10.0.%d.%d", (i >> 8) & 0xff, i & 0xff);
+    snprintf(dst, sizeof(dst), "20.0.%d.%d", (i >> 8) & 0xff, i & 0xff);
+    port_t start = (port_t)(i % 1000);
+
+    size_t len = build_packet(raw, &pkt, "00:00:00:00:00:00",
+                              "00:00:00:00:00:00", src, dst, PROTOCOL_TCP,
+                              1234, start + 5, NULL);
+    ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+
+    // Right addresses, port just outside of the range
+    len = build_packet(raw, &pkt, "00:00:00:00:00:00", "00:00:00:00:00:00",
+                       src, dst, PROTOCOL_TCP, 1234, start + 11, NULL);
+    ASSERT_EQ(ACTION_PASS, firewall_check(fw, pkt, len));
+
+    // Swapped addresses
+    len = build_packet(raw, &pkt, "00:00:00:00:00:00", "00:00:00:00:00:00",
+                       dst, src, PROTOCOL_TCP, 1234, start + 5, NULL);
+    ASSERT_EQ(ACTION_PASS, firewall_check(fw, pkt, len));
+  }
+
+  size_t len = build_packet(raw, &pkt, "00:00:00:00:00:00", "00:00:00:00:00:00",
+                            "10.0.0.1", "20.0.0.1", PROTOCOL_UDP, 1234, 50005,
+                            NULL);
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+
+  firewall_destroy(fw);
+  PASS();
+}
+
+static size_t build_ip_packet(uint8_t *raw, uint8_t **pkt, ipaddr_t src,
+                              ipaddr_t dst, protocol_t proto, port_t destport) {
+  char src_str[16], dst_str[16];
+  snprintf(src_str, sizeof(src_str), "%u.%u.%u.%u", src >> 24,
+           (src >> 16) & 0xff, (src >> 8) & 0xff, src & 0xff);
+  snprintf(dst_str, sizeof(dst_str), "%u.%u.%u.%u", dst >> 24,
+           (dst >> 16) & 0xff, (dst >> 8) & 0xff, dst & 0xff);
+  return build_packet(raw, pkt, "00:00:00:00:00:00", "00:00:00:00:00:00",
+                      src_str, dst_str, proto, 1234, destport, NULL);
+}
+
+TEST test_blacklist_prefix() {
+  firewall_t *fw = firewall_create();
+  ipaddr_t net, host, sub;
+  parse_ip("10.1.0.0", &net);
+  parse_ip("192.168.1.7", &host);
+  parse_ip("172.16.5.96", &sub);
+
+  // 10.1.0.0/16 -> anywhere, 172.16.5.96/27 -> 192.168.1.7, anything -> /0
+  firewall_add_blacklist_prefix_rule(fw, PROTOCOL_TCP, net, 16, 0, 0, 80, 80);
+  firewall_add_blacklist_prefix_rule(fw, PROTOCOL_UDP, sub, 27, host, 32, 53,
+                                     53);
+  firewall_add_blacklist_prefix_rule(fw, PROTOCOL_TCP, 0, 0, 0, 0, 22, 22);
+  // Lengths above 32 are exact addresses
+  firewall_add_blacklist_prefix_rule(fw, PROTOCOL_TCP, host, 40, host, 33, 25,
+                                     25);
+
+  uint8_t raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  size_t len;
+  ipaddr_t other;
+  parse_ip("8.8.8.8", &other);
+
+  len = build_ip_packet(raw, &pkt, net, other, PROTOCOL_TCP, 80);
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+  len = build_ip_packet(raw, &pkt, net | 0xffff, other, PROTOCOL_TCP, 80);
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+  len = build_ip_packet(raw, &pkt, net + 0x10000, other, PROTOCOL_TCP, 80);
+  ASSERT_EQ(ACTION_PASS, firewall_check(fw, pkt, len));
+  len = build_ip_packet(raw, &pkt, net - 1, other, PROTOCOL_TCP, 80);
+  ASSERT_EQ(ACTION_PASS, firewall_check(fw, pkt, len));
+
+  // Prefixes longer than /24 split a /24 block
+  len = build_ip_packet(raw, &pkt, sub, host, PROTOCOL_UDP, 53);
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+  len = build_ip_packet(raw, &pkt, sub + 31, host, PROTOCOL_UDP, 53);
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+  len = build_ip_packet(raw, &pkt, sub + 32, host, PROTOCOL_UDP, 53);
+  ASSERT_EQ(ACTION_PASS, firewall_check(fw, pkt, len));
+  len = build_ip_packet(raw, &pkt, sub - 1, host, PROTOCOL_UDP, 53);
+  ASSERT_EQ(ACTION_PASS, firewall_check(fw, pkt, len));
+  len = build_ip_packet(raw, &pkt, sub, host + 1, PROTOCOL_UDP, 53);
+  ASSERT_EQ(ACTION_PASS, firewall_check(fw, pkt, len));
+
+  len = build_ip_packet(raw, &pkt, other, other, PROTOCOL_TCP, 22);
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+  len = build_ip_packet(raw, &pkt, host, host, PROTOCOL_TCP, 25);
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+  len = build_ip_packet(raw, &pkt, host + 1, host, PROTOCOL_TCP, 25);
+  ASSERT_EQ(ACTION_PASS, firewall_check(fw, pkt, len));
+
+  firewall_destroy(fw);
+  PASS();
+}
+
+TEST test_blacklist_prefix_commits() {
+  // Commits that leave the prefixes of one side alone reuse its table
+  firewall_t *fw = firewall_create();
+  ipaddr_t net, host, other;
+  parse_ip("10.0.0.0", &net);
+  parse_ip("192.168.1.7", &host);
+  parse_ip("8.8.8.8", &other);
+
+  uint8_t raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  size_t len;
+  firewall_add_blacklist_prefix_rule(fw, PROTOCOL_TCP, net, 8, 0, 0, 80, 80);
+  len = build_ip_packet(raw, &pkt, net | 0x123456, other, PROTOCOL_TCP, 80);
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+
+  // Exact addresses are not in the tables
+  firewall_add_blacklist_rule(fw, PROTOCOL_TCP, host, other, 22, 22);
+  len = build_ip_packet(raw, &pkt, host, other, PROTOCOL_TCP, 22);
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+  len = build_ip_packet(raw, &pkt, net | 0x123456, other, PROTOCOL_TCP, 80);
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+
+  // A new destination prefix, the source side stays
+  firewall_add_blacklist_prefix_rule(fw, PROTOCOL_UDP, 0, 0, other, 16, 53,
+                                     53);
+  len = build_ip_packet(raw, &pkt, host, other | 0xffff, PROTOCOL_UDP, 53);
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+  len = build_ip_packet(raw, &pkt, net | 0x123456, other, PROTOCOL_TCP, 80);
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+  len = build_ip_packet(raw, &pkt, net - 1, other, PROTOCOL_TCP, 80);
+  ASSERT_EQ(ACTION_PASS, firewall_check(fw, pkt, len));
+
+  // And the other way around
+  firewall_add_blacklist_prefix_rule(fw, PROTOCOL_TCP, host, 24, 0, 0, 25, 25);
+  ASSERT(firewall_commit(fw));
+  len = build_ip_packet(raw, &pkt, host | 0xff, host, PROTOCOL_TCP, 25);
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+  len = build_ip_packet(raw, &pkt, host, other | 0xff, PROTOCOL_UDP, 53);
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+  len = build_ip_packet(raw, &pkt, net, other, PROTOCOL_TCP, 80);
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+
+  firewall_destroy(fw);
+  PASS();
+}
+
+typedef struct {
+  protocol_t proto;
+  ipaddr_t src;
+  uint8_t src_len;
+  ipaddr_t dst;
+  uint8_t dst_len;
+  port_t start;
+  port_t end;
+} prefix_rule_t;
+
+static bool prefix_contains(ipaddr_t net, uint8_t len, ipaddr_t addr) {
+  return len == 0 || ((net ^ addr) >> (32 - len)) == 0;
+}
+
+static uint32_t test_rand(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return (uint32_t)(*state >> 16);
+}
+
+TEST test_blacklist_prefix_random() {
+  // Compare against a linear scan over nested random prefixes of all lengths,
+  // one packet at a time and in batches
+  enum { NUM_RULES = 3000, NUM_PACKETS = 20000, BATCH = 64 };
+  static prefix_rule_t rules[NUM_RULES];
+  static uint8_t batch_raw[BATCH][RAW_BUFFER_SIZE];
+  void *batch[BATCH];
+  size_t batch_lens[BATCH];
+  action_t batch_expected[BATCH], batch_out[BATCH];
+  uint64_t rng = 0x9e3779b97f4a7c15ULL;
+  firewall_t *fw = firewall_create();
+
+  for (int i = 0; i < NUM_RULES; i++) {
+    prefix_rule_t *r = &rules[i];
+    r->proto = test_rand(&rng) % 2 ? PROTOCOL_TCP : PROTOCOL_UDP;
+    // Keep addresses in a few /8s so prefixes overlap
+    r->src = (10u + test_rand(&rng) % 3) << 24 | (test_rand(&rng) & 0xffffff);
+    r->dst = (20u + test_rand(&rng) % 3) << 24 | (test_rand(&rng) & 0xffffff);
+    r->src_len = (uint8_t)(test_rand(&rng) % 3 == 0 ? test_rand(&rng) % 33
+                                                   : 8 + test_rand(&rng) % 25);
+    r->dst_len = (uint8_t)(test_rand(&rng) % 33);
+    r->start = (port_t)(test_rand(&rng) % 1000);
+    r->end = (port_t)(r->start + test_rand(&rng) % 100);
+    firewall_add_blacklist_prefix_rule(fw, r->proto, r->src, r->src_len,
+                                       r->dst, r->dst_len, r->start, r->end);
+  }
+
+  uint8_t raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  for (int i = 0; i < NUM_PACKETS; i++) {
+    // Start from a rule's addresses and flip some low bits
+    const prefix_rule_t *base = &rules[test_rand(&rng) % NUM_RULES];
+    ipaddr_t src = base->src ^ (test_rand(&rng) >> (test_rand(&rng) % 32));
+    ipaddr_t dst = base->dst ^ (test_rand(&rng) >> (test_rand(&rng) % 32));
+    protocol_t proto = test_rand(&rng) % 2 ? PROTOCOL_TCP : PROTOCOL_UDP;
+    port_t port = (port_t)(test_rand(&rng) % 1100);
+
+    action_t expected = ACTION_PASS;
+    for (int j = 0; j < NUM_RULES; j++) {
+      const prefix_rule_t *r = &rules[j];
+      if (r->proto == proto && prefix_contains(r->src, r->src_len, src) &&
+          prefix_contains(r->dst, r->dst_len, dst) && port >= r->start &&
+          port <= r->end) {
+        expected = ACTION_DROP;
+        break;
+      }
+    }
+
+    size_t len = build_ip_packet(raw, &pkt, src, dst, proto, port);
+    ASSERT_EQ(expected, firewall_check(fw, pkt, len));
+
+    int b = i % BATCH;
+    batch_lens[b] = build_ip_packet(batch_raw[b], &pkt, src, dst, proto, port);
+    batch[b] = pkt;
+    batch_expected[b] = expected;
+    if (b == BATCH - 1) {
+      firewall_check_batch(fw, batch, batch_lens, batch_out, BATCH);
+      for (int j = 0; j < BATCH; j++)
+        ASSERT_EQ(batch_expected[j], batch_out[j]);
+    }
+  }
+
+  firewall_destroy(fw);
+  PASS();
+}
+
 // ==========================================
 //        FEATURE 3: CONTENT RULES
 // ==========================================
@@ -648,6 +930,210 @@ TEST test_content_large_payload_exact() {
   PASS();
 }
 
+TEST test_content_many_rules() {
+  firewall_t *fw = firewall_create();
+  char pattern[32];
+  for (int i = 0; i < 5000; i++) {
+    int n = snprintf(pattern, sizeof(pattern), "pattern-%d", i);
+    firewall_add_content_rule(fw, pattern, (size_t)n);
+  }
+  // Duplicate patterns are allowed
+  firewall_add_content_rule(fw, "pattern-7", 9);
+
+  uint8_t raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  for (int i = 0; i < 5000; i += 499) {
+    snprintf(pattern, sizeof(pattern), "pattern-%d", i);
+    size_t len =
+        build_packet(raw, &pkt, "00:00:00:00:00:00", "00:00:00:00:00:00",
+                     "1.1.1.1", "2.2.2.2", PROTOCOL_UDP, 80, 80, pattern);
+    ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+
+    // One byte longer than the pattern -> PASS
+    strcat(pattern, "x");
+    len = build_packet(raw, &pkt, "00:00:00:00:00:00", "00:00:00:00:00:00",
+                       "1.1.1.1", "2.2.2.2", PROTOCOL_UDP, 80, 80, pattern);
+    ASSERT_EQ(ACTION_PASS, firewall_check(fw, pkt, len));
+  }
+
+  firewall_destroy(fw);
+  PASS();
+}
+
+TEST test_content_pattern_lengths() {
+  // Patterns around the 64 byte words of the length filter, payloads of
+  // every length next to them
+  static const size_t pattern_lens[] = {1, 63, 64, 65, 128, 1400};
+  firewall_t *fw = firewall_create();
+  char data[1402];
+  memset(data, 'B', sizeof(data));
+  for (size_t p = 0; p < sizeof(pattern_lens) / sizeof(*pattern_lens); p++)
+    firewall_add_content_rule(fw, data, pattern_lens[p]);
+
+  uint8_t raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  for (size_t len = 0; len <= 1401; len++) {
+    data[len] = '\0';
+    size_t pkt_len =
+        build_packet(raw, &pkt, "00:00:00:00:00:00", "00:00:00:00:00:00",
+                     "1.1.1.1", "2.2.2.2", PROTOCOL_UDP, 80, 80, data);
+    data[len] = 'B';
+    bool listed = false;
+    for (size_t p = 0; p < sizeof(pattern_lens) / sizeof(*pattern_lens); p++)
+      listed = listed || pattern_lens[p] == len;
+    ASSERT_EQ(listed ? ACTION_DROP : ACTION_PASS,
+              firewall_check(fw, pkt, pkt_len));
+  }
+
+  firewall_destroy(fw);
+  PASS();
+}
+
+// Checks a TCP segment from srcip:srcport to destip:destport
+static action_t check_segment(firewall_t *fw, const char *srcip,
+                              uint16_t srcport, const char *destip,
+                              uint16_t destport, const char *payload) {
+  uint8_t raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  size_t len = build_packet(raw, &pkt, "00:00:00:00:00:00",
+                            "00:00:00:00:00:00", srcip, destip, PROTOCOL_TCP,
+                            srcport, destport, payload);
+  return firewall_check(fw, pkt, len);
+}
+
+TEST test_content_stream_across_segments() {
+  firewall_t *fw = firewall_create();
+  firewall_add_stream_rule(fw, "attack", 6);
+  firewall_add_stream_rule(fw, "usher", 5);
+  firewall_add_stream_rule(fw, "hers", 4);
+  firewall_add_stream_rule(fw, "", 0);  // never matches
+
+  // Split across three segments, the one completing it is dropped
+  ASSERT_EQ(ACTION_PASS, check_segment(fw, "1.1.1.1", 1000, "2.2.2.2", 80,
+                                       "xxatt"));
+  ASSERT_EQ(ACTION_PASS, check_segment(fw, "1.1.1.1", 1000, "2.2.2.2", 80,
+                                       "ac"));
+  ASSERT_EQ(ACTION_DROP, check_segment(fw, "1.1.1.1", 1000, "2.2.2.2", 80,
+                                       "k!"));
+  // Within one segment
+  ASSERT_EQ(ACTION_DROP, check_segment(fw, "1.1.1.1", 1001, "2.2.2.2", 80,
+                                       "an attack"));
+  // The two directions of a connection are separate streams
+  ASSERT_EQ(ACTION_PASS, check_segment(fw, "1.1.1.1", 1002, "2.2.2.2", 80,
+                                       "att"));
+  ASSERT_EQ(ACTION_PASS, check_segment(fw, "2.2.2.2", 80, "1.1.1.1", 1002,
+                                       "ack"));
+  // Overlapping patterns
+  ASSERT_EQ(ACTION_PASS, check_segment(fw, "1.1.1.1", 1003, "2.2.2.2", 80,
+                                       "us"));
+  ASSERT_EQ(ACTION_PASS, check_segment(fw, "1.1.1.1", 1003, "2.2.2.2", 80,
+                                       "he"));
+  ASSERT_EQ(ACTION_DROP, check_segment(fw, "1.1.1.1", 1003, "2.2.2.2", 80,
+                                       "r"));
+  ASSERT_EQ(ACTION_DROP, check_segment(fw, "1.1.1.1", 1004, "2.2.2.2", 80,
+                                       "ushe-hers"));
+
+  // UDP datagrams are not streams
+  uint8_t raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  size_t len = build_packet(raw, &pkt, "00:00:00:00:00:00",
+                            "00:00:00:00:00:00", "1.1.1.1", "2.2.2.2",
+                            PROTOCOL_UDP, 1005, 53, "attack");
+  ASSERT_EQ(ACTION_PASS, firewall_check(fw, pkt, len));
+
+  // A batch sees the segments of a flow in order
+  static const char *const segments[] = {"at", "ta", "ck", "at"};
+  uint8_t raws[4][RAW_BUFFER_SIZE];
+  void *pkts[4];
+  size_t lens[4];
+  action_t out[4];
+  for (size_t i = 0; i < 4; i++) {
+    uint8_t *p;
+    lens[i] = build_packet(raws[i], &p, "00:00:00:00:00:00",
+                           "00:00:00:00:00:00", "1.1.1.1", "2.2.2.2",
+                           PROTOCOL_TCP, i == 3 ? 1007 : 1006, 80,
+                           segments[i]);
+    pkts[i] = p;
+  }
+  firewall_check_batch(fw, pkts, lens, out, 4);
+  ASSERT_EQ(ACTION_PASS, out[0]);
+  ASSERT_EQ(ACTION_PASS, out[1]);
+  ASSERT_EQ(ACTION_DROP, out[2]);
+  ASSERT_EQ(ACTION_PASS, out[3]);
+
+  firewall_stats_t stats;
+  if (firewall_stats_snapshot(fw, &stats)) {
+    ASSERT_EQ(4, stats.num_stream_rules);
+    ASSERT_EQ(3, stats.stream_rules[0].packets);  // attack
+    ASSERT_EQ(1, stats.stream_rules[1].packets);  // usher
+    ASSERT_EQ(1, stats.stream_rules[2].packets);  // hers
+    ASSERT_EQ(0, stats.stream_rules[3].packets);
+    firewall_stats_free(&stats);
+  }
+
+  firewall_destroy(fw);
+
+  // Streams start over when the stream rules change, the matcher state of
+  // the old rules is meaningless under the new ones
+  fw = firewall_create();
+  firewall_add_stream_rule(fw, "xyz", 3);
+  ASSERT_EQ(ACTION_PASS, check_segment(fw, "1.1.1.1", 1000, "2.2.2.2", 80,
+                                       "xy"));
+  firewall_add_stream_rule(fw, "zz", 2);
+  ASSERT_EQ(ACTION_PASS, check_segment(fw, "1.1.1.1", 1000, "2.2.2.2", 80,
+                                       "z"));
+  ASSERT_EQ(ACTION_DROP, check_segment(fw, "1.1.1.1", 1000, "2.2.2.2", 80,
+                                       "z"));
+  firewall_destroy(fw);
+  PASS();
+}
+
+TEST test_content_stream_matches_naive() {
+  // Random patterns and segments over a 3 letter alphabet, checked against
+  // a search of the whole stream of every flow
+  enum { NUM_PATTERNS = 20, NUM_FLOWS = 4, STREAM_LEN = 4096 };
+  firewall_t *fw = firewall_create();
+  char patterns[NUM_PATTERNS][8];
+  size_t pattern_lens[NUM_PATTERNS];
+  for (size_t p = 0; p < NUM_PATTERNS; p++) {
+    pattern_lens[p] = 2 + rand() % 6;
+    for (size_t j = 0; j < pattern_lens[p]; j++)
+      patterns[p][j] = (char)('a' + rand() % 3);
+    firewall_add_stream_rule(fw, patterns[p], pattern_lens[p]);
+  }
+
+  static char streams[NUM_FLOWS][STREAM_LEN];
+  size_t stream_lens[NUM_FLOWS] = {0};
+  for (;;) {
+    size_t f = (size_t)rand() % NUM_FLOWS;
+    size_t n = 1 + rand() % 12;
+    if (stream_lens[f] + n > STREAM_LEN) break;
+    char payload[13];
+    for (size_t j = 0; j < n; j++)
+      payload[j] = (char)('a' + rand() % 3);
+    payload[n] = '\0';
+    memcpy(streams[f] + stream_lens[f], payload, n);
+    size_t end = stream_lens[f] + n;
+
+    // Does an occurrence end within this segment?
+    bool expected = false;
+    for (size_t p = 0; p < NUM_PATTERNS && !expected; p++) {
+      for (size_t e = stream_lens[f] + 1; e <= end && !expected; e++) {
+        expected = e >= pattern_lens[p] &&
+                   memcmp(streams[f] + e - pattern_lens[p], patterns[p],
+                          pattern_lens[p]) == 0;
+      }
+    }
+    stream_lens[f] = end;
+    ASSERT_EQ(expected ? ACTION_DROP : ACTION_PASS,
+              check_segment(fw, "1.1.1.1", (uint16_t)(2000 + f), "2.2.2.2",
+                            80, payload));
+  }
+
+  firewall_destroy(fw);
+  PASS();
+}
+
 // ==========================================
 //        FEATURE 4: RATE LIMIT RULES
 // ==========================================
@@ -1292,6 +1778,345 @@ TEST test_ratelimit_self_loop() {
   PASS();
 }
 
+TEST test_ratelimit_many_flows_expire() {
+  // Lots of concurrent flows, all of which time out together
+  firewall_t *fw = firewall_create();
+  firewall_configure_ratelimit(fw, 1000, 200000);  // 0.2s timeout
+
+  char payload[801];
+  memset(payload, 'A', 800);
+  payload[800] = '\0';
+  uint8_t raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  char src_ip[32];
+  const int num_flows = 20000;
+
+  for (int round = 0; round < 2; round++) {
+    for (int i = 0; i < num_flows; i++) {
+      snprintf(src_ip, sizeof(src_ip), "10.%d.%d.1", i >> 8, i & 0xff);
+      size_t len =
+          build_packet(raw, &pkt, "00:00:00:00:00:00", "00:00:00:00:00:00",
+                       src_ip, "2.2.2.2", PROTOCOL_UDP, 1000, 53, payload);
+      // Fresh flow: 800 fits. Second packet: 1600 > 1000.
+      ASSERT_EQ(ACTION_PASS, firewall_check(fw, pkt, len));
+      ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+    }
+    // All flows expire, the next round starts from empty buckets
+    usleep(300000);
+  }
+
+  firewall_destroy(fw);
+  PASS();
+}
+
+TEST test_ratelimit_caller_timestamps() {
+  // With caller supplied timestamps drain is exact and deterministic
+  firewall_t *fw = firewall_create();
+  firewall_configure_ratelimit(fw, 1000, 1000000);
+
+  char payload[501];
+  memset(payload, 'A', 500);
+  payload[500] = '\0';
+  uint8_t raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  size_t len =
+      build_packet(raw, &pkt, "00:00:00:00:00:00", "00:00:00:00:00:00",
+                   "1.1.1.1", "2.2.2.2", PROTOCOL_TCP, 10, 20, payload);
+
+  uint64_t t = 5000000;
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t));  // 500
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t));  // 1000
+  ASSERT_EQ(ACTION_DROP, firewall_check_at(fw, pkt, len, t));
+  // 1us drains 0.001 bytes, not enough
+  ASSERT_EQ(ACTION_DROP, firewall_check_at(fw, pkt, len, t + 1));
+  // Exactly 500 bytes drained since t, 500 + 500 fits
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t + 500000));
+  // Going back in time drains nothing
+  ASSERT_EQ(ACTION_DROP, firewall_check_at(fw, pkt, len, t));
+  // Past the timeout the flow starts over
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t + 2000000));
+
+  // One timestamp for a whole burst
+  void *pkts[3] = {pkt, pkt, pkt};
+  size_t lens[3] = {len, len, len};
+  action_t out[3];
+  firewall_check_batch_at(fw, pkts, lens, out, 3, t + 3500000);
+  ASSERT_EQ(ACTION_PASS, out[0]);  // timed out again, starts empty
+  ASSERT_EQ(ACTION_PASS, out[1]);
+  ASSERT_EQ(ACTION_DROP, out[2]);
+
+  // Every value is a valid timestamp, the largest is not a "read the clock"
+  t = UINT64_MAX - 500000;
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t));
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t));
+  ASSERT_EQ(ACTION_DROP, firewall_check_at(fw, pkt, len, t));
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, UINT64_MAX));
+
+  firewall_destroy(fw);
+  PASS();
+}
+
+TEST test_ratelimit_timestamp_jump() {
+  // Long idle gaps must not cost a timer wheel step per tick
+  firewall_t *fw = firewall_create();
+  firewall_configure_ratelimit(fw, 1000, UINT64_MAX);
+
+  char payload[501];
+  memset(payload, 'A', 500);
+  payload[500] = '\0';
+  uint8_t raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  size_t len =
+      build_packet(raw, &pkt, "00:00:00:00:00:00", "00:00:00:00:00:00",
+                   "1.1.1.1", "2.2.2.2", PROTOCOL_TCP, 10, 20, payload);
+
+  uint64_t t = 5000000;
+  uint64_t day = 86400ULL * 1000000;
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t));
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t));
+  ASSERT_EQ(ACTION_DROP, firewall_check_at(fw, pkt, len, t));
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t + day));
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t + 100 * day));
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, UINT64_MAX / 2));
+  firewall_flow_stats_t stats;
+  firewall_flow_stats(fw, &stats);
+  ASSERT_EQ(1, stats.flows);
+
+  firewall_destroy(fw);
+
+  // Flows idle past their timeout are still released after the jump
+  fw = firewall_create();
+  firewall_configure_ratelimit(fw, 1000, 1000000);
+  for (uint16_t i = 0; i < 100; ++i) {
+    uint8_t flow_raw[RAW_BUFFER_SIZE];
+    uint8_t *flow;
+    size_t flow_len = build_packet(
+        flow_raw, &flow, "00:00:00:00:00:00", "00:00:00:00:00:00",
+        "3.3.3.3", "4.4.4.4", PROTOCOL_UDP, 1000 + i, 53, "A");
+    ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, flow, flow_len, t + i));
+  }
+  firewall_flow_stats(fw, &stats);
+  ASSERT_EQ(100, stats.flows);
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t + 100 * day));
+  firewall_flow_stats(fw, &stats);
+  ASSERT_EQ(1, stats.flows);
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t + 100 * day));
+  ASSERT_EQ(ACTION_DROP, firewall_check_at(fw, pkt, len, t + 100 * day));
+
+  firewall_destroy(fw);
+  PASS();
+}
+
+TEST test_ratelimit_flow_limit() {
+  // A flood of new flows must not evict a flow that keeps sending
+  firewall_t *fw = firewall_create();
+  firewall_configure_ratelimit(fw, 1000, 1000000);
+  firewall_configure_flow_limit(fw, 4, 0);
+
+  char payload[501];
+  memset(payload, 'A', 500);
+  payload[500] = '\0';
+  uint8_t raw[RAW_BUFFER_SIZE], small_raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt, *small;
+  size_t len =
+      build_packet(raw, &pkt, "00:00:00:00:00:00", "00:00:00:00:00:00",
+                   "1.1.1.1", "2.2.2.2", PROTOCOL_TCP, 10, 20, payload);
+  size_t small_len =
+      build_packet(small_raw, &small, "00:00:00:00:00:00", "00:00:00:00:00:00",
+                   "1.1.1.1", "2.2.2.2", PROTOCOL_TCP, 10, 20, "A");
+
+  uint64_t t = 5000000;
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t));  // 500
+  for (uint16_t i = 0; i < 100; ++i) {
+    uint8_t flood_raw[RAW_BUFFER_SIZE];
+    uint8_t *flood;
+    size_t flood_len = build_packet(
+        flood_raw, &flood, "00:00:00:00:00:00", "00:00:00:00:00:00",
+        "3.3.3.3", "4.4.4.4", PROTOCOL_UDP, 1000 + i, 53, "A");
+    ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, flood, flood_len,
+                                             t + 10 * i + 1));
+    ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, small, small_len,
+                                             t + 10 * i + 2));
+  }
+
+  firewall_flow_stats_t stats;
+  firewall_flow_stats(fw, &stats);
+  ASSERT_EQ(4, stats.flows);
+  ASSERT_EQ(97, stats.evictions);
+  ASSERT_EQ(4, stats.max_flows);
+  // The bucket survived the flood: ~599 bytes + 500 is over the limit
+  ASSERT_EQ(ACTION_DROP, firewall_check_at(fw, pkt, len, t + 1000));
+
+  // The byte budget converts to flows, a shrunk limit empties the table
+  firewall_configure_flow_limit(fw, 1000, 800);
+  firewall_flow_stats(fw, &stats);
+  ASSERT_EQ(10, stats.max_flows);
+  ASSERT_EQ(4, stats.flows);
+  firewall_configure_flow_limit(fw, 2, 0);
+  firewall_flow_stats(fw, &stats);
+  ASSERT_EQ(0, stats.flows);
+  ASSERT_EQ(97, stats.evictions);
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t + 1000));
+
+  firewall_configure_flow_limit(fw, 0, 0);
+  firewall_flow_stats(fw, &stats);
+  ASSERT_EQ(0, stats.max_flows);
+
+  // Flows last seen at the largest timestamp can still be evicted
+  firewall_configure_flow_limit(fw, 2, 0);
+  for (uint16_t i = 0; i < 3; ++i) {
+    uint8_t late_raw[RAW_BUFFER_SIZE];
+    uint8_t *late;
+    size_t late_len = build_packet(
+        late_raw, &late, "00:00:00:00:00:00", "00:00:00:00:00:00",
+        "5.5.5.5", "6.6.6.6", PROTOCOL_UDP, 1000 + i, 53, "A");
+    ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, late, late_len, UINT64_MAX));
+  }
+  firewall_flow_stats(fw, &stats);
+  ASSERT_EQ(2, stats.flows);
+  ASSERT_EQ(98, stats.evictions);
+
+  firewall_destroy(fw);
+  PASS();
+}
+
+// A TCP packet with a 500 byte payload from srcip:srcport to 2.2.2.2:80
+static size_t build_source_packet(uint8_t *raw, uint8_t **pkt,
+                                  const char *srcip, uint16_t srcport) {
+  char payload[501];
+  memset(payload, 'A', 500);
+  payload[500] = '\0';
+  return build_packet(raw, pkt, "00:00:00:00:00:00", "00:00:00:00:00:00",
+                      srcip, "2.2.2.2", PROTOCOL_TCP, srcport, 80, payload);
+}
+
+TEST test_ratelimit_burst() {
+  firewall_t *fw = firewall_create();
+  firewall_configure_ratelimit(fw, 1000, 1000000);
+  firewall_configure_ratelimit_burst(fw, 1500);
+
+  uint8_t raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  size_t len = build_source_packet(raw, &pkt, "1.1.1.1", 10);
+  uint64_t t = 5000000;
+  for (int i = 0; i < 3; i++)
+    ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t));
+  ASSERT_EQ(ACTION_DROP, firewall_check_at(fw, pkt, len, t));
+  // Still drains at the rate: 500 bytes after half a second
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t + 500000));
+  ASSERT_EQ(ACTION_DROP, firewall_check_at(fw, pkt, len, t + 500000));
+
+  // 0 goes back to one second of traffic
+  firewall_configure_ratelimit_burst(fw, 0);
+  len = build_source_packet(raw, &pkt, "1.1.1.1", 11);
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t));
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t));
+  ASSERT_EQ(ACTION_DROP, firewall_check_at(fw, pkt, len, t));
+
+  firewall_destroy(fw);
+  PASS();
+}
+
+TEST test_ratelimit_source_aggregate() {
+  // Opening more ports doesn't get a source past its aggregate bucket
+  firewall_t *fw = firewall_create();
+  firewall_configure_ratelimit(fw, 1000, 1000000);
+  firewall_configure_source_ratelimit(fw, 1000, 1500);
+
+  uint8_t raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  uint64_t t = 5000000;
+  for (uint16_t port = 10; port < 13; port++) {
+    size_t len = build_source_packet(raw, &pkt, "1.1.1.1", port);
+    ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t));
+  }
+  size_t len = build_source_packet(raw, &pkt, "1.1.1.1", 13);
+  ASSERT_EQ(ACTION_DROP, firewall_check_at(fw, pkt, len, t));
+  // Other sources have their own bucket
+  uint8_t other_raw[RAW_BUFFER_SIZE];
+  uint8_t *other;
+  size_t other_len = build_source_packet(other_raw, &other, "1.1.1.2", 13);
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, other, other_len, t));
+
+  // The drop filled neither bucket: after one second the source holds 500
+  // bytes and the flow nothing, so two more packets fit into both
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t + 1000000));
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t + 1000000));
+  ASSERT_EQ(ACTION_DROP, firewall_check_at(fw, pkt, len, t + 1000000));
+
+  // Without per-flow limits a single flow gets the whole burst
+  firewall_t *sources = firewall_create();
+  firewall_configure_source_ratelimit(sources, 1000, 0);
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(sources, pkt, len, t));
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(sources, pkt, len, t));
+  ASSERT_EQ(ACTION_DROP, firewall_check_at(sources, pkt, len, t));
+  // Same verdicts in a batch
+  firewall_configure_source_ratelimit(sources, 1000, 500);
+  void *pkts[3] = {pkt, other, pkt};
+  size_t lens[3] = {len, other_len, len};
+  action_t out[3];
+  firewall_check_batch_at(sources, pkts, lens, out, 3, t + 1000000);
+  ASSERT_EQ(ACTION_PASS, out[0]);
+  ASSERT_EQ(ACTION_PASS, out[1]);
+  ASSERT_EQ(ACTION_DROP, out[2]);
+  // Disabled again
+  firewall_configure_source_ratelimit(sources, 0, 0);
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(sources, pkt, len, t + 1000000));
+
+  firewall_destroy(fw);
+  firewall_destroy(sources);
+  PASS();
+}
+
+TEST test_ratelimit_source_shards() {
+  // Every shard enforces its share of the source's rate and burst
+  firewall_t *fw = firewall_create();
+  ASSERT(firewall_configure_shards(fw, 2));
+  firewall_configure_source_ratelimit(fw, 2000, 2000);
+
+  uint8_t raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  size_t len = build_source_packet(raw, &pkt, "1.1.1.1", 10);
+  uint64_t t = 5000000;
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t));
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t));
+  ASSERT_EQ(ACTION_DROP, firewall_check_at(fw, pkt, len, t));
+  // Half the rate: 250 bytes drained after 250ms, 500 after 500ms
+  ASSERT_EQ(ACTION_DROP, firewall_check_at(fw, pkt, len, t + 250000));
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t + 500000));
+
+  firewall_destroy(fw);
+  PASS();
+}
+
+TEST test_ratelimit_source_limit() {
+  // A flood of spoofed sources must not evict a source with a full bucket
+  firewall_t *fw = firewall_create();
+  firewall_configure_source_ratelimit(fw, 1000, 1000);
+  firewall_configure_flow_limit(fw, 2, 0);
+
+  uint8_t raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  size_t len = build_source_packet(raw, &pkt, "1.1.1.1", 10);
+  uint64_t t = 5000000;
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t));
+  ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, pkt, len, t));
+  for (int i = 0; i < 100; i++) {
+    uint8_t flood_raw[RAW_BUFFER_SIZE];
+    uint8_t *flood;
+    char srcip[16];
+    snprintf(srcip, sizeof(srcip), "3.3.%d.%d", i / 250, i % 250 + 1);
+    size_t flood_len = build_packet(
+        flood_raw, &flood, "00:00:00:00:00:00", "00:00:00:00:00:00", srcip,
+        "4.4.4.4", PROTOCOL_UDP, 1000, 53, "A");
+    ASSERT_EQ(ACTION_PASS, firewall_check_at(fw, flood, flood_len, t + i));
+  }
+  ASSERT_EQ(ACTION_DROP, firewall_check_at(fw, pkt, len, t + 100));
+
+  firewall_destroy(fw);
+  PASS();
+}
+
 TEST test_combined_mac_drop_blacklist_pass() {
   // Scenario: MAC rule says DROP. No Blacklist rule matches (default PASS).
   // Result: DROP.
@@ -1525,6 +2350,750 @@ TEST test_combined_protocol_mismatch_content_drop() {
   PASS();
 }
 
+// ==========================================
+//              BATCHED CHECKS
+// ==========================================
+
+#define BATCH_TEST_SIZE 200
+
+// Configures the same rules on a fresh firewall
+static firewall_t *create_batch_test_firewall(void) {
+  firewall_t *fw = firewall_create();
+  uint8_t mac[6];
+  parse_mac("aa:aa:aa:aa:aa:aa", mac);
+  firewall_add_mac_rule(fw, mac, ACTION_DROP);
+  firewall_add_blacklist_rule(fw, PROTOCOL_TCP, 0, 0, 23, 23);
+  ipaddr_t src;
+  parse_ip("10.0.0.7", &src);
+  firewall_add_blacklist_rule(fw, PROTOCOL_UDP, src, 0, 0, 65535);
+  firewall_add_content_rule(fw, "virus", 5);
+  firewall_configure_ratelimit(fw, 1000, 1000000);
+  return fw;
+}
+
+// Fills raw[i] with a mix of packets hitting every rule type. Returns the
+// packet pointers and lengths through pkts/lens.
+static void build_batch_packets(uint8_t raw[][RAW_BUFFER_SIZE], void **pkts,
+                                size_t *lens) {
+  char payload[301];
+  memset(payload, 'A', 300);
+  payload[300] = '\0';
+
+  for (int i = 0; i < BATCH_TEST_SIZE; i++) {
+    char src_ip[32];
+    snprintf(src_ip, sizeof(src_ip), "10.0.0.%d", i % 10);
+    const char *src_mac =
+        i % 13 == 0 ? "aa:aa:aa:aa:aa:aa" : "11:11:11:11:11:11";
+    protocol_t proto = i % 3 == 0 ? PROTOCOL_UDP : PROTOCOL_TCP;
+    uint16_t dest_port = i % 7 == 0 ? 23 : 80;
+    const char *data = i % 11 == 0 ? "virus" : payload;
+
+    uint8_t *pkt;
+    lens[i] = build_packet(raw[i], &pkt, src_mac, "22:22:22:22:22:22", src_ip,
+                           "10.1.0.1", proto, 1000, dest_port, data);
+    pkts[i] = pkt;
+  }
+  // Truncated packet
+  lens[BATCH_TEST_SIZE - 1] = sizeof(ethhdr_t) + 10;
+}
+
+TEST test_batch_matches_single() {
+  static uint8_t raw[BATCH_TEST_SIZE][RAW_BUFFER_SIZE];
+  void *pkts[BATCH_TEST_SIZE];
+  size_t lens[BATCH_TEST_SIZE];
+  action_t batch_out[BATCH_TEST_SIZE];
+  build_batch_packets(raw, pkts, lens);
+
+  firewall_t *single = create_batch_test_firewall();
+  firewall_t *batch = create_batch_test_firewall();
+
+  // Uneven burst sizes to cover partial chunks
+  size_t done = 0;
+  size_t burst = 1;
+  while (done < BATCH_TEST_SIZE) {
+    size_t n = BATCH_TEST_SIZE - done < burst ? BATCH_TEST_SIZE - done : burst;
+    firewall_check_batch(batch, pkts + done, lens + done, batch_out + done, n);
+    done += n;
+    burst = burst * 3 + 1;
+  }
+
+  size_t drops = 0;
+  for (int i = 0; i < BATCH_TEST_SIZE; i++) {
+    action_t expected = firewall_check(single, pkts[i], lens[i]);
+    ASSERT_EQ(expected, batch_out[i]);
+    drops += expected == ACTION_DROP;
+  }
+  // Every rule type should have triggered
+  ASSERT(drops > BATCH_TEST_SIZE / 2);
+  ASSERT(drops < BATCH_TEST_SIZE);
+
+  firewall_destroy(single);
+  firewall_destroy(batch);
+  PASS();
+}
+
+TEST test_batch_empty() {
+  firewall_t *fw = firewall_create();
+  firewall_check_batch(fw, NULL, NULL, NULL, 0);
+  firewall_destroy(fw);
+  PASS();
+}
+
+// ==========================================
+//              SHARDED MODE
+// ==========================================
+
+#define SHARD_TEST_FLOWS 64
+#define SHARD_TEST_PACKETS (SHARD_TEST_FLOWS * 4)
+#define SHARD_TEST_THREADS 4
+
+typedef struct {
+  firewall_t *fw;
+  size_t shard;
+  void **pkts;
+  size_t *lens;
+  action_t *out;
+  size_t n;
+} shard_worker_t;
+
+// Checks the packets of one shard, in order
+static void *shard_worker(void *arg) {
+  shard_worker_t *w = arg;
+  for (size_t i = 0; i < w->n; i++) {
+    if (firewall_flow_shard(w->fw, w->pkts[i], w->lens[i]) != w->shard)
+      continue;
+    w->out[i] = firewall_check_shard(w->fw, w->shard, w->pkts[i], w->lens[i]);
+  }
+  return NULL;
+}
+
+TEST test_shard_symmetric() {
+  firewall_t *fw = firewall_create();
+  ASSERT(firewall_configure_shards(fw, 16));
+
+  uint8_t raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  size_t hits[16] = {0};
+  for (int i = 0; i < 256; i++) {
+    char ip[32];
+    snprintf(ip, sizeof(ip), "10.0.%d.%d", i / 16, i % 16);
+    size_t len = build_packet(raw, &pkt, "00:00:00:00:00:00",
+                              "00:00:00:00:00:00", ip, "2.2.2.2", PROTOCOL_TCP,
+                              (uint16_t)(1000 + i), 443, NULL);
+    size_t shard = firewall_flow_shard(fw, pkt, len);
+    ASSERT(shard < 16);
+    hits[shard]++;
+
+    // Reverse direction lands on the same shard
+    len = build_packet(raw, &pkt, "00:00:00:00:00:00", "00:00:00:00:00:00",
+                       "2.2.2.2", ip, PROTOCOL_TCP, 443, (uint16_t)(1000 + i),
+                       NULL);
+    ASSERT_EQ(shard, firewall_flow_shard(fw, pkt, len));
+  }
+  // Flows are spread over all shards
+  for (int i = 0; i < 16; i++) ASSERT(hits[i] > 0);
+
+  ASSERT_FALSE(firewall_configure_shards(fw, 0));
+  firewall_destroy(fw);
+  PASS();
+}
+
+TEST test_shard_threads_match_single() {
+  static uint8_t raw[SHARD_TEST_PACKETS][RAW_BUFFER_SIZE];
+  void *pkts[SHARD_TEST_PACKETS];
+  size_t lens[SHARD_TEST_PACKETS];
+  action_t out[SHARD_TEST_PACKETS];
+
+  char payload[301];
+  memset(payload, 'A', 300);
+  payload[300] = '\0';
+  for (int i = 0; i < SHARD_TEST_PACKETS; i++) {
+    char ip[32];
+    int flow = i % SHARD_TEST_FLOWS;
+    snprintf(ip, sizeof(ip), "10.0.0.%d", flow);
+    uint8_t *pkt;
+    // Every 8th flow hits the blacklist
+    lens[i] = build_packet(raw[i], &pkt, "00:00:00:00:00:00",
+                           "00:00:00:00:00:00", ip, "2.2.2.2", PROTOCOL_UDP,
+                           1000, flow % 8 == 0 ? 23 : 53, payload);
+    pkts[i] = pkt;
+  }
+
+  firewall_t *fw = firewall_create();
+  firewall_add_blacklist_rule(fw, PROTOCOL_UDP, 0, 0, 23, 23);
+  firewall_configure_ratelimit(fw, 1000, 1000000);
+  ASSERT(firewall_configure_shards(fw, SHARD_TEST_THREADS));
+
+  pthread_t threads[SHARD_TEST_THREADS];
+  shard_worker_t workers[SHARD_TEST_THREADS];
+  for (size_t t = 0; t < SHARD_TEST_THREADS; t++) {
+    workers[t] = (shard_worker_t){fw, t, pkts, lens, out, SHARD_TEST_PACKETS};
+    ASSERT_EQ(0, pthread_create(&threads[t], NULL, shard_worker, &workers[t]));
+  }
+  for (size_t t = 0; t < SHARD_TEST_THREADS; t++)
+    pthread_join(threads[t], NULL);
+
+  // Per flow: 300, 600, 900 pass, 1200 > 1000 drops
+  for (int i = 0; i < SHARD_TEST_PACKETS; i++) {
+    int flow = i % SHARD_TEST_FLOWS;
+    bool last = i >= SHARD_TEST_PACKETS - SHARD_TEST_FLOWS;
+    action_t expected = flow % 8 == 0 || last ? ACTION_DROP : ACTION_PASS;
+    ASSERT_EQ(expected, out[i]);
+  }
+
+  firewall_destroy(fw);
+  PASS();
+}
+
+TEST test_shard_parse_once() {
+  static uint8_t raw[SHARD_TEST_PACKETS][RAW_BUFFER_SIZE];
+  firewall_packet_t parsed[SHARD_TEST_PACKETS];
+  size_t lens[SHARD_TEST_PACKETS];
+
+  char payload[301];
+  memset(payload, 'A', 300);
+  payload[300] = '\0';
+  for (int i = 0; i < SHARD_TEST_PACKETS; i++) {
+    char ip[32];
+    int flow = i % SHARD_TEST_FLOWS;
+    snprintf(ip, sizeof(ip), "10.0.0.%d", flow);
+    uint8_t *pkt;
+    lens[i] = build_packet(raw[i], &pkt, "00:00:00:00:00:00",
+                           "00:00:00:00:00:00", ip, "2.2.2.2", PROTOCOL_UDP,
+                           1000, flow % 8 == 0 ? 23 : 53, payload);
+    ASSERT(firewall_parse(pkt, lens[i], &parsed[i]));
+  }
+  const firewall_packet_t *p = &parsed[1];
+  ASSERT(p->is_ip);
+  ASSERT_EQ(PROTOCOL_UDP, p->proto);
+  ASSERT_EQ(0x0a000001, p->srcip);
+  ASSERT_EQ(0x02020202, p->destip);
+  ASSERT_EQ(1000, p->srcport);
+  ASSERT_EQ(53, p->destport);
+  ASSERT_EQ(sizeof(ethhdr_t) + sizeof(iphdr_t), p->l4_off);
+  ASSERT_EQ(p->l4_off + sizeof(udphdr_t), p->payload_off);
+  ASSERT_EQ(300, p->len - p->payload_off);
+  ASSERT_FALSE(firewall_parse(p->bytes, sizeof(ethhdr_t) + 10,
+                              &parsed[SHARD_TEST_PACKETS - 1]));
+  ASSERT(firewall_parse(p->bytes, lens[SHARD_TEST_PACKETS - 1],
+                        &parsed[SHARD_TEST_PACKETS - 1]));
+
+  firewall_t *fw = firewall_create();
+  firewall_add_blacklist_rule(fw, PROTOCOL_UDP, 0, 0, 23, 23);
+  firewall_configure_ratelimit(fw, 1000, 1000000);
+  ASSERT(firewall_configure_shards(fw, SHARD_TEST_THREADS));
+
+  // Same verdicts as firewall_check_shard_at, see above
+  for (int i = 0; i < SHARD_TEST_PACKETS; i++) {
+    size_t shard = firewall_packet_shard(fw, &parsed[i]);
+    ASSERT_EQ(firewall_flow_shard(fw, parsed[i].bytes, lens[i]), shard);
+    int flow = i % SHARD_TEST_FLOWS;
+    bool last = i >= SHARD_TEST_PACKETS - SHARD_TEST_FLOWS;
+    action_t expected = flow % 8 == 0 || last ? ACTION_DROP : ACTION_PASS;
+    ASSERT_EQ(expected,
+              firewall_check_parsed(fw, shard, &parsed[i], 1000000));
+  }
+
+  firewall_destroy(fw);
+  PASS();
+}
+
+// ==========================================
+//             PIPELINED MODE
+// ==========================================
+
+TEST test_pipeline_matches_single() {
+  static uint8_t raw[BATCH_TEST_SIZE][RAW_BUFFER_SIZE];
+  void *pkts[BATCH_TEST_SIZE];
+  size_t lens[BATCH_TEST_SIZE];
+  firewall_verdict_t out[BATCH_TEST_SIZE];
+  build_batch_packets(raw, pkts, lens);
+
+  firewall_t *single = create_batch_test_firewall();
+  firewall_t *fw = create_batch_test_firewall();
+  // A small ring so that the stages wrap around and wait on each other
+  firewall_pipeline_t *pipeline = firewall_pipeline_create(fw, 5);
+  ASSERT(pipeline != NULL);
+
+  size_t submitted = 0, polled = 0;
+  while (polled < BATCH_TEST_SIZE) {
+    submitted += firewall_pipeline_submit(pipeline, pkts + submitted,
+                                          lens + submitted,
+                                          BATCH_TEST_SIZE - submitted);
+    polled += firewall_pipeline_poll(pipeline, out + polled,
+                                     BATCH_TEST_SIZE - polled);
+  }
+  ASSERT_EQ(0, firewall_pipeline_poll(pipeline, out, BATCH_TEST_SIZE));
+
+  for (int i = 0; i < BATCH_TEST_SIZE; i++) {
+    ASSERT_EQ(pkts[i], out[i].packet);
+    ASSERT_EQ(firewall_check(single, pkts[i], lens[i]), out[i].verdict);
+  }
+
+  // Rules change under a running pipeline through commits
+  uint8_t pkt_raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  size_t len = build_packet(pkt_raw, &pkt, "00:00:00:00:00:00",
+                            "00:00:00:00:00:00", "1.1.1.1", "2.2.2.2",
+                            PROTOCOL_UDP, 1, 2, "worm");
+  firewall_add_content_rule(fw, "worm", 4);
+  ASSERT(firewall_commit(fw));
+  void *one[1] = {pkt};
+  ASSERT_EQ(1, firewall_pipeline_submit(pipeline, one, &len, 1));
+  while (firewall_pipeline_poll(pipeline, out, 1) == 0) continue;
+  ASSERT_EQ(ACTION_DROP, out[0].verdict);
+
+  firewall_pipeline_destroy(pipeline);
+  firewall_destroy(single);
+  firewall_destroy(fw);
+  PASS();
+}
+
+// ==========================================
+//          RULE SET COMMITS
+// ==========================================
+
+TEST test_commit_explicit() {
+  firewall_t *fw = firewall_create();
+  ASSERT(firewall_commit(fw));
+
+  uint8_t raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  size_t len = build_packet(raw, &pkt, "00:00:00:00:00:01", "00:00:00:00:00:02",
+                            "10.0.0.1", "10.0.0.2", PROTOCOL_TCP, 1234, 80,
+                            "hello");
+
+  // Staged rules are not visible until the next commit
+  firewall_add_blacklist_rule(fw, PROTOCOL_TCP, 0, 0, 80, 80);
+  ASSERT_EQ(ACTION_PASS, firewall_check(fw, pkt, len));
+  ASSERT(firewall_commit(fw));
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+
+  // Later commits keep the earlier rules
+  len = build_packet(raw, &pkt, "00:00:00:00:00:01", "00:00:00:00:00:02",
+                     "10.0.0.1", "10.0.0.2", PROTOCOL_UDP, 1234, 53, "hello");
+  firewall_add_content_rule(fw, "hello", 5);
+  ASSERT_EQ(ACTION_PASS, firewall_check(fw, pkt, len));
+  ASSERT(firewall_commit(fw));
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+
+  len = build_packet(raw, &pkt, "00:00:00:00:00:01", "00:00:00:00:00:02",
+                     "10.0.0.1", "10.0.0.2", PROTOCOL_TCP, 1234, 80, "hi");
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+  firewall_destroy(fw);
+  PASS();
+}
+
+enum { COMMIT_PORTS = 64 };
+
+typedef struct {
+  firewall_t *fw;
+  void *pkts[COMMIT_PORTS];
+  size_t lens[COMMIT_PORTS];
+  atomic_bool stop;
+  size_t violations;  // PASS after a DROP on the same port
+} commit_reader_t;
+
+static void *commit_reader(void *arg) {
+  commit_reader_t *r = arg;
+  bool dropped[COMMIT_PORTS] = {false};
+  while (!atomic_load(&r->stop)) {
+    for (size_t p = 0; p < COMMIT_PORTS; p++) {
+      action_t verdict = firewall_check(r->fw, r->pkts[p], r->lens[p]);
+      if (verdict == ACTION_DROP) {
+        dropped[p] = true;
+      } else if (dropped[p]) {
+        r->violations++;
+      }
+    }
+  }
+  return NULL;
+}
+
+TEST test_commit_concurrent_readers() {
+  // Rules only get added, so a port that was dropped once must stay dropped
+  static uint8_t raws[COMMIT_PORTS][RAW_BUFFER_SIZE];
+  static commit_reader_t reader;
+  reader.fw = firewall_create();
+  reader.violations = 0;
+  atomic_init(&reader.stop, false);
+  for (size_t p = 0; p < COMMIT_PORTS; p++) {
+    uint8_t *pkt;
+    reader.lens[p] = build_packet(raws[p], &pkt, "00:00:00:00:00:01",
+                                  "00:00:00:00:00:02", "10.0.0.1", "10.0.0.2",
+                                  PROTOCOL_TCP, 1234, (port_t)p, "payload");
+    reader.pkts[p] = pkt;
+  }
+  ASSERT(firewall_commit(reader.fw));
+
+  pthread_t thread;
+  ASSERT_EQ(0, pthread_create(&thread, NULL, commit_reader, &reader));
+  for (size_t p = 0; p < COMMIT_PORTS; p++) {
+    firewall_add_blacklist_rule(reader.fw, PROTOCOL_TCP, 0, 0, (port_t)p,
+                                (port_t)p);
+    // Also change the other components every few commits
+    if (p % 4 == 0) {
+      uint8_t mac[6] = {0x02, 0, 0, 0, 0, (uint8_t)p};
+      firewall_add_mac_rule(reader.fw, mac, ACTION_DROP);
+      char pattern[16];
+      snprintf(pattern, sizeof(pattern), "pattern%zu", p);
+      firewall_add_content_rule(reader.fw, pattern, strlen(pattern));
+    }
+    ASSERT(firewall_commit(reader.fw));
+    usleep(100);
+  }
+  atomic_store(&reader.stop, true);
+  pthread_join(thread, NULL);
+
+  ASSERT_EQ(0, reader.violations);
+  for (size_t p = 0; p < COMMIT_PORTS; p++)
+    ASSERT_EQ(ACTION_DROP,
+              firewall_check(reader.fw, reader.pkts[p], reader.lens[p]));
+  firewall_destroy(reader.fw);
+  PASS();
+}
+
+// ==========================================
+//               RULE FILES
+// ==========================================
+
+// Creates an empty temporary file for a rule file, returns its path
+static void rule_file_path(char *path, size_t size) {
+  snprintf(path, size, "/tmp/firewall-rules-XXXXXX");
+  int fd = mkstemp(path);
+  if (fd >= 0) close(fd);
+}
+
+TEST test_rule_file_round_trip() {
+  static uint8_t raw[BATCH_TEST_SIZE][RAW_BUFFER_SIZE];
+  void *pkts[BATCH_TEST_SIZE];
+  size_t lens[BATCH_TEST_SIZE];
+  build_batch_packets(raw, pkts, lens);
+  char path[64];
+  rule_file_path(path, sizeof(path));
+
+  firewall_t *saved = create_batch_test_firewall();
+  ipaddr_t prefix;
+  parse_ip("10.0.0.0", &prefix);
+  firewall_add_blacklist_prefix_rule(saved, PROTOCOL_TCP, prefix, 30, 0, 0,
+                                     80, 80);
+  parse_ip("20.0.0.0", &prefix);
+  firewall_add_blacklist_prefix_rule(saved, PROTOCOL_TCP, 0, 0, prefix, 8, 80,
+                                     80);
+  firewall_add_content_rule(saved, "trojan", 6);
+  firewall_add_stream_rule(saved, "worm", 4);
+  ASSERT(firewall_save_rules(saved, path));
+  // Prefixes are saved instead of the 32 MB tables built from them
+  struct stat st;
+  ASSERT_EQ(0, stat(path, &st));
+  ASSERT(st.st_size < 1 << 20);
+
+  firewall_t *loaded = firewall_create();
+  firewall_add_content_rule(loaded, "AAAA", 4);  // replaced by the file
+  ASSERT(firewall_load_rules(loaded, path));
+  for (int i = 0; i < BATCH_TEST_SIZE; i++) {
+    ASSERT_EQ(firewall_check(saved, pkts[i], lens[i]),
+              firewall_check(loaded, pkts[i], lens[i]));
+  }
+  ASSERT_EQ(ACTION_PASS, check_segment(loaded, "1.1.1.1", 1000, "2.2.2.2",
+                                       80, "AAAA"));
+  ASSERT_EQ(ACTION_PASS, check_segment(loaded, "1.1.1.1", 1000, "2.2.2.2",
+                                       80, "wo"));
+  ASSERT_EQ(ACTION_DROP, check_segment(loaded, "1.1.1.1", 1000, "2.2.2.2",
+                                       80, "rm"));
+
+  firewall_stats_t stats;
+  if (firewall_stats_snapshot(loaded, &stats)) {
+    ASSERT_EQ(1, stats.num_mac_rules);
+    ASSERT_EQ(4, stats.num_blacklist_rules);
+    ASSERT_EQ(2, stats.num_content_rules);
+    ASSERT_EQ(1, stats.num_stream_rules);
+    ASSERT_EQ(1, stats.stream_rules[0].packets);
+    firewall_stats_free(&stats);
+  }
+
+  // Rules added after a load are compiled together with the loaded ones,
+  // and saving again keeps both
+  firewall_add_content_rule(loaded, "spam", 4);
+  ASSERT(firewall_save_rules(loaded, path));
+  firewall_t *reloaded = firewall_create();
+  ASSERT(firewall_load_rules(reloaded, path));
+  firewall_t *fws[] = {loaded, reloaded};
+  for (size_t f = 0; f < 2; f++) {
+    ASSERT_EQ(ACTION_DROP, check_segment(fws[f], "1.1.1.1", 1001, "2.2.2.2",
+                                         80, "spam"));
+    ASSERT_EQ(ACTION_DROP, check_segment(fws[f], "1.1.1.1", 1001, "2.2.2.2",
+                                         80, "trojan"));
+    ASSERT_EQ(ACTION_DROP, check_segment(fws[f], "10.0.0.3", 1001, "2.2.2.2",
+                                         80, "hi"));
+    ASSERT_EQ(ACTION_PASS, check_segment(fws[f], "10.0.0.4", 1001, "2.2.2.2",
+                                         80, "hi"));
+    ASSERT_EQ(ACTION_DROP, check_segment(fws[f], "10.0.0.4", 1001,
+                                         "20.1.2.3", 80, "hi"));
+    ASSERT_EQ(ACTION_PASS, check_segment(fws[f], "10.0.0.4", 1001,
+                                         "21.1.2.3", 80, "hi"));
+  }
+
+  firewall_destroy(saved);
+  firewall_destroy(loaded);
+  firewall_destroy(reloaded);
+  unlink(path);
+  PASS();
+}
+
+TEST test_rule_file_rejects_bad_files() {
+  char path[64];
+  rule_file_path(path, sizeof(path));
+  firewall_t *fw = firewall_create();
+  firewall_add_content_rule(fw, "virus", 5);
+
+  ASSERT_FALSE(firewall_load_rules(fw, "/nonexistent/firewall.rules"));
+  ASSERT_FALSE(firewall_load_rules(fw, path));  // empty
+
+  FILE *f = fopen(path, "wb");
+  ASSERT(f);
+  char garbage[8192];
+  memset(garbage, 0x5a, sizeof(garbage));
+  fwrite(garbage, 1, sizeof(garbage), f);
+  fclose(f);
+  ASSERT_FALSE(firewall_load_rules(fw, path));
+
+  ASSERT(firewall_save_rules(fw, path));
+  struct stat st;
+  ASSERT_EQ(0, stat(path, &st));
+  ASSERT_EQ(0, truncate(path, st.st_size - 1));
+  ASSERT_FALSE(firewall_load_rules(fw, path));
+
+  // The current rules stay in place
+  ASSERT_EQ(ACTION_DROP, check_segment(fw, "1.1.1.1", 1000, "2.2.2.2", 80,
+                                       "virus"));
+  firewall_destroy(fw);
+  unlink(path);
+  PASS();
+}
+
+// ==========================================
+//              VERDICT CACHE
+// ==========================================
+
+TEST test_verdict_cache_matches_uncached() {
+  static uint8_t raw[BATCH_TEST_SIZE][RAW_BUFFER_SIZE];
+  void *pkts[BATCH_TEST_SIZE];
+  size_t lens[BATCH_TEST_SIZE];
+  action_t batch_out[BATCH_TEST_SIZE];
+  build_batch_packets(raw, pkts, lens);
+
+  firewall_t *plain = create_batch_test_firewall();
+  firewall_t *single = create_batch_test_firewall();
+  firewall_t *batch = create_batch_test_firewall();
+  // Tiny caches, so that flows keep evicting each other
+  ASSERT(firewall_configure_verdict_cache(single, 16));
+  ASSERT(firewall_configure_verdict_cache(batch, 16));
+
+  // Several passes, the later ones mostly hit
+  uint64_t now = 1000000;
+  for (int round = 0; round < 3; round++, now += 1000) {
+    firewall_check_batch_at(batch, pkts, lens, batch_out, BATCH_TEST_SIZE,
+                            now);
+    for (int i = 0; i < BATCH_TEST_SIZE; i++) {
+      action_t expected = firewall_check_at(plain, pkts[i], lens[i], now);
+      ASSERT_EQ(expected, firewall_check_at(single, pkts[i], lens[i], now));
+      ASSERT_EQ(expected, batch_out[i]);
+    }
+  }
+
+  ASSERT(firewall_configure_verdict_cache(single, 0));
+  firewall_destroy(plain);
+  firewall_destroy(single);
+  firewall_destroy(batch);
+  PASS();
+}
+
+TEST test_verdict_cache_invalidation() {
+  firewall_t *fw = firewall_create();
+  ASSERT(firewall_configure_verdict_cache(fw, 1024));
+  ASSERT(firewall_configure_shards(fw, 2));  // caches follow the shards
+
+  uint8_t raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  size_t len = build_packet(raw, &pkt, "00:00:00:00:00:01", "00:00:00:00:00:02",
+                            "10.0.0.1", "10.0.0.2", PROTOCOL_TCP, 1234, 80,
+                            "hello");
+  size_t shard = firewall_flow_shard(fw, pkt, len);
+  ASSERT_EQ(ACTION_PASS, firewall_check(fw, pkt, len));
+  ASSERT_EQ(ACTION_PASS, firewall_check_shard(fw, shard, pkt, len));
+
+  // New blacklist rules apply to flows with a cached verdict
+  firewall_add_blacklist_rule(fw, PROTOCOL_TCP, 0, 0, 80, 80);
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+  ASSERT_EQ(ACTION_DROP, firewall_check_shard(fw, shard, pkt, len));
+
+  // And so do MAC rules, the newest one winning
+  len = build_packet(raw, &pkt, "00:00:00:00:00:01", "00:00:00:00:00:02",
+                     "10.0.0.1", "10.0.0.2", PROTOCOL_TCP, 1234, 443, "hello");
+  ASSERT_EQ(ACTION_PASS, firewall_check(fw, pkt, len));
+  uint8_t mac[6] = {0, 0, 0, 0, 0, 1};
+  firewall_add_mac_rule(fw, mac, ACTION_DROP);
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+  firewall_add_mac_rule(fw, mac, ACTION_PASS);
+  ASSERT_EQ(ACTION_PASS, firewall_check(fw, pkt, len));
+
+  // Content rules always run
+  firewall_add_content_rule(fw, "hello", 5);
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+
+  // Staged rules only count once committed
+  ASSERT(firewall_commit(fw));
+  len = build_packet(raw, &pkt, "00:00:00:00:00:01", "00:00:00:00:00:02",
+                     "10.0.0.1", "10.0.0.2", PROTOCOL_UDP, 1234, 53, "hi");
+  ASSERT_EQ(ACTION_PASS, firewall_check(fw, pkt, len));
+  firewall_add_blacklist_rule(fw, PROTOCOL_UDP, 0, 0, 53, 53);
+  ASSERT_EQ(ACTION_PASS, firewall_check(fw, pkt, len));
+  ASSERT(firewall_commit(fw));
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, len));
+
+  firewall_destroy(fw);
+  PASS();
+}
+
+// ==========================================
+//              STATISTICS
+// ==========================================
+
+#define STATS_TEST_PACKETS 5
+
+TEST test_stats_without_rules() {
+  // Before any rule is committed the totals are still empty
+  firewall_t *fw = firewall_create();
+  firewall_stats_t stats;
+  if (!firewall_stats_snapshot(fw, &stats)) {
+    firewall_destroy(fw);
+    SKIPm("built without FIREWALL_STATS");
+  }
+  ASSERT_EQ(0, stats.num_mac_rules);
+  ASSERT_EQ(0, stats.num_blacklist_rules);
+  ASSERT_EQ(0, stats.num_content_rules);
+  firewall_stats_free(&stats);
+
+  static uint8_t raw[RAW_BUFFER_SIZE];
+  uint8_t *pkt;
+  size_t len = build_packet(raw, &pkt, "aa:aa:aa:aa:aa:aa",
+                            "22:22:22:22:22:22", "10.0.0.1", "10.1.0.1",
+                            PROTOCOL_TCP, 1000, 80, "hello");
+  ASSERT_EQ(ACTION_PASS, firewall_check(fw, pkt, len));
+  ASSERT(firewall_stats_snapshot(fw, &stats));
+  ASSERT_EQ(0, stats.num_mac_rules);
+  ASSERT_EQ(1, stats.stage_packets[FIREWALL_STAGE_PARSE]);
+  firewall_stats_free(&stats);
+
+  firewall_destroy(fw);
+  PASS();
+}
+
+TEST test_stats_counters() {
+  firewall_t *fw = firewall_create();
+  firewall_stats_t stats;
+  if (!firewall_stats_snapshot(fw, &stats)) {
+    firewall_destroy(fw);
+    SKIPm("built without FIREWALL_STATS");
+  }
+  firewall_stats_free(&stats);
+
+  uint8_t mac[6];
+  parse_mac("aa:aa:aa:aa:aa:aa", mac);
+  firewall_add_mac_rule(fw, mac, ACTION_DROP);
+  parse_mac("bb:bb:bb:bb:bb:bb", mac);
+  firewall_add_mac_rule(fw, mac, ACTION_PASS);
+  firewall_add_blacklist_rule(fw, PROTOCOL_TCP, 0, 0, 23, 23);
+  ipaddr_t src;
+  parse_ip("10.0.0.7", &src);
+  firewall_add_blacklist_rule(fw, PROTOCOL_UDP, src, 0, 0, 65535);
+  firewall_add_content_rule(fw, "virus", 5);
+  firewall_add_content_rule(fw, "virus", 5);
+
+  static uint8_t raw[STATS_TEST_PACKETS][RAW_BUFFER_SIZE];
+  void *pkts[STATS_TEST_PACKETS];
+  size_t lens[STATS_TEST_PACKETS];
+  action_t out[STATS_TEST_PACKETS];
+  uint8_t *pkt;
+  // MAC drop, then blacklist, blacklist, content and no match
+  lens[0] = build_packet(raw[0], &pkt, "aa:aa:aa:aa:aa:aa", "22:22:22:22:22:22",
+                         "10.0.0.1", "10.1.0.1", PROTOCOL_TCP, 1000, 23,
+                         "virus");
+  pkts[0] = pkt;
+  lens[1] = build_packet(raw[1], &pkt, "bb:bb:bb:bb:bb:bb", "22:22:22:22:22:22",
+                         "10.0.0.1", "10.1.0.1", PROTOCOL_TCP, 1000, 23,
+                         "virus");
+  pkts[1] = pkt;
+  lens[2] = build_packet(raw[2], &pkt, "11:11:11:11:11:11", "22:22:22:22:22:22",
+                         "10.0.0.7", "10.1.0.1", PROTOCOL_UDP, 1000, 53,
+                         "hello");
+  pkts[2] = pkt;
+  lens[3] = build_packet(raw[3], &pkt, "11:11:11:11:11:11", "22:22:22:22:22:22",
+                         "10.0.0.1", "10.1.0.1", PROTOCOL_TCP, 1000, 80,
+                         "virus");
+  pkts[3] = pkt;
+  lens[4] = build_packet(raw[4], &pkt, "bb:bb:bb:bb:bb:bb", "22:22:22:22:22:22",
+                         "10.0.0.1", "10.1.0.1", PROTOCOL_TCP, 1000, 80,
+                         "hello");
+  pkts[4] = pkt;
+
+  // Once through each path, the counts must agree
+  for (int i = 0; i < STATS_TEST_PACKETS; i++)
+    firewall_check(fw, pkts[i], lens[i]);
+  firewall_check_batch(fw, pkts, lens, out, STATS_TEST_PACKETS);
+  ASSERT_EQ(ACTION_PASS, out[4]);
+
+  ASSERT(firewall_stats_snapshot(fw, &stats));
+  ASSERT_EQ(2, stats.num_mac_rules);
+  ASSERT_EQ(2, stats.num_blacklist_rules);
+  ASSERT_EQ(2, stats.num_content_rules);
+  ASSERT_EQ(2, stats.mac_rules[0].packets);
+  ASSERT_EQ(2 * lens[0], stats.mac_rules[0].bytes);
+  ASSERT_EQ(4, stats.mac_rules[1].packets);
+  ASSERT_EQ(2 * (lens[1] + lens[4]), stats.mac_rules[1].bytes);
+  ASSERT_EQ(2, stats.blacklist_rules[0].packets);
+  ASSERT_EQ(2 * lens[1], stats.blacklist_rules[0].bytes);
+  ASSERT_EQ(2, stats.blacklist_rules[1].packets);
+  ASSERT_EQ(2 * lens[2], stats.blacklist_rules[1].bytes);
+  ASSERT_EQ(2, stats.content_rules[0].packets);
+  ASSERT_EQ(2 * lens[3], stats.content_rules[0].bytes);
+  ASSERT_EQ(0, stats.content_rules[1].packets);
+  ASSERT_EQ(0, stats.ratelimit_drops.packets);
+
+  ASSERT_EQ(2 * 5, stats.stage_packets[FIREWALL_STAGE_PARSE]);
+  ASSERT_EQ(2 * 5, stats.stage_packets[FIREWALL_STAGE_MAC]);
+  ASSERT_EQ(2 * 4, stats.stage_packets[FIREWALL_STAGE_BLACKLIST]);
+  ASSERT_EQ(2 * 2, stats.stage_packets[FIREWALL_STAGE_CONTENT]);
+  ASSERT_EQ(0, stats.stage_packets[FIREWALL_STAGE_RATELIMIT]);
+  firewall_stats_free(&stats);
+
+  // Counts survive rule changes, new rules start at zero
+  firewall_add_content_rule(fw, "hello", 5);
+  firewall_configure_ratelimit(fw, 0, 1000000);
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkts[4], lens[4]));
+  ASSERT(firewall_stats_snapshot(fw, &stats));
+  ASSERT_EQ(3, stats.num_content_rules);
+  ASSERT_EQ(2, stats.content_rules[0].packets);
+  ASSERT_EQ(1, stats.content_rules[2].packets);
+  ASSERT_EQ(5, stats.mac_rules[1].packets);
+  firewall_stats_free(&stats);
+
+  // Rate limit drops once the content rule is gone from the path
+  lens[4] = build_packet(raw[4], &pkt, "bb:bb:bb:bb:bb:bb", "22:22:22:22:22:22",
+                         "10.0.0.1", "10.1.0.1", PROTOCOL_TCP, 1000, 80,
+                         "other");
+  ASSERT_EQ(ACTION_DROP, firewall_check(fw, pkt, lens[4]));
+  ASSERT(firewall_stats_snapshot(fw, &stats));
+  ASSERT_EQ(1, stats.ratelimit_drops.packets);
+  ASSERT_EQ(lens[4], stats.ratelimit_drops.bytes);
+  ASSERT_EQ(1, stats.stage_packets[FIREWALL_STAGE_RATELIMIT]);
+  firewall_stats_free(&stats);
+
+  firewall_destroy(fw);
+  PASS();
+}
+
 // ==========================================
 //                TEST RUNNER
 // ==========================================
@@ -1541,6 +3110,7 @@ SUITE(suite_mac) {
   RUN_TEST(test_mac_no_rules_default);
   RUN_TEST(test_mac_case_insensitivity_setup);
   RUN_TEST(test_mac_pass_before_drop);
+  RUN_TEST(test_mac_many_rules);
 }
 
 SUITE(suite_blacklist) {
@@ -1555,6 +3125,10 @@ SUITE(suite_blacklist) {
   RUN_TEST(test_blacklist_boundary_ports);
   RUN_TEST(test_blacklist_inverted_range);
   RUN_TEST(test_blacklist_max_port);
+  RUN_TEST(test_blacklist_many_rules);
+  RUN_TEST(test_blacklist_prefix);
+  RUN_TEST(test_blacklist_prefix_commits);
+  RUN_TEST(test_blacklist_prefix_random);
 }
 
 SUITE(suite_content) {
@@ -1569,6 +3143,10 @@ SUITE(suite_content) {
   RUN_TEST(test_content_binary);
   RUN_TEST(test_content_multi_rule);
   RUN_TEST(test_content_large_payload_exact);
+  RUN_TEST(test_content_many_rules);
+  RUN_TEST(test_content_pattern_lengths);
+  RUN_TEST(test_content_stream_across_segments);
+  RUN_TEST(test_content_stream_matches_naive);
 }
 
 SUITE(suite_ratelimit) {
@@ -1594,6 +3172,14 @@ SUITE(suite_ratelimit) {
   RUN_TEST(test_ratelimit_burst_strictly_n);
   RUN_TEST(test_ratelimit_tiny_limit);
   RUN_TEST(test_ratelimit_self_loop);
+  RUN_TEST(test_ratelimit_many_flows_expire);
+  RUN_TEST(test_ratelimit_caller_timestamps);
+  RUN_TEST(test_ratelimit_timestamp_jump);
+  RUN_TEST(test_ratelimit_flow_limit);
+  RUN_TEST(test_ratelimit_burst);
+  RUN_TEST(test_ratelimit_source_aggregate);
+  RUN_TEST(test_ratelimit_source_shards);
+  RUN_TEST(test_ratelimit_source_limit);
 }
 
 SUITE(suite_combined) {
@@ -1609,6 +3195,41 @@ SUITE(suite_combined) {
   RUN_TEST(test_combined_protocol_mismatch_content_drop);
 }
 
+SUITE(suite_batch) {
+  RUN_TEST(test_batch_matches_single);
+  RUN_TEST(test_batch_empty);
+}
+
+SUITE(suite_shard) {
+  RUN_TEST(test_shard_symmetric);
+  RUN_TEST(test_shard_threads_match_single);
+  RUN_TEST(test_shard_parse_once);
+}
+
+SUITE(suite_pipeline) {
+  RUN_TEST(test_pipeline_matches_single);
+}
+
+SUITE(suite_commit) {
+  RUN_TEST(test_commit_explicit);
+  RUN_TEST(test_commit_concurrent_readers);
+}
+
+SUITE(suite_rule_files) {
+  RUN_TEST(test_rule_file_round_trip);
+  RUN_TEST(test_rule_file_rejects_bad_files);
+}
+
+SUITE(suite_verdict_cache) {
+  RUN_TEST(test_verdict_cache_matches_uncached);
+  RUN_TEST(test_verdict_cache_invalidation);
+}
+
+SUITE(suite_stats) {
+  RUN_TEST(test_stats_without_rules);
+  RUN_TEST(test_stats_counters);
+}
+
 GREATEST_MAIN_DEFS();
 
 int main(int argc, char **argv) {
@@ -1619,6 +3240,13 @@ int main(int argc, char **argv) {
   RUN_SUITE(suite_content);
   RUN_SUITE(suite_ratelimit);
   RUN_SUITE(suite_combined);
+  RUN_SUITE(suite_batch);
+  RUN_SUITE(suite_shard);
+  RUN_SUITE(suite_pipeline);
+  RUN_SUITE(suite_commit);
+  RUN_SUITE(suite_rule_files);
+  RUN_SUITE(suite_verdict_cache);
+  RUN_SUITE(suite_stats);
   GREATEST_PRINT_REPORT();
   custom_tests();
   return greatest_all_passed() ? EXIT_SUCCESS : EXIT_FAILURE;
@@ -0,0 +1,196 @@
+#include "traffic.h"
+
+#include <arpa/inet.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+const traffic_size_t traffic_imix[TRAFFIC_IMIX_SIZES] = {
+    {10, 10, 7},
+    {540, 540, 4},
+    {1460, 1460, 1},
+};
+
+static const traffic_size_t default_sizes[] = {{64, 1024, 1}};
+
+// Random bytes that payloads are cut from, at a random offset
+#define NOISE_SIZE (TRAFFIC_MAX_PAYLOAD + 256)
+
+struct traffic_gen {
+  traffic_config_t config;
+  uint64_t rng;
+  // cdf[k] = P(flow <= k), binary searched by traffic_gen_next
+  double *cdf;
+  // size_cdf[i] = P(size component <= i)
+  double *size_cdf;
+  uint8_t noise[NOISE_SIZE];
+};
+
+// ==========================================
+//                 FRAMES
+// ==========================================
+
+size_t traffic_write_frame(uint8_t *buf, protocol_t proto, ipaddr_t srcip,
+                           ipaddr_t destip, port_t srcport, port_t destport,
+                           const uint8_t *payload, size_t payload_len) {
+  size_t l4_len = proto == PROTOCOL_TCP ? sizeof(tcphdr_t) : sizeof(udphdr_t);
+  size_t len = sizeof(ethhdr_t) + sizeof(iphdr_t) + l4_len + payload_len;
+  memset(buf, 0, len - payload_len);
+
+  ethhdr_t *eth = (ethhdr_t *)buf;
+  eth->src[5] = (uint8_t)srcip;
+  eth->dest[5] = (uint8_t)destip;
+  eth->proto = htons(ETH_P_IP);
+
+  iphdr_t *ip = (iphdr_t *)(buf + sizeof(ethhdr_t));
+  ip->ihl = 5;
+  ip->version = 4;
+  ip->tot_len = htons((uint16_t)(sizeof(iphdr_t) + l4_len + payload_len));
+  ip->ttl = 64;
+  ip->protocol = proto == PROTOCOL_TCP ? IP_P_TCP : IP_P_UDP;
+  ip->saddr = htonl(srcip);
+  ip->daddr = htonl(destip);
+
+  uint8_t *l4 = (uint8_t *)ip + sizeof(iphdr_t);
+  if (proto == PROTOCOL_TCP) {
+    tcphdr_t *tcp = (tcphdr_t *)l4;
+    tcp->source = htons(srcport);
+    tcp->dest = htons(destport);
+    tcp->doff = 5;
+  } else {
+    udphdr_t *udp = (udphdr_t *)l4;
+    udp->source = htons(srcport);
+    udp->dest = htons(destport);
+    udp->len = htons((uint16_t)(sizeof(udphdr_t) + payload_len));
+  }
+  memcpy(l4 + l4_len, payload, payload_len);
+  return len;
+}
+
+// ==========================================
+//                GENERATOR
+// ==========================================
+
+// xorshift64*
+static uint64_t rng_next(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545f4914f6cdd1dULL;
+}
+
+// Uniform in [0, 1)
+static double rng_unit(uint64_t *state) {
+  return (double)(rng_next(state) >> 11) * 0x1p-53;
+}
+
+// splitmix64 finalizer, derives per flow properties from its rank
+static uint64_t mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// First index whose cumulative probability exceeds u
+static size_t cdf_search(const double *cdf, size_t n, double u) {
+  size_t lo = 0, hi = n - 1;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (cdf[mid] > u)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
+
+// Accumulates `weights` into a normalized CDF, the last entry is exactly 1
+static void cdf_normalize(double *cdf, size_t n) {
+  for (size_t i = 1; i < n; ++i) cdf[i] += cdf[i - 1];
+  double total = cdf[n - 1];
+  for (size_t i = 0; i < n; ++i) cdf[i] /= total;
+  cdf[n - 1] = 1.0;
+}
+
+traffic_gen_t *traffic_gen_create(const traffic_config_t *config) {
+  traffic_config_t c = *config;
+  if (c.num_flows == 0) return NULL;
+  if (!c.sizes || c.num_sizes == 0) {
+    c.sizes = default_sizes;
+    c.num_sizes = 1;
+  }
+  for (size_t i = 0; i < c.num_sizes; ++i) {
+    if (c.sizes[i].min > c.sizes[i].max ||
+        c.sizes[i].max > TRAFFIC_MAX_PAYLOAD)
+      return NULL;
+  }
+  for (size_t i = 0; i < c.num_patterns; ++i) {
+    if (c.pattern_lens[i] > TRAFFIC_MAX_PAYLOAD) return NULL;
+  }
+  if (c.num_patterns == 0) c.pattern_rate = 0;
+
+  traffic_gen_t *gen = malloc(sizeof(traffic_gen_t));
+  if (!gen) return NULL;
+  gen->config = c;
+  // xorshift must not start at 0
+  gen->rng = mix64(c.seed) | 1;
+  gen->cdf = malloc(c.num_flows * sizeof(double));
+  gen->size_cdf = malloc(c.num_sizes * sizeof(double));
+  if (!gen->cdf || !gen->size_cdf) {
+    traffic_gen_destroy(gen);
+    return NULL;
+  }
+
+  for (size_t k = 0; k < c.num_flows; ++k)
+    gen->cdf[k] = c.zipf_skew == 0 ? 1.0 : pow((double)(k + 1), -c.zipf_skew);
+  cdf_normalize(gen->cdf, c.num_flows);
+  for (size_t i = 0; i < c.num_sizes; ++i)
+    gen->size_cdf[i] = c.sizes[i].weight;
+  cdf_normalize(gen->size_cdf, c.num_sizes);
+
+  for (size_t i = 0; i < NOISE_SIZE; ++i)
+    gen->noise[i] = (uint8_t)rng_next(&gen->rng);
+  return gen;
+}
+
+void traffic_gen_destroy(traffic_gen_t *gen) {
+  if (!gen) return;
+  free(gen->cdf);
+  free(gen->size_cdf);
+  free(gen);
+}
+
+size_t traffic_gen_next(traffic_gen_t *gen, uint8_t *buf, size_t *flow) {
+  const traffic_config_t *c = &gen->config;
+  size_t rank = cdf_search(gen->cdf, c->num_flows, rng_unit(&gen->rng));
+  if (flow) *flow = rank;
+
+  // The rank is spread over 2^24 source addresses by an odd multiplier,
+  // which is a bijection, so popular flows do not share address prefixes.
+  // Ranks beyond 2^24 move to higher source ports.
+  uint64_t h = mix64(rank ^ c->seed);
+  ipaddr_t srcip = 0x0a000000 | (ipaddr_t)((rank * 0x9e3779b1u) & 0xffffff);
+  port_t srcport = (port_t)(1024 + (rank >> 24));
+  ipaddr_t destip = 0xc0a80001 + (ipaddr_t)(h & 0xf);
+  bool udp = (double)(h >> 11) * 0x1p-53 < c->udp_share;
+
+  const uint8_t *payload;
+  size_t len;
+  if (c->pattern_rate > 0 && rng_unit(&gen->rng) < c->pattern_rate) {
+    size_t p = rng_next(&gen->rng) % c->num_patterns;
+    payload = c->patterns[p];
+    len = c->pattern_lens[p];
+  } else {
+    const traffic_size_t *size =
+        &c->sizes[cdf_search(gen->size_cdf, c->num_sizes,
+                             rng_unit(&gen->rng))];
+    uint64_t r = rng_next(&gen->rng);
+    len = size->min + (size_t)(r % (size->max - size->min + 1));
+    payload = gen->noise + (r >> 32) % (NOISE_SIZE - TRAFFIC_MAX_PAYLOAD);
+  }
+
+  return traffic_write_frame(buf, udp ? PROTOCOL_UDP : PROTOCOL_TCP, srcip,
+                             destip, srcport, udp ? 53 : 443, payload, len);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lib.h"
+#include "net.h"
+
+/**
+ * Synthetic traffic for benchmarks: Ethernet/IPv4/TCP or UDP frames laid out
+ * as in net.h, drawn from a fixed population of flows whose popularity
+ * follows a Zipf distribution.
+ */
+
+// Largest payload and frame the generator emits, a 1500 byte IP MTU
+#define TRAFFIC_MAX_PAYLOAD 1460
+#define TRAFFIC_MAX_FRAME                                                  \
+  (sizeof(ethhdr_t) + sizeof(iphdr_t) + sizeof(tcphdr_t) +                 \
+   TRAFFIC_MAX_PAYLOAD)
+
+/**
+ * One component of a payload size distribution: payload lengths drawn
+ * uniformly from [min, max], picked with probability weight / sum(weights)
+ */
+typedef struct {
+  size_t min, max;
+  double weight;
+} traffic_size_t;
+
+// Simple IMIX, 7:4:1 of 64, 594 and 1514 byte TCP frames
+#define TRAFFIC_IMIX_SIZES 3
+extern const traffic_size_t traffic_imix[TRAFFIC_IMIX_SIZES];
+
+typedef struct {
+  // Distinct 5-tuples, flow k (0 based) is drawn with probability
+  // proportional to 1 / (k + 1)^zipf_skew, so 0 is uniform
+  size_t num_flows;
+  double zipf_skew;
+  // Share of flows that are UDP, the others are TCP
+  double udp_share;
+  // Payload size distribution, NULL for uniform 64 to 1024 bytes
+  const traffic_size_t *sizes;
+  size_t num_sizes;
+  // With probability pattern_rate a packet's payload is one of the patterns,
+  // picked uniformly, instead of random bytes. Both content and stream rules
+  // built from the patterns match those packets.
+  const uint8_t *const *patterns;
+  const size_t *pattern_lens;
+  size_t num_patterns;
+  double pattern_rate;
+  // The same seed and configuration give the same packet sequence
+  uint64_t seed;
+} traffic_config_t;
+
+typedef struct traffic_gen traffic_gen_t;
+
+/**
+ * Returns NULL when out of memory, when num_flows is 0 or when a size or a
+ * pattern exceeds TRAFFIC_MAX_PAYLOAD
+ */
+traffic_gen_t *traffic_gen_create(const traffic_config_t *config);
+void traffic_gen_destroy(traffic_gen_t *gen);
+
+/**
+ * Writes the next frame into `buf`, which must hold TRAFFIC_MAX_FRAME bytes,
+ * and returns its length. If `flow` is not NULL it receives the flow's
+ * popularity rank, 0 being the most popular.
+ */
+size_t traffic_gen_next(traffic_gen_t *gen, uint8_t *buf, size_t *flow);
+
+/**
+ * Writes an Ethernet/IPv4/TCP or UDP frame into `buf` and returns its length.
+ * Addresses and ports are in host byte order.
+ */
+size_t traffic_write_frame(uint8_t *buf, protocol_t proto, ipaddr_t srcip,
+                           ipaddr_t destip, port_t srcport, port_t destport,
+                           const uint8_t *payload, size_t payload_len);
@@ -0,0 +1,410 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lib.h"
+
+/**
+ * Micro benchmarks for the slab allocator.
+ *
+ * Usage: ./bench <benchmark> [args...], run without arguments for a list.
+ * Build with `make bench`, use `make bench IMPL=solution.c` to benchmark the
+ * reference solution.
+ */
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void *checked_malloc(size_t size) {
+  void *p = malloc(size);
+  if (!p) {
+    fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+static void print_result(const char *label, uint64_t ops, uint64_t elapsed) {
+  printf("%-32s %8.2f ns/op %10.1f Mops/s\n", label,
+         (double)elapsed / (double)ops, (double)ops / (double)elapsed * 1e3);
+}
+
+// Keeps the compiler from dropping allocations whose result is unused
+static void *volatile sink;
+
+// ==========================================
+//              ALLOC/FREE PAIRS
+// ==========================================
+
+static const size_t object_sizes[] = {16, 64, 256, 1024};
+#define NUM_OBJECT_SIZES (sizeof(object_sizes) / sizeof(*object_sizes))
+
+static void bench_pairs(void) {
+  const uint64_t iterations = 20000000;
+  printf("slab_alloc + slab_free pairs against malloc + free, %llu pairs\n",
+         (unsigned long long)iterations);
+
+  for (size_t s = 0; s < NUM_OBJECT_SIZES; ++s) {
+    slab_allocator_t *allocator = slab_allocator_create();
+    slab_cache_t *cache = slab_cache_create(allocator, object_sizes[s], 8);
+    char label[64];
+
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < iterations; ++i) {
+      void *obj = slab_alloc(cache);
+      sink = obj;
+      slab_free(cache, obj);
+    }
+    snprintf(label, sizeof(label), "slab %zu bytes", object_sizes[s]);
+    print_result(label, iterations, now_ns() - start);
+
+    start = now_ns();
+    for (uint64_t i = 0; i < iterations; ++i) {
+      void *obj = malloc(object_sizes[s]);
+      sink = obj;
+      free(obj);
+    }
+    snprintf(label, sizeof(label), "malloc %zu bytes", object_sizes[s]);
+    print_result(label, iterations, now_ns() - start);
+    slab_allocator_free(allocator);
+  }
+}
+
+// Allocates `depth` objects, then frees them all, so that the magazines
+// overflow into the depot and the slabs
+static void bench_batches(void) {
+  static const size_t depths[] = {16, 256, 4096, 65536};
+  const uint64_t total = 20000000;
+  printf("batches: allocate `depth` 64 byte objects, then free them\n");
+
+  void **objs = checked_malloc(65536 * sizeof(void *));
+  for (size_t d = 0; d < sizeof(depths) / sizeof(*depths); ++d) {
+    size_t depth = depths[d];
+    uint64_t rounds = total / depth;
+    slab_allocator_t *allocator = slab_allocator_create();
+    slab_cache_t *cache = slab_cache_create(allocator, 64, 8);
+    char label[64];
+
+    uint64_t start = now_ns();
+    for (uint64_t r = 0; r < rounds; ++r) {
+      for (size_t i = 0; i < depth; ++i) objs[i] = slab_alloc(cache);
+      for (size_t i = 0; i < depth; ++i) slab_free(cache, objs[i]);
+    }
+    snprintf(label, sizeof(label), "slab depth %zu", depth);
+    print_result(label, rounds * depth, now_ns() - start);
+
+    start = now_ns();
+    for (uint64_t r = 0; r < rounds; ++r) {
+      for (size_t i = 0; i < depth; ++i) objs[i] = malloc(64);
+      for (size_t i = 0; i < depth; ++i) free(objs[i]);
+    }
+    snprintf(label, sizeof(label), "malloc depth %zu", depth);
+    print_result(label, rounds * depth, now_ns() - start);
+    slab_allocator_free(allocator);
+  }
+  free(objs);
+}
+
+// Mixed sizes from 1 to KMALLOC_MAX_SIZE, 64 objects live at a time
+static void bench_kmalloc(void) {
+  const uint64_t total = 20000000;
+  printf("slab_kmalloc + slab_kfree of mixed sizes against malloc + free\n");
+
+  size_t sizes[1024];
+  uint64_t x = 88172645463325252ull;
+  for (size_t i = 0; i < 1024; ++i) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    // Small sizes dominate, as in most programs
+    sizes[i] = 1 + x % (x & 1 ? 128 : KMALLOC_MAX_SIZE);
+  }
+
+  slab_allocator_t *allocator = slab_allocator_create();
+  void *objs[64];
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < total; i += 64) {
+    for (size_t k = 0; k < 64; ++k)
+      objs[k] = slab_kmalloc(allocator, sizes[(i + k) % 1024]);
+    sink = objs[63];
+    for (size_t k = 0; k < 64; ++k) slab_kfree(allocator, objs[k]);
+  }
+  print_result("slab_kmalloc", total, now_ns() - start);
+
+  start = now_ns();
+  for (uint64_t i = 0; i < total; i += 64) {
+    for (size_t k = 0; k < 64; ++k) objs[k] = malloc(sizes[(i + k) % 1024]);
+    sink = objs[63];
+    for (size_t k = 0; k < 64; ++k) free(objs[k]);
+  }
+  print_result("malloc", total, now_ns() - start);
+  slab_allocator_free(allocator);
+}
+
+// Follows a random cycle through `count` 64 byte objects, so that nearly
+// every step misses the caches and, with small pages, the TLB
+static void bench_chase_one(const char *label, slab_allocator_t *allocator,
+                            size_t count) {
+  slab_cache_t *cache = allocator ? slab_cache_create(allocator, 64, 8) : NULL;
+  void ***objs = checked_malloc(count * sizeof(void **));
+  for (size_t i = 0; i < count; ++i)
+    objs[i] = cache ? slab_alloc(cache) : checked_malloc(64);
+
+  // Sattolo's shuffle gives a single cycle through all objects
+  size_t *order = checked_malloc(count * sizeof(size_t));
+  for (size_t i = 0; i < count; ++i) order[i] = i;
+  uint64_t x = 88172645463325252ull;
+  for (size_t i = count - 1; i > 0; --i) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    size_t j = x % i;
+    size_t tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+  for (size_t i = 0; i < count; ++i) *objs[i] = objs[order[i]];
+
+  const uint64_t steps = 20000000;
+  void **p = objs[0];
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < steps; ++i) p = *p;
+  print_result(label, steps, now_ns() - start);
+  sink = p;
+
+  if (!cache)
+    for (size_t i = 0; i < count; ++i) free(objs[i]);
+  free(order);
+  free(objs);
+}
+
+static void bench_chase(void) {
+  static const size_t counts[] = {1 << 16, 1 << 20, 1 << 22};
+  printf("random pointer chase through live 64 byte objects\n");
+  for (size_t c = 0; c < sizeof(counts) / sizeof(*counts); ++c) {
+    char label[64];
+    slab_allocator_t *allocator = slab_allocator_create();
+    snprintf(label, sizeof(label), "slab %zu objects", counts[c]);
+    bench_chase_one(label, allocator, counts[c]);
+    slab_allocator_free(allocator);
+
+    allocator = slab_allocator_create_huge_pages();
+    snprintf(label, sizeof(label), "slab huge pages %zu objects", counts[c]);
+    bench_chase_one(label, allocator, counts[c]);
+    slab_allocator_free(allocator);
+
+    snprintf(label, sizeof(label), "malloc %zu objects", counts[c]);
+    bench_chase_one(label, NULL, counts[c]);
+  }
+}
+
+// ==========================================
+//              THREAD SCALING
+// ==========================================
+
+typedef struct {
+  slab_cache_t *cache;  // NULL for malloc
+  uint64_t iterations;
+  pthread_barrier_t *barrier;
+} pair_worker_t;
+
+static void *pair_worker_main(void *arg) {
+  pair_worker_t *w = arg;
+  void *objs[8];
+  pthread_barrier_wait(w->barrier);
+  // A few objects live at a time, like a request handler
+  for (uint64_t i = 0; i < w->iterations; i += 8) {
+    for (size_t k = 0; k < 8; ++k)
+      objs[k] = w->cache ? slab_alloc(w->cache) : malloc(64);
+    sink = objs[7];
+    for (size_t k = 0; k < 8; ++k) {
+      if (w->cache)
+        slab_free(w->cache, objs[k]);
+      else
+        free(objs[k]);
+    }
+  }
+  return NULL;
+}
+
+// Runs `num_threads` workers on one shared cache (or malloc) and returns the
+// elapsed time
+static uint64_t run_pair_workers(slab_cache_t *cache, size_t num_threads,
+                                 uint64_t iterations) {
+  pthread_t threads[64];
+  pair_worker_t workers[64];
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, (unsigned)num_threads + 1);
+  for (size_t t = 0; t < num_threads; ++t) {
+    workers[t] = (pair_worker_t){cache, iterations, &barrier};
+    pthread_create(&threads[t], NULL, pair_worker_main, &workers[t]);
+  }
+  pthread_barrier_wait(&barrier);
+  uint64_t start = now_ns();
+  for (size_t t = 0; t < num_threads; ++t) pthread_join(threads[t], NULL);
+  uint64_t elapsed = now_ns() - start;
+  pthread_barrier_destroy(&barrier);
+  return elapsed;
+}
+
+static void bench_threads(size_t max_threads) {
+  const uint64_t iterations = 8000000;
+  if (max_threads > 64) max_threads = 64;
+  printf("threads sharing one 64 byte cache, %llu allocations per thread\n",
+         (unsigned long long)iterations);
+
+  for (size_t n = 1; n <= max_threads; n *= 2) {
+    slab_allocator_t *allocator = slab_allocator_create();
+    slab_cache_t *cache = slab_cache_create(allocator, 64, 8);
+    char label[64];
+    uint64_t elapsed = run_pair_workers(cache, n, iterations);
+    snprintf(label, sizeof(label), "slab %zu threads", n);
+    print_result(label, n * iterations, elapsed);
+    elapsed = run_pair_workers(NULL, n, iterations);
+    snprintf(label, sizeof(label), "malloc %zu threads", n);
+    print_result(label, n * iterations, elapsed);
+    slab_allocator_free(allocator);
+  }
+}
+
+// ==========================================
+//          PRODUCER/CONSUMER HANDOFF
+// ==========================================
+
+#define HANDOFF_RING 1024
+
+typedef struct {
+  slab_cache_t *cache;  // NULL for malloc
+  uint64_t iterations;
+  pthread_barrier_t *barrier;
+  void *ring[HANDOFF_RING];
+  _Atomic uint64_t head;  // objects put in the ring
+  _Atomic uint64_t tail;  // objects taken out
+} handoff_t;
+
+static void *handoff_produce(void *arg) {
+  handoff_t *h = arg;
+  pthread_barrier_wait(h->barrier);
+  for (uint64_t i = 0; i < h->iterations; ++i) {
+    void *obj = h->cache ? slab_alloc(h->cache) : malloc(64);
+    while (i - atomic_load_explicit(&h->tail, memory_order_acquire) >=
+           HANDOFF_RING)
+      sched_yield();
+    h->ring[i % HANDOFF_RING] = obj;
+    atomic_store_explicit(&h->head, i + 1, memory_order_release);
+  }
+  return NULL;
+}
+
+static void *handoff_consume(void *arg) {
+  handoff_t *h = arg;
+  pthread_barrier_wait(h->barrier);
+  for (uint64_t i = 0; i < h->iterations; ++i) {
+    while (atomic_load_explicit(&h->head, memory_order_acquire) == i)
+      sched_yield();
+    void *obj = h->ring[i % HANDOFF_RING];
+    if (h->cache)
+      slab_free(h->cache, obj);
+    else
+      free(obj);
+    atomic_store_explicit(&h->tail, i + 1, memory_order_release);
+  }
+  return NULL;
+}
+
+// Runs `num_pairs` producer threads allocating objects that their consumer
+// threads free, and returns the elapsed time
+static uint64_t run_handoff_pairs(slab_cache_t *cache, size_t num_pairs,
+                                  uint64_t iterations) {
+  pthread_t threads[64];
+  handoff_t *pairs = checked_malloc(num_pairs * sizeof(handoff_t));
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, (unsigned)(2 * num_pairs) + 1);
+  for (size_t p = 0; p < num_pairs; ++p) {
+    pairs[p].cache = cache;
+    pairs[p].iterations = iterations;
+    pairs[p].barrier = &barrier;
+    atomic_init(&pairs[p].head, 0);
+    atomic_init(&pairs[p].tail, 0);
+    pthread_create(&threads[2 * p], NULL, handoff_produce, &pairs[p]);
+    pthread_create(&threads[2 * p + 1], NULL, handoff_consume, &pairs[p]);
+  }
+  pthread_barrier_wait(&barrier);
+  uint64_t start = now_ns();
+  for (size_t t = 0; t < 2 * num_pairs; ++t) pthread_join(threads[t], NULL);
+  uint64_t elapsed = now_ns() - start;
+  pthread_barrier_destroy(&barrier);
+  free(pairs);
+  return elapsed;
+}
+
+static void bench_handoff(size_t max_pairs) {
+  const uint64_t iterations = 4000000;
+  if (max_pairs > 32) max_pairs = 32;
+  printf("producers allocating 64 byte objects that consumers free, "
+         "%llu objects per pair\n",
+         (unsigned long long)iterations);
+
+  for (size_t n = 1; n <= max_pairs; n *= 2) {
+    slab_allocator_t *allocator = slab_allocator_create();
+    slab_cache_t *cache = slab_cache_create(allocator, 64, 8);
+    char label[64];
+    uint64_t elapsed = run_handoff_pairs(cache, n, iterations);
+    snprintf(label, sizeof(label), "slab %zu pairs", n);
+    print_result(label, n * iterations, elapsed);
+    elapsed = run_handoff_pairs(NULL, n, iterations);
+    snprintf(label, sizeof(label), "malloc %zu pairs", n);
+    print_result(label, n * iterations, elapsed);
+    slab_allocator_free(allocator);
+  }
+}
+
+// ==========================================
+//                  MAIN
+// ==========================================
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s <benchmark> [args...]\n"
+          "  pairs      alloc/free pairs at 16 to 1024 bytes, against malloc\n"
+          "  batches    bursts of 16 to 64k allocations, then frees\n"
+          "  kmalloc    slab_kmalloc of mixed sizes, against malloc\n"
+          "  chase      pointer chase over many objects, with huge pages\n"
+          "  threads [max]  1, 2, 4, ... max (8) threads on one cache\n"
+          "  handoff [max]  1, 2, ... max (4) producer/consumer pairs\n",
+          prog);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (strcmp(argv[1], "pairs") == 0) {
+    bench_pairs();
+  } else if (strcmp(argv[1], "batches") == 0) {
+    bench_batches();
+  } else if (strcmp(argv[1], "chase") == 0) {
+    bench_chase();
+  } else if (strcmp(argv[1], "kmalloc") == 0) {
+    bench_kmalloc();
+  } else if (strcmp(argv[1], "threads") == 0) {
+    bench_threads(argc > 2 ? strtoul(argv[2], NULL, 10) : 8);
+  } else if (strcmp(argv[1], "handoff") == 0) {
+    bench_handoff(argc > 2 ? strtoul(argv[2], NULL, 10) : 4);
+  } else {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -23,6 +23,10 @@ slab_allocator_t *slab_allocator_create(void) {
   return NULL;
 }
 
+slab_allocator_t *slab_allocator_create_huge_pages(void) {
+  return NULL;
+}
+
 void slab_cache_free(slab_cache_t *cache) {}
 
 void slab_allocator_free(slab_allocator_t *allocator) {}
@@ -37,3 +41,9 @@ void *slab_alloc(slab_cache_t *cache) {
 }
 
 void slab_free(slab_cache_t *cache, void *obj) {}
+
+void *slab_kmalloc(slab_allocator_t *allocator, size_t size) {
+  return NULL;
+}
+
+void slab_kfree(slab_allocator_t *allocator, void *ptr) {}
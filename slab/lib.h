@@ -12,18 +12,50 @@ typedef struct slab_allocator slab_allocator_t;
 typedef struct slab_cache slab_cache_t;
 
 /**
- * Slabs should be allocated in PAGE_SIZE chunks.
+ * Slabs should be allocated in PAGE_SIZE chunks. slab_cache_create may use
+ * chunks of 2^n pages to waste less of each.
  */
 static const size_t PAGE_SIZE = 4096;
 
 slab_allocator_t *slab_allocator_create(void);
 void slab_allocator_free(slab_allocator_t *allocator);
 
+/**
+ * Like slab_allocator_create, but slabs are carved out of 2 MB regions mapped
+ * with transparent huge pages, which cuts TLB misses when many objects are
+ * live. Memory of released slabs is reused for new ones, but only goes back
+ * to the system with slab_allocator_free. A released slab can be split for
+ * smaller slabs, but released small slabs are never merged into a larger
+ * one.
+ */
+slab_allocator_t *slab_allocator_create_huge_pages(void);
+
 slab_cache_t *slab_cache_create(slab_allocator_t *allocator, size_t obj_size,
                                 size_t alignment);
 void slab_cache_free(slab_cache_t *cache);
 
+/**
+ * slab_alloc and slab_free may be called from several threads at once, and an
+ * object may be freed by another thread than the one that allocated it.
+ * Every thread keeps a few free objects of each cache it uses in per-thread
+ * magazines, which serve most calls without locks or atomic operations, and
+ * returns them to the cache when it exits. Objects freed on another thread
+ * go back to their slab through a lock-free list. A cache must not be freed
+ * while other threads still use it.
+ */
 void *slab_alloc(slab_cache_t *cache);
 void slab_free(slab_cache_t *cache, void *obj);
 
+/**
+ * General purpose allocation of 1 to KMALLOC_MAX_SIZE bytes, from caches of
+ * power of two size classes (8, 16, ... KMALLOC_MAX_SIZE) that `allocator`
+ * creates on first use. Objects are aligned to their size class.
+ * slab_kmalloc returns NULL for a size of 0 or above KMALLOC_MAX_SIZE.
+ * slab_kfree takes no size and ignores NULL.
+ */
+#define KMALLOC_MAX_SIZE 2048
+
+void *slab_kmalloc(slab_allocator_t *allocator, size_t size);
+void slab_kfree(slab_allocator_t *allocator, void *ptr);
+
 #endif  // LIB_H
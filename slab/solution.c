@@ -0,0 +1,1004 @@
+#include "lib.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/**
+ * Objects are handed out by three layers, after Bonwick's magazine allocator:
+ *
+ *  1. Every thread keeps two magazines per cache, small LIFO stacks of free
+ *     objects. Most allocations pop from one and most frees push onto one,
+ *     without locks or atomic operations.
+ *  2. When both of a thread's magazines are empty it refills one from its own
+ *     slabs, or trades it for a full magazine of the cache's depot. When both
+ *     are full it trades one for an empty magazine of the depot, or returns
+ *     its objects to their slabs once the depot holds enough. The depot is
+ *     guarded by the cache lock.
+ *  3. The slabs, chunks of pages cut into objects. Every slab belongs to one
+ *     thread's cache, which allocates from it and frees into it without
+ *     locks. Other threads push the objects they free onto the slab's
+ *     lock-free remote list, and the owner takes them back in one batch when
+ *     its own free objects run out.
+ *
+ * So a producer thread allocating objects that consumer threads free gets
+ * them back through the remote lists, and neither side takes a lock on its
+ * common path.
+ */
+
+// Bytes of objects one magazine holds, within the round limits below
+#define MAGAZINE_BYTES (4 * PAGE_SIZE)
+#define MAGAZINE_MIN_ROUNDS 8
+#define MAGAZINE_MAX_ROUNDS 64
+
+// Full magazines the depot keeps, further ones go back to the slabs
+#define DEPOT_MAX_FULL 16
+
+// Slabs grow up to 2^SLAB_MAX_ORDER pages to keep the unused part, header
+// included, within 1/SLAB_WASTE_FRACTION of a slab
+#define SLAB_MAX_ORDER 3
+#define SLAB_WASTE_FRACTION 16
+
+// Size of the regions huge page allocators carve their slabs from
+#define HUGE_REGION_BYTES ((size_t)2 << 20)
+#define HUGE_REGION_ORDERS 10  // slab sizes PAGE_SIZE to HUGE_REGION_BYTES
+
+static inline size_t round_up(size_t n, size_t multiple) {
+  return (n + multiple - 1) / multiple * multiple;
+}
+
+// ==========================================
+//                 SLABS
+// ==========================================
+
+/**
+ * A slab is a chunk of slab_bytes, 2^order pages with the order picked by
+ * slab_cache_create, aligned to its size. Its header, the
+ * slab_t, sits at the start and the rest is cut into objects of `stride`
+ * bytes, free ones linked through their first word. The slab of any object
+ * is then found by masking the object's address, see slab_of.
+ *
+ * The owner of a slab never changes. Its free list and its place on the
+ * owner's partial or full list are only touched by the thread using the
+ * owner; `remote` and `remote_next` are shared with the other threads. A
+ * thread cache keeps at most one empty slab, further ones are released.
+ */
+
+typedef struct thread_cache thread_cache_t;
+
+typedef struct slab {
+  struct slab *prev;
+  struct slab *next;  // in the owner's partial or full list
+  slab_cache_t *cache;
+  thread_cache_t *owner;
+  void *free_list;
+  size_t num_free;           // objects on free_list
+  _Atomic(void *) remote;    // objects freed by other threads
+  struct slab *remote_next;  // in the owner's remote_slabs
+} slab_t;
+
+typedef struct magazine {
+  struct magazine *next;  // in the depot
+  size_t rounds;          // objects held
+  void *objs[];
+} magazine_t;
+
+struct thread_cache {
+  magazine_t *loaded;
+  magazine_t *previous;  // always full or empty
+  slab_t *partial;       // slabs with objects on their free list
+  slab_t *full;
+  slab_t *empty;
+  _Atomic(slab_t *) remote_slabs;  // slabs with remote frees to take back
+  thread_cache_t *next;            // in the cache's list of thread caches
+  thread_cache_t *next_idle;       // in the cache's list of parked ones
+};
+
+struct slab_cache {
+  slab_allocator_t *allocator;
+  slab_cache_t *prev;
+  slab_cache_t *next;  // in the allocator's list of caches
+
+  size_t stride;      // object size rounded up to the alignment
+  size_t slab_bytes;  // a power of two, slabs are aligned to it
+  size_t first_obj;   // offset of the first object, past the header
+  size_t objs_per_slab;
+  size_t magazine_rounds;
+
+  size_t id;        // slot in the registry, see THREAD CACHES
+  uint64_t serial;  // never reused, unlike the id and the address
+
+  pthread_mutex_t lock;  // guards everything below
+  magazine_t *depot_full;
+  magazine_t *depot_empty;
+  _Atomic size_t depot_num_full;  // also read without the lock, as a hint
+  thread_cache_t *threads;
+  thread_cache_t *idle;    // left by exited threads
+  thread_cache_t *shared;  // for threads that failed to get their own
+};
+
+// kmalloc size classes are the powers of two from 8 to KMALLOC_MAX_SIZE
+#define KMALLOC_MIN_SHIFT 3
+#define KMALLOC_CLASSES 9
+// Every class uses this slab size, for slab_kfree to mask with
+#define KMALLOC_SLAB_BYTES (8 * PAGE_SIZE)
+static_assert((1 << (KMALLOC_MIN_SHIFT + KMALLOC_CLASSES - 1)) ==
+                  KMALLOC_MAX_SIZE,
+              "kmalloc classes must end at KMALLOC_MAX_SIZE");
+
+struct slab_allocator {
+  pthread_mutex_t lock;  // guards the list of caches and the regions
+  slab_cache_t *caches;
+  _Atomic(slab_cache_t *) kmalloc[KMALLOC_CLASSES];  // created on first use
+
+  bool huge_pages;  // see SLAB MEMORY
+  uint8_t **regions;
+  size_t num_regions;
+  uint8_t *region_next;  // unused part of the last region
+  uint8_t *region_end;
+  void *free_chunks[HUGE_REGION_ORDERS];  // by log2(size / PAGE_SIZE)
+};
+
+static void slab_list_push(slab_t **list, slab_t *slab) {
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list) (*list)->prev = slab;
+  *list = slab;
+}
+
+static void slab_list_remove(slab_t **list, slab_t *slab) {
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    *list = slab->next;
+  if (slab->next) slab->next->prev = slab->prev;
+}
+
+// The slab holding `obj`, for a cache whose slabs are `slab_bytes` long
+static inline slab_t *slab_of(const void *obj, size_t slab_bytes) {
+  return (slab_t *)((uintptr_t)obj & ~(uintptr_t)(slab_bytes - 1));
+}
+
+// ==========================================
+//               SLAB MEMORY
+// ==========================================
+
+/**
+ * Slabs come from aligned_alloc, or for allocators made with
+ * slab_allocator_create_huge_pages, from 2 MB aligned regions mapped with
+ * transparent huge pages, so that objects of many slabs share a few TLB
+ * entries. A region is cut into slabs at increasing, size aligned offsets;
+ * a released slab, and the gaps that alignment leaves, go on a free list
+ * by size for the next slab of that size. A slab with none of its size free
+ * splits a larger free chunk in halves before cutting into a region, so
+ * released large slabs serve small ones. Free chunks are never coalesced:
+ * memory split for small slabs does not serve large ones again. Regions are
+ * only unmapped with the allocator. Slabs larger than a region always use
+ * aligned_alloc.
+ */
+
+static inline size_t chunk_order(size_t bytes) {
+  return (size_t)__builtin_ctzll(bytes / PAGE_SIZE);
+}
+
+static inline bool chunk_in_region(const slab_allocator_t *allocator,
+                                   size_t bytes) {
+  return allocator->huge_pages && bytes <= HUGE_REGION_BYTES;
+}
+
+static void chunk_push(slab_allocator_t *allocator, void *chunk,
+                       size_t bytes) {
+  void **list = &allocator->free_chunks[chunk_order(bytes)];
+  *(void **)chunk = *list;
+  *list = chunk;
+}
+
+// Puts [region_next, end) on the free lists as the largest aligned chunks
+// that fit, each aligned to its size. `end` must be aligned to the chunk
+// sizes this reaches.
+static void region_release_until(slab_allocator_t *allocator, uint8_t *end) {
+  while (allocator->region_next < end) {
+    uintptr_t addr = (uintptr_t)allocator->region_next;
+    size_t bytes = (size_t)(addr & -addr);
+    while (bytes > (size_t)(end - allocator->region_next)) bytes /= 2;
+    chunk_push(allocator, allocator->region_next, bytes);
+    allocator->region_next += bytes;
+  }
+}
+
+// Maps a new region and makes it the one slabs are cut from. Returns false on
+// failure.
+static bool region_map(slab_allocator_t *allocator) {
+  uint8_t **grown = realloc(allocator->regions, (allocator->num_regions + 1) *
+                                                    sizeof(uint8_t *));
+  if (!grown) return false;
+  allocator->regions = grown;
+
+  // Twice the size, so that an aligned region fits, then trim the rest
+  size_t bytes = 2 * HUGE_REGION_BYTES;
+  uint8_t *raw = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) return false;
+  uint8_t *base = (uint8_t *)round_up((uintptr_t)raw, HUGE_REGION_BYTES);
+  if (base > raw) munmap(raw, (size_t)(base - raw));
+  if (raw + bytes > base + HUGE_REGION_BYTES)
+    munmap(base + HUGE_REGION_BYTES,
+           (size_t)(raw + bytes - (base + HUGE_REGION_BYTES)));
+#ifdef MADV_HUGEPAGE
+  madvise(base, HUGE_REGION_BYTES, MADV_HUGEPAGE);  // a hint, may fail
+#endif
+
+  // The rest of the previous region stays usable through the free lists
+  if (allocator->region_next)
+    region_release_until(allocator, allocator->region_end);
+  allocator->regions[allocator->num_regions++] = base;
+  allocator->region_next = base;
+  allocator->region_end = base + HUGE_REGION_BYTES;
+  return true;
+}
+
+// Takes the smallest free chunk of at least `bytes`, and puts all of it past
+// the first `bytes` back on the free lists. Returns NULL if there is none.
+static void *chunk_split(slab_allocator_t *allocator, size_t bytes) {
+  size_t order = chunk_order(bytes);
+  size_t from = order;
+  while (from < HUGE_REGION_ORDERS && !allocator->free_chunks[from]) ++from;
+  if (from == HUGE_REGION_ORDERS) return NULL;
+
+  uint8_t *chunk = allocator->free_chunks[from];
+  allocator->free_chunks[from] = *(void **)chunk;
+  while (from-- > order)
+    chunk_push(allocator, chunk + (PAGE_SIZE << from), PAGE_SIZE << from);
+  return chunk;
+}
+
+static void *region_alloc(slab_allocator_t *allocator, size_t bytes) {
+  pthread_mutex_lock(&allocator->lock);
+  void *chunk = chunk_split(allocator, bytes);
+  if (!chunk) {
+    // Regions end on a multiple of every slab size, so start <= region_end
+    uint8_t *start = NULL;
+    if (allocator->region_next)
+      start = (uint8_t *)round_up((uintptr_t)allocator->region_next, bytes);
+    if (!start || (size_t)(allocator->region_end - start) < bytes)
+      start = region_map(allocator) ? allocator->region_next : NULL;
+    if (start) {
+      region_release_until(allocator, start);
+      allocator->region_next = start + bytes;
+      chunk = start;
+    }
+  }
+  pthread_mutex_unlock(&allocator->lock);
+  return chunk;
+}
+
+static void regions_unmap(slab_allocator_t *allocator) {
+  for (size_t i = 0; i < allocator->num_regions; ++i)
+    munmap(allocator->regions[i], HUGE_REGION_BYTES);
+  free(allocator->regions);
+}
+
+// Returns NULL on allocation failure
+static void *slab_memory_alloc(const slab_cache_t *cache) {
+  if (chunk_in_region(cache->allocator, cache->slab_bytes))
+    return region_alloc(cache->allocator, cache->slab_bytes);
+  return aligned_alloc(cache->slab_bytes, cache->slab_bytes);
+}
+
+static void slab_memory_free(const slab_cache_t *cache, void *mem) {
+  slab_allocator_t *allocator = cache->allocator;
+  if (chunk_in_region(allocator, cache->slab_bytes)) {
+    pthread_mutex_lock(&allocator->lock);
+    chunk_push(allocator, mem, cache->slab_bytes);
+    pthread_mutex_unlock(&allocator->lock);
+  } else {
+    free(mem);
+  }
+}
+
+// ==========================================
+//             SLAB OWNERSHIP
+// ==========================================
+
+static void slab_destroy(slab_t *slab) {
+  if (slab) slab_memory_free(slab->cache, slab);  // the start of its chunk
+}
+
+static void slab_list_destroy(slab_t *list) {
+  while (list) {
+    slab_t *next = list->next;
+    slab_destroy(list);
+    list = next;
+  }
+}
+
+// Returns NULL on allocation failure
+static slab_t *slab_create(slab_cache_t *cache, thread_cache_t *owner) {
+  uint8_t *mem = slab_memory_alloc(cache);
+  if (!mem) return NULL;
+  slab_t *slab = (slab_t *)mem;
+  slab->cache = cache;
+  slab->owner = owner;
+  // Linked in address order, a fresh slab hands out its first object first
+  void **link = &slab->free_list;
+  for (size_t i = 0; i < cache->objs_per_slab; ++i) {
+    void *obj = mem + cache->first_obj + i * cache->stride;
+    *link = obj;
+    link = (void **)obj;
+  }
+  *link = NULL;
+  slab->num_free = cache->objs_per_slab;
+  atomic_init(&slab->remote, NULL);
+  slab->remote_next = NULL;
+  return slab;
+}
+
+// Puts `n` objects, linked from `head` to `tail`, back on the free list of a
+// slab owned by `tc`
+static void slab_put(thread_cache_t *tc, slab_t *slab, void *head, void *tail,
+                     size_t n) {
+  *(void **)tail = slab->free_list;
+  slab->free_list = head;
+  if (slab->num_free == 0) {
+    slab_list_remove(&tc->full, slab);
+    slab_list_push(&tc->partial, slab);
+  }
+  slab->num_free += n;
+  if (slab->num_free == slab->cache->objs_per_slab) {
+    slab_list_remove(&tc->partial, slab);
+    // One empty slab stays, so that a thread going back and forth over a
+    // slab boundary doesn't allocate and release it every time
+    slab_destroy(tc->empty);
+    tc->empty = slab;
+  }
+}
+
+// Frees `obj` into a slab of another thread cache. The first object pushed
+// since the owner last looked also queues the slab on the owner's list.
+static void slab_free_remote(slab_t *slab, void *obj) {
+  void *head = atomic_load_explicit(&slab->remote, memory_order_relaxed);
+  do {
+    *(void **)obj = head;
+  } while (!atomic_compare_exchange_weak_explicit(&slab->remote, &head, obj,
+                                                  memory_order_acq_rel,
+                                                  memory_order_relaxed));
+  if (head) return;
+
+  thread_cache_t *owner = slab->owner;
+  slab_t *first =
+      atomic_load_explicit(&owner->remote_slabs, memory_order_relaxed);
+  do {
+    slab->remote_next = first;
+  } while (!atomic_compare_exchange_weak_explicit(
+      &owner->remote_slabs, &first, slab, memory_order_release,
+      memory_order_relaxed));
+}
+
+// Returns `obj` to its slab, from the thread using `tc`
+static void slab_release(const slab_cache_t *cache, thread_cache_t *tc,
+                         void *obj) {
+  slab_t *slab = slab_of(obj, cache->slab_bytes);
+  if (slab->cache != cache) return;  // not an object of this cache
+  if (slab->owner == tc) {
+    slab_put(tc, slab, obj, obj, 1);
+  } else {
+    slab_free_remote(slab, obj);
+  }
+}
+
+// Takes back the objects other threads freed into the slabs of `tc`
+static void thread_cache_reclaim(thread_cache_t *tc) {
+  slab_t *slab =
+      atomic_exchange_explicit(&tc->remote_slabs, NULL, memory_order_acquire);
+  while (slab) {
+    // Read first: once its remote list is emptied, another thread may queue
+    // the slab again
+    slab_t *next = slab->remote_next;
+    void *head =
+        atomic_exchange_explicit(&slab->remote, NULL, memory_order_acq_rel);
+    if (head) {
+      void *tail = head;
+      size_t n = 1;
+      for (; *(void **)tail; ++n) tail = *(void **)tail;
+      slab_put(tc, slab, head, tail, n);
+    }
+    slab = next;
+  }
+}
+
+// Fills an empty magazine halfway from the slabs of `tc`, taking back the
+// remote frees once the local ones run out. Creates no slab.
+static void thread_cache_fill(const slab_cache_t *cache, thread_cache_t *tc,
+                              magazine_t *mag) {
+  size_t want = (cache->magazine_rounds + 1) / 2;
+  bool reclaimed = false;
+  while (mag->rounds < want) {
+    slab_t *slab = tc->partial;
+    if (!slab) {
+      if (!reclaimed &&
+          atomic_load_explicit(&tc->remote_slabs, memory_order_relaxed)) {
+        thread_cache_reclaim(tc);
+        reclaimed = true;
+        continue;
+      }
+      if (!tc->empty) break;
+      slab = tc->empty;
+      tc->empty = NULL;
+      slab_list_push(&tc->partial, slab);
+    }
+    while (mag->rounds < want && slab->num_free > 0) {
+      void *obj = slab->free_list;
+      slab->free_list = *(void **)obj;
+      --slab->num_free;
+      mag->objs[mag->rounds++] = obj;
+    }
+    if (slab->num_free == 0) {
+      slab_list_remove(&tc->partial, slab);
+      slab_list_push(&tc->full, slab);
+    }
+  }
+  // Pops come from the top, hand out the objects in slab order
+  for (size_t i = 0, j = mag->rounds; i + 1 < j; ++i, --j) {
+    void *tmp = mag->objs[i];
+    mag->objs[i] = mag->objs[j - 1];
+    mag->objs[j - 1] = tmp;
+  }
+}
+
+// Adds a fresh slab to `tc` and fills the magazine from it. Returns false on
+// allocation failure.
+static bool thread_cache_grow(slab_cache_t *cache, thread_cache_t *tc,
+                              magazine_t *mag) {
+  slab_t *slab = slab_create(cache, tc);
+  if (!slab) return false;
+  slab_list_push(&tc->partial, slab);
+  thread_cache_fill(cache, tc, mag);
+  return true;
+}
+
+// ==========================================
+//           MAGAZINES AND DEPOT
+// ==========================================
+
+static magazine_t *magazine_create(const slab_cache_t *cache) {
+  magazine_t *mag =
+      malloc(sizeof(magazine_t) + cache->magazine_rounds * sizeof(void *));
+  if (!mag) return NULL;
+  mag->next = NULL;
+  mag->rounds = 0;
+  return mag;
+}
+
+static void magazine_list_destroy(magazine_t *list) {
+  while (list) {
+    magazine_t *next = list->next;
+    free(list);
+    list = next;
+  }
+}
+
+static void magazine_push(magazine_t **list, magazine_t *mag) {
+  mag->next = *list;
+  *list = mag;
+}
+
+static magazine_t *magazine_pop(magazine_t **list) {
+  magazine_t *mag = *list;
+  *list = mag->next;
+  return mag;
+}
+
+// Returns the objects of `mag` to their slabs, from the thread using `tc`
+static void magazine_drain(const slab_cache_t *cache, thread_cache_t *tc,
+                           magazine_t *mag) {
+  while (mag->rounds > 0) slab_release(cache, tc, mag->objs[--mag->rounds]);
+}
+
+// ==========================================
+//             THREAD CACHES
+// ==========================================
+
+/**
+ * A thread finds its magazines and slabs for a cache through a thread-local
+ * array indexed by the cache's id. Ids come from a process wide registry and
+ * are reused once a cache is freed, so every slot also records the serial
+ * of the cache it belongs to: a slot left behind by a freed cache no longer
+ * matches and is never followed.
+ *
+ * When a thread exits, its magazines go back to the slabs of the caches that
+ * still exist; the registry lock keeps a cache from being freed meanwhile.
+ * Its thread caches are parked rather than freed, since other threads may
+ * still hold objects of their slabs and free them remotely, and the next
+ * thread to use the cache takes one over. They are only freed with the
+ * cache.
+ */
+
+typedef struct {
+  uint64_t serial;  // of the cache, 0 if unused
+  thread_cache_t *tc;
+} thread_slot_t;
+
+typedef struct {
+  size_t num_slots;
+  thread_slot_t slots[];
+} thread_slots_t;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static slab_cache_t **registry;  // by id, NULL for free ids
+static size_t registry_size;
+static size_t registry_count;
+static uint64_t registry_serial;
+
+static _Thread_local thread_slots_t *thread_slots;
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static bool thread_key_ok;
+
+static bool registry_add(slab_cache_t *cache) {
+  pthread_mutex_lock(&registry_lock);
+  size_t id = 0;
+  while (id < registry_size && registry[id]) ++id;
+  if (id == registry_size) {
+    size_t size = registry_size ? registry_size * 2 : 16;
+    slab_cache_t **grown = realloc(registry, size * sizeof(slab_cache_t *));
+    if (!grown) {
+      pthread_mutex_unlock(&registry_lock);
+      return false;
+    }
+    memset(grown + registry_size, 0,
+           (size - registry_size) * sizeof(slab_cache_t *));
+    registry = grown;
+    registry_size = size;
+  }
+  registry[id] = cache;
+  ++registry_count;
+  cache->id = id;
+  cache->serial = ++registry_serial;
+  pthread_mutex_unlock(&registry_lock);
+  return true;
+}
+
+static void registry_remove(const slab_cache_t *cache) {
+  pthread_mutex_lock(&registry_lock);
+  registry[cache->id] = NULL;
+  if (--registry_count == 0) {
+    free(registry);
+    registry = NULL;
+    registry_size = 0;
+  }
+  pthread_mutex_unlock(&registry_lock);
+}
+
+static thread_cache_t *thread_cache_create(const slab_cache_t *cache) {
+  thread_cache_t *tc = calloc(1, sizeof(thread_cache_t));
+  if (!tc) return NULL;
+  atomic_init(&tc->remote_slabs, NULL);
+  tc->loaded = magazine_create(cache);
+  tc->previous = magazine_create(cache);
+  if (!tc->loaded || !tc->previous) {
+    free(tc->loaded);
+    free(tc->previous);
+    free(tc);
+    return NULL;
+  }
+  return tc;
+}
+
+static void thread_cache_destroy(thread_cache_t *tc) {
+  free(tc->loaded);
+  free(tc->previous);
+  slab_list_destroy(tc->partial);
+  slab_list_destroy(tc->full);
+  slab_destroy(tc->empty);
+  free(tc);
+}
+
+// Returns the magazines of an exiting thread to their slabs and parks its
+// thread cache for the next thread that attaches to `cache`
+static void thread_cache_park(slab_cache_t *cache, thread_cache_t *tc) {
+  magazine_drain(cache, tc, tc->loaded);
+  magazine_drain(cache, tc, tc->previous);
+  thread_cache_reclaim(tc);
+  slab_destroy(tc->empty);
+  tc->empty = NULL;
+  pthread_mutex_lock(&cache->lock);
+  tc->next_idle = cache->idle;
+  cache->idle = tc;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+static void thread_slots_release(void *arg) {
+  thread_slots_t *slots = arg;
+  pthread_mutex_lock(&registry_lock);
+  for (size_t id = 0; id < slots->num_slots; ++id) {
+    const thread_slot_t *slot = &slots->slots[id];
+    if (slot->serial && id < registry_size && registry[id] &&
+        registry[id]->serial == slot->serial)
+      thread_cache_park(registry[id], slot->tc);
+  }
+  pthread_mutex_unlock(&registry_lock);
+  free(slots);
+  thread_slots = NULL;
+}
+
+static void thread_key_create(void) {
+  thread_key_ok = pthread_key_create(&thread_key, thread_slots_release) == 0;
+}
+
+// Gives the calling thread a thread cache for `cache`, a parked one if there
+// is any. Returns NULL on allocation failure, the thread then shares
+// `cache->shared` with the others under the cache lock.
+static thread_cache_t *thread_cache_attach(slab_cache_t *cache) {
+  if (pthread_once(&thread_key_once, thread_key_create) != 0 ||
+      !thread_key_ok)
+    return NULL;
+
+  thread_slots_t *slots = thread_slots;
+  size_t num_slots = slots ? slots->num_slots : 0;
+  if (cache->id >= num_slots) {
+    size_t size = num_slots ? num_slots * 2 : 16;
+    while (size <= cache->id) size *= 2;
+    thread_slots_t *grown =
+        realloc(slots, sizeof(thread_slots_t) + size * sizeof(thread_slot_t));
+    if (!grown) return NULL;
+    memset(grown->slots + num_slots, 0,
+           (size - num_slots) * sizeof(thread_slot_t));
+    grown->num_slots = size;
+    thread_slots = slots = grown;
+    pthread_setspecific(thread_key, slots);
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  thread_cache_t *tc = cache->idle;
+  if (tc) cache->idle = tc->next_idle;
+  pthread_mutex_unlock(&cache->lock);
+  if (!tc) {
+    tc = thread_cache_create(cache);
+    if (!tc) return NULL;
+    pthread_mutex_lock(&cache->lock);
+    tc->next = cache->threads;
+    cache->threads = tc;
+    pthread_mutex_unlock(&cache->lock);
+  }
+
+  slots->slots[cache->id] = (thread_slot_t){cache->serial, tc};
+  return tc;
+}
+
+static inline thread_cache_t *thread_cache_get(slab_cache_t *cache) {
+  thread_slots_t *slots = thread_slots;
+  if (slots && cache->id < slots->num_slots &&
+      slots->slots[cache->id].serial == cache->serial)
+    return slots->slots[cache->id].tc;
+  return thread_cache_attach(cache);
+}
+
+// ==========================================
+//                 CACHES
+// ==========================================
+
+static slab_allocator_t *allocator_create(bool huge_pages) {
+  slab_allocator_t *allocator = calloc(1, sizeof(slab_allocator_t));
+  if (!allocator) return NULL;
+  if (pthread_mutex_init(&allocator->lock, NULL) != 0) {
+    free(allocator);
+    return NULL;
+  }
+  for (size_t i = 0; i < KMALLOC_CLASSES; ++i)
+    atomic_init(&allocator->kmalloc[i], NULL);
+  allocator->huge_pages = huge_pages;
+  return allocator;
+}
+
+slab_allocator_t *slab_allocator_create(void) {
+  return allocator_create(false);
+}
+
+slab_allocator_t *slab_allocator_create_huge_pages(void) {
+  return allocator_create(true);
+}
+
+// Frees a cache already unlinked from its allocator
+static void slab_cache_destroy(slab_cache_t *cache) {
+  registry_remove(cache);
+  while (cache->threads) {
+    thread_cache_t *next = cache->threads->next;
+    thread_cache_destroy(cache->threads);
+    cache->threads = next;
+  }
+  magazine_list_destroy(cache->depot_full);
+  magazine_list_destroy(cache->depot_empty);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+void slab_cache_free(slab_cache_t *cache) {
+  if (!cache) return;
+  slab_allocator_t *allocator = cache->allocator;
+  pthread_mutex_lock(&allocator->lock);
+  if (cache->prev)
+    cache->prev->next = cache->next;
+  else
+    allocator->caches = cache->next;
+  if (cache->next) cache->next->prev = cache->prev;
+  pthread_mutex_unlock(&allocator->lock);
+  slab_cache_destroy(cache);
+}
+
+void slab_allocator_free(slab_allocator_t *allocator) {
+  if (!allocator) return;
+  while (allocator->caches) {
+    slab_cache_t *next = allocator->caches->next;
+    slab_cache_destroy(allocator->caches);
+    allocator->caches = next;
+  }
+  regions_unmap(allocator);
+  pthread_mutex_destroy(&allocator->lock);
+  free(allocator);
+}
+
+// Unused bytes of a slab, its header included
+static inline size_t slab_waste(size_t slab_bytes, size_t first_obj,
+                                size_t stride) {
+  return first_obj + (slab_bytes - first_obj) % stride;
+}
+
+/**
+ * Picks the slab size for objects of `stride` bytes behind a header of
+ * `first_obj` bytes. Starting from the smallest 2^order pages that hold one
+ * object, slabs grow while more than 1/SLAB_WASTE_FRACTION of them would go
+ * unused, up to SLAB_MAX_ORDER, keeping the least wasteful. Objects above
+ * half a page stay on the smallest slab unless their stride is a whole
+ * number of pages: packed tighter, most of them would straddle two pages.
+ * Returns 0 if no slab size fits.
+ */
+static size_t slab_pick_bytes(size_t first_obj, size_t stride) {
+  size_t bytes = PAGE_SIZE;
+  while (bytes < first_obj + stride) {
+    if (bytes > SIZE_MAX / 2) return 0;
+    bytes *= 2;
+  }
+  if (stride > PAGE_SIZE / 2 && stride % PAGE_SIZE != 0) return bytes;
+
+  size_t best = bytes;
+  for (; bytes <= PAGE_SIZE << SLAB_MAX_ORDER; bytes *= 2) {
+    size_t waste = slab_waste(bytes, first_obj, stride);
+    if (waste * SLAB_WASTE_FRACTION <= bytes) return bytes;
+    if (waste * best < slab_waste(best, first_obj, stride) * bytes)
+      best = bytes;
+  }
+  return best;
+}
+
+// slab_cache_create with slabs of `slab_bytes`, 0 to pick them
+static slab_cache_t *cache_create(slab_allocator_t *allocator, size_t obj_size,
+                                  size_t alignment, size_t slab_bytes) {
+  if (!allocator || obj_size == 0 || obj_size > SIZE_MAX / 4) return NULL;
+  if (alignment == 0) alignment = 1;
+  if ((alignment & (alignment - 1)) != 0 || alignment > SIZE_MAX / 4)
+    return NULL;
+  // Free objects hold a link, so they are at least pointer sized and aligned
+  if (alignment < alignof(void *)) alignment = alignof(void *);
+  if (obj_size < sizeof(void *)) obj_size = sizeof(void *);
+
+  size_t stride = round_up(obj_size, alignment);
+  size_t first_obj = round_up(sizeof(slab_t), alignment);
+  // Aligned to its power of two size, a slab is also aligned to `alignment`
+  if (slab_bytes == 0) slab_bytes = slab_pick_bytes(first_obj, stride);
+  if (slab_bytes == 0) return NULL;
+  assert(slab_bytes >= first_obj + stride);
+
+  slab_cache_t *cache = calloc(1, sizeof(slab_cache_t));
+  if (!cache) return NULL;
+  cache->allocator = allocator;
+  cache->stride = stride;
+  cache->slab_bytes = slab_bytes;
+  cache->first_obj = first_obj;
+  cache->objs_per_slab = (slab_bytes - first_obj) / stride;
+  size_t rounds = MAGAZINE_BYTES / cache->stride;
+  cache->magazine_rounds = rounds < MAGAZINE_MIN_ROUNDS   ? MAGAZINE_MIN_ROUNDS
+                           : rounds > MAGAZINE_MAX_ROUNDS ? MAGAZINE_MAX_ROUNDS
+                                                          : rounds;
+  atomic_init(&cache->depot_num_full, 0);
+  cache->shared = thread_cache_create(cache);
+  if (!cache->shared) {
+    free(cache);
+    return NULL;
+  }
+  cache->threads = cache->shared;
+  if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+    thread_cache_destroy(cache->shared);
+    free(cache);
+    return NULL;
+  }
+  if (!registry_add(cache)) {
+    pthread_mutex_destroy(&cache->lock);
+    thread_cache_destroy(cache->shared);
+    free(cache);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&allocator->lock);
+  cache->next = allocator->caches;
+  if (allocator->caches) allocator->caches->prev = cache;
+  allocator->caches = cache;
+  pthread_mutex_unlock(&allocator->lock);
+  return cache;
+}
+
+slab_cache_t *slab_cache_create(slab_allocator_t *allocator, size_t obj_size,
+                                size_t alignment) {
+  return cache_create(allocator, obj_size, alignment, 0);
+}
+
+// ==========================================
+//            ALLOCATION AND FREE
+// ==========================================
+
+// Both magazines are empty: refill one from the thread's slabs, trade it for
+// a full magazine of the depot, or refill it from a new slab. Threads
+// without a thread cache allocate from the shared one under the cache lock.
+static void *slab_alloc_slow(slab_cache_t *cache, thread_cache_t *tc) {
+  if (!tc) {
+    pthread_mutex_lock(&cache->lock);
+    magazine_t *mag = cache->shared->loaded;
+    if (mag->rounds == 0) thread_cache_fill(cache, cache->shared, mag);
+    if (mag->rounds == 0) thread_cache_grow(cache, cache->shared, mag);
+    void *obj = mag->rounds > 0 ? mag->objs[--mag->rounds] : NULL;
+    pthread_mutex_unlock(&cache->lock);
+    return obj;
+  }
+
+  thread_cache_fill(cache, tc, tc->loaded);
+  if (tc->loaded->rounds == 0 &&
+      atomic_load_explicit(&cache->depot_num_full, memory_order_relaxed)) {
+    pthread_mutex_lock(&cache->lock);
+    if (cache->depot_full) {
+      magazine_push(&cache->depot_empty, tc->previous);
+      tc->previous = tc->loaded;
+      tc->loaded = magazine_pop(&cache->depot_full);
+      atomic_fetch_sub_explicit(&cache->depot_num_full, 1,
+                                memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&cache->lock);
+  }
+  if (tc->loaded->rounds == 0 && !thread_cache_grow(cache, tc, tc->loaded))
+    return NULL;
+  return tc->loaded->objs[--tc->loaded->rounds];
+}
+
+// Both magazines are full: trade one for an empty magazine of the depot, or
+// return its objects to their slabs if the depot holds enough. The depot
+// size is checked without the lock first, so that threads whose frees go
+// back to the slabs never take it.
+static void slab_free_slow(slab_cache_t *cache, thread_cache_t *tc,
+                           void *obj) {
+  if (!tc) {
+    pthread_mutex_lock(&cache->lock);
+    slab_release(cache, cache->shared, obj);
+    pthread_mutex_unlock(&cache->lock);
+    return;
+  }
+
+  magazine_t *empty = NULL;
+  if (atomic_load_explicit(&cache->depot_num_full, memory_order_relaxed) <
+      DEPOT_MAX_FULL) {
+    pthread_mutex_lock(&cache->lock);
+    if (cache->depot_empty)
+      empty = magazine_pop(&cache->depot_empty);
+    else if (atomic_load_explicit(&cache->depot_num_full,
+                                  memory_order_relaxed) < DEPOT_MAX_FULL)
+      empty = magazine_create(cache);
+    if (empty) {
+      magazine_push(&cache->depot_full, tc->previous);
+      atomic_fetch_add_explicit(&cache->depot_num_full, 1,
+                                memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&cache->lock);
+  }
+  if (empty) {
+    tc->previous = tc->loaded;
+    tc->loaded = empty;
+  } else {
+    magazine_drain(cache, tc, tc->previous);
+    magazine_t *drained = tc->previous;
+    tc->previous = tc->loaded;
+    tc->loaded = drained;
+  }
+  tc->loaded->objs[tc->loaded->rounds++] = obj;
+}
+
+void *slab_alloc(slab_cache_t *cache) {
+  if (!cache) return NULL;
+  thread_cache_t *tc = thread_cache_get(cache);
+  if (tc) {
+    magazine_t *mag = tc->loaded;
+    if (mag->rounds > 0) return mag->objs[--mag->rounds];
+    if (tc->previous->rounds > 0) {
+      tc->loaded = tc->previous;
+      tc->previous = mag;
+      return tc->loaded->objs[--tc->loaded->rounds];
+    }
+  }
+  return slab_alloc_slow(cache, tc);
+}
+
+void slab_free(slab_cache_t *cache, void *obj) {
+  if (!cache || !obj) return;
+  thread_cache_t *tc = thread_cache_get(cache);
+  if (tc) {
+    magazine_t *mag = tc->loaded;
+    if (mag->rounds < cache->magazine_rounds) {
+      mag->objs[mag->rounds++] = obj;
+      return;
+    }
+    if (tc->previous->rounds == 0) {
+      tc->loaded = tc->previous;
+      tc->previous = mag;
+      tc->loaded->objs[tc->loaded->rounds++] = obj;
+      return;
+    }
+  }
+  slab_free_slow(cache, tc, obj);
+}
+
+// ==========================================
+//                 KMALLOC
+// ==========================================
+
+/**
+ * The kmalloc caches are ordinary caches on the allocator's list, so
+ * slab_allocator_free releases them with the others. A class's alignment and
+ * stride are its size. All classes share one slab size, KMALLOC_SLAB_BYTES,
+ * instead of each picking its own, so that slab_kfree finds the slab, and
+ * from it the cache, by masking the pointer. At 32 KB the header and
+ * alignment cost the 2048 byte class one object in 16.
+ */
+
+// Size class of 1 <= size <= KMALLOC_MAX_SIZE: sizes up to 8 share class 0,
+// above that ceil(log2(size)) - 3. The `| 7` folds the small sizes in
+// without a branch.
+static inline size_t kmalloc_class(size_t size) {
+  unsigned long long bits = (unsigned long long)(size - 1) | 7;
+  return (size_t)(64 - __builtin_clzll(bits)) - KMALLOC_MIN_SHIFT;
+}
+
+// Creates the cache of class `cls`, unless a racing thread got there first
+static slab_cache_t *kmalloc_cache_create(slab_allocator_t *allocator,
+                                          size_t cls) {
+  size_t size = (size_t)1 << (cls + KMALLOC_MIN_SHIFT);
+  slab_cache_t *cache = cache_create(allocator, size, size, KMALLOC_SLAB_BYTES);
+  if (!cache) return NULL;
+  slab_cache_t *expected = NULL;
+  if (!atomic_compare_exchange_strong_explicit(
+          &allocator->kmalloc[cls], &expected, cache, memory_order_acq_rel,
+          memory_order_acquire)) {
+    slab_cache_free(cache);
+    cache = expected;
+  }
+  return cache;
+}
+
+void *slab_kmalloc(slab_allocator_t *allocator, size_t size) {
+  // Also rejects 0, which wraps around
+  if (!allocator || size - 1 >= KMALLOC_MAX_SIZE) return NULL;
+  size_t cls = kmalloc_class(size);
+  slab_cache_t *cache =
+      atomic_load_explicit(&allocator->kmalloc[cls], memory_order_acquire);
+  if (!cache && !(cache = kmalloc_cache_create(allocator, cls))) return NULL;
+  return slab_alloc(cache);
+}
+
+void slab_kfree(slab_allocator_t *allocator, void *ptr) {
+  if (!allocator || !ptr) return;
+  slab_t *slab = slab_of(ptr, KMALLOC_SLAB_BYTES);
+  if (slab->cache->allocator != allocator) return;
+  slab_free(slab->cache, ptr);
+}
@@ -1,5 +1,8 @@
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -89,6 +92,54 @@ TEST test_massive_alignment() {
   PASS();
 }
 
+TEST test_alignment_beyond_page() {
+  // Alignments above PAGE_SIZE hold across slabs and after recycling
+  slab_allocator_t *alloc = slab_allocator_create();
+  slab_cache_t *cache = slab_cache_create(alloc, 100, 4 * PAGE_SIZE);
+  void *objs[8];
+
+  for (int i = 0; i < 8; i++) {
+    objs[i] = slab_alloc(cache);
+    ASSERT(objs[i] != NULL);
+    ASSERT_EQ(0, (uintptr_t)objs[i] % (4 * PAGE_SIZE));
+    memset(objs[i], i, 100);
+  }
+  for (int i = 0; i < 8; i++) {
+    slab_free(cache, objs[i]);
+  }
+  void *p = slab_alloc(cache);
+  ASSERT_EQ(objs[7], p);
+
+  slab_allocator_free(alloc);
+  PASS();
+}
+
+TEST test_slab_order_packs_objects() {
+  // 1 KB objects leave most of a page's tail unused, larger slabs do not
+  slab_allocator_t *alloc = slab_allocator_create();
+  slab_cache_t *cache = slab_cache_create(alloc, 1024, 8);
+  uintptr_t pages[60 * 2];
+  size_t num_pages = 0;
+
+  for (int i = 0; i < 60; i++) {
+    uintptr_t p = (uintptr_t)slab_alloc(cache);
+    ASSERT(p != 0);
+    uintptr_t ends[2] = {p / PAGE_SIZE, (p + 1023) / PAGE_SIZE};
+    for (int e = 0; e < 2; e++) {
+      bool seen = false;
+      for (size_t k = 0; k < num_pages; k++) {
+        seen |= pages[k] == ends[e];
+      }
+      if (!seen) pages[num_pages++] = ends[e];
+    }
+  }
+  // 60 KB of objects on at most 8/7 of that in pages
+  ASSERT(num_pages * PAGE_SIZE * 7 <= 60 * 1024 * 8);
+
+  slab_allocator_free(alloc);
+  PASS();
+}
+
 TEST test_cache_linkage_in_allocator() {
   slab_allocator_t *alloc = slab_allocator_create();
   slab_cache_t *c1 = slab_cache_create(alloc, 16, 8);
@@ -438,11 +489,227 @@ TEST test_empty_allocator_free() {
   PASS();
 }
 
+#define THREAD_TEST_THREADS 4
+#define THREAD_TEST_OBJECTS 1000
+
+typedef struct {
+  slab_cache_t *cache;
+  uint8_t tag;
+  void **objs;  // THREAD_TEST_OBJECTS objects allocated by the thread
+} thread_test_arg_t;
+
+static void *thread_test_churn(void *arg) {
+  thread_test_arg_t *a = arg;
+  for (int round = 0; round < 20; round++) {
+    for (int i = 0; i < THREAD_TEST_OBJECTS; i++) {
+      a->objs[i] = slab_alloc(a->cache);
+      if (!a->objs[i]) return a;
+      memset(a->objs[i], a->tag, 48);
+    }
+    for (int i = 0; i < THREAD_TEST_OBJECTS; i++) {
+      uint8_t *obj = a->objs[i];
+      for (int k = 0; k < 48; k++) {
+        if (obj[k] != a->tag) return a;
+      }
+    }
+    for (int i = 0; i < THREAD_TEST_OBJECTS; i++) {
+      slab_free(a->cache, a->objs[i]);
+    }
+  }
+  return NULL;
+}
+
+TEST test_threads_share_cache() {
+  // Objects handed to concurrent threads never overlap
+  slab_allocator_t *alloc = slab_allocator_create();
+  slab_cache_t *cache = slab_cache_create(alloc, 48, 16);
+
+  pthread_t threads[THREAD_TEST_THREADS];
+  thread_test_arg_t args[THREAD_TEST_THREADS];
+  for (int t = 0; t < THREAD_TEST_THREADS; t++) {
+    args[t].cache = cache;
+    args[t].tag = (uint8_t)(t + 1);
+    args[t].objs = malloc(sizeof(void *) * THREAD_TEST_OBJECTS);
+    ASSERT_EQ(0, pthread_create(&threads[t], NULL, thread_test_churn,
+                                &args[t]));
+  }
+  for (int t = 0; t < THREAD_TEST_THREADS; t++) {
+    void *failed;
+    pthread_join(threads[t], &failed);
+    ASSERT_EQ(NULL, failed);
+    free(args[t].objs);
+  }
+
+  slab_allocator_free(alloc);
+  PASS();
+}
+
+static void *thread_test_alloc(void *arg) {
+  thread_test_arg_t *a = arg;
+  for (int i = 0; i < THREAD_TEST_OBJECTS; i++) {
+    a->objs[i] = slab_alloc(a->cache);
+  }
+  return NULL;
+}
+
+static void *thread_test_free(void *arg) {
+  thread_test_arg_t *a = arg;
+  for (int i = 0; i < THREAD_TEST_OBJECTS; i++) {
+    slab_free(a->cache, a->objs[i]);
+  }
+  return NULL;
+}
+
+TEST test_threads_free_elsewhere() {
+  // One thread allocates, another frees, and the objects come back
+  slab_allocator_t *alloc = slab_allocator_create();
+  slab_cache_t *cache = slab_cache_create(alloc, 64, 8);
+  void **objs = malloc(sizeof(void *) * THREAD_TEST_OBJECTS);
+  thread_test_arg_t arg = {cache, 0, objs};
+
+  pthread_t thread;
+  ASSERT_EQ(0, pthread_create(&thread, NULL, thread_test_alloc, &arg));
+  pthread_join(thread, NULL);
+  for (int i = 0; i < THREAD_TEST_OBJECTS; i++) {
+    ASSERT(objs[i] != NULL);
+  }
+  ASSERT_EQ(0, pthread_create(&thread, NULL, thread_test_free, &arg));
+  pthread_join(thread, NULL);
+
+  // Both threads are gone and have returned their magazines, so this
+  // reuses one of their objects
+  void *p = slab_alloc(cache);
+  bool reused = false;
+  for (int i = 0; i < THREAD_TEST_OBJECTS; i++) {
+    reused |= p == objs[i];
+  }
+  ASSERT(reused);
+
+  free(objs);
+  slab_allocator_free(alloc);
+  PASS();
+}
+
+TEST test_threads_outlive_cache() {
+  // A thread that used a freed cache exits cleanly, and a new cache that
+  // gets the same slot is not confused with the old one
+  slab_allocator_t *alloc = slab_allocator_create();
+  slab_cache_t *cache = slab_cache_create(alloc, 32, 8);
+  void **objs = malloc(sizeof(void *) * THREAD_TEST_OBJECTS);
+  thread_test_arg_t arg = {cache, 0, objs};
+
+  void *p = slab_alloc(cache);
+  slab_free(cache, p);
+  slab_cache_free(cache);
+  cache = slab_cache_create(alloc, 32, 8);
+  arg.cache = cache;
+  void *q = slab_alloc(cache);
+  ASSERT(q != NULL);
+
+  pthread_t thread;
+  ASSERT_EQ(0, pthread_create(&thread, NULL, thread_test_alloc, &arg));
+  pthread_join(thread, NULL);
+  slab_cache_free(cache);
+
+  free(objs);
+  slab_allocator_free(alloc);
+  PASS();
+}
+
+#define HANDOFF_OBJECTS 100000
+#define HANDOFF_RING 256
+
+typedef struct {
+  slab_cache_t *cache;
+  uint64_t *ring[HANDOFF_RING];
+  _Atomic size_t head;  // objects the producer has put in the ring
+  _Atomic size_t tail;  // objects the consumer has taken out
+  uintptr_t *addrs;     // every object the producer got
+  bool corrupt;
+} handoff_t;
+
+static void *handoff_produce(void *arg) {
+  handoff_t *h = arg;
+  for (size_t i = 0; i < HANDOFF_OBJECTS; i++) {
+    uint64_t *obj = slab_alloc(h->cache);
+    h->addrs[i] = (uintptr_t)obj;
+    if (!obj) {
+      h->corrupt = true;
+      return NULL;
+    }
+    obj[0] = i;
+    obj[1] = ~(uint64_t)i;
+    while (i - atomic_load(&h->tail) >= HANDOFF_RING) sched_yield();
+    h->ring[i % HANDOFF_RING] = obj;
+    atomic_store(&h->head, i + 1);
+  }
+  return NULL;
+}
+
+static void *handoff_consume(void *arg) {
+  handoff_t *h = arg;
+  for (size_t i = 0; i < HANDOFF_OBJECTS; i++) {
+    while (atomic_load(&h->head) == i) {
+      if (h->corrupt) return NULL;
+      sched_yield();
+    }
+    uint64_t *obj = h->ring[i % HANDOFF_RING];
+    if (obj[0] != i || obj[1] != ~(uint64_t)i) h->corrupt = true;
+    slab_free(h->cache, obj);
+    atomic_store(&h->tail, i + 1);
+  }
+  return NULL;
+}
+
+static int compare_addrs(const void *a, const void *b) {
+  uintptr_t x = *(const uintptr_t *)a, y = *(const uintptr_t *)b;
+  return (x > y) - (x < y);
+}
+
+TEST test_threads_producer_consumer() {
+  // Producers allocate, consumers free, and the objects the consumers free
+  // find their way back to the producers instead of piling up
+  slab_allocator_t *alloc = slab_allocator_create();
+  slab_cache_t *cache = slab_cache_create(alloc, 64, 8);
+
+  handoff_t *pairs = calloc(2, sizeof(handoff_t));
+  pthread_t threads[4];
+  for (int p = 0; p < 2; p++) {
+    pairs[p].cache = cache;
+    pairs[p].addrs = malloc(sizeof(uintptr_t) * HANDOFF_OBJECTS);
+    ASSERT_EQ(0, pthread_create(&threads[2 * p], NULL, handoff_produce,
+                                &pairs[p]));
+    ASSERT_EQ(0, pthread_create(&threads[2 * p + 1], NULL, handoff_consume,
+                                &pairs[p]));
+  }
+  for (int t = 0; t < 4; t++) {
+    pthread_join(threads[t], NULL);
+  }
+
+  for (int p = 0; p < 2; p++) {
+    ASSERT_FALSE(pairs[p].corrupt);
+    uintptr_t *addrs = pairs[p].addrs;
+    qsort(addrs, HANDOFF_OBJECTS, sizeof(uintptr_t), compare_addrs);
+    size_t distinct = 1;
+    for (size_t i = 1; i < HANDOFF_OBJECTS; i++) {
+      distinct += addrs[i] != addrs[i - 1];
+    }
+    ASSERT(distinct < HANDOFF_OBJECTS / 10);
+    free(addrs);
+  }
+
+  free(pairs);
+  slab_allocator_free(alloc);
+  PASS();
+}
+
 SUITE(slab_suite) {
   RUN_TEST(test_strict_alignment_and_spacing);
   RUN_TEST(test_full_list_transition);
   RUN_TEST(test_minimum_object_size_constraint);
   RUN_TEST(test_massive_alignment);
+  RUN_TEST(test_alignment_beyond_page);
+  RUN_TEST(test_slab_order_packs_objects);
   RUN_TEST(test_cache_linkage_in_allocator);
   RUN_TEST(test_partial_to_free_transition);
   RUN_TEST(test_object_overlap);
@@ -471,11 +738,251 @@ SUITE(slab_suite) {
   RUN_TEST(test_empty_allocator_free);
 }
 
+SUITE(slab_thread_suite) {
+  RUN_TEST(test_threads_share_cache);
+  RUN_TEST(test_threads_free_elsewhere);
+  RUN_TEST(test_threads_outlive_cache);
+  RUN_TEST(test_threads_producer_consumer);
+}
+
+TEST test_kmalloc_size_classes() {
+  // Every size gets a usable object aligned to its power of two class, and
+  // objects of neighbouring sizes don't overlap
+  slab_allocator_t *alloc = slab_allocator_create();
+  for (size_t size = 1; size <= KMALLOC_MAX_SIZE; size++) {
+    uint8_t *p = slab_kmalloc(alloc, size);
+    uint8_t *q = slab_kmalloc(alloc, size);
+    ASSERT(p != NULL && q != NULL);
+    size_t cls = 8;
+    while (cls < size) cls *= 2;
+    ASSERT_EQ(0, (uintptr_t)p % cls);
+    ASSERT((size_t)(p > q ? p - q : q - p) >= size);
+    memset(p, 0xAA, size);
+    memset(q, 0x55, size);
+    ASSERT_EQ(0xAA, p[size - 1]);
+    slab_kfree(alloc, p);
+    slab_kfree(alloc, q);
+  }
+  slab_allocator_free(alloc);
+  PASS();
+}
+
+TEST test_kmalloc_bounds() {
+  slab_allocator_t *alloc = slab_allocator_create();
+  ASSERT_EQ(NULL, slab_kmalloc(alloc, 0));
+  ASSERT_EQ(NULL, slab_kmalloc(alloc, KMALLOC_MAX_SIZE + 1));
+  ASSERT_EQ(NULL, slab_kmalloc(alloc, SIZE_MAX));
+  ASSERT_EQ(NULL, slab_kmalloc(NULL, 16));
+  slab_kfree(alloc, NULL);
+  slab_allocator_free(alloc);
+  PASS();
+}
+
+TEST test_kfree_finds_class() {
+  // kfree takes no size, yet the object goes back to its own class
+  slab_allocator_t *alloc = slab_allocator_create();
+  void *small = slab_kmalloc(alloc, 24);
+  void *large = slab_kmalloc(alloc, 1500);
+  slab_kfree(alloc, small);
+  slab_kfree(alloc, large);
+  ASSERT_EQ(large, slab_kmalloc(alloc, 2048));
+  ASSERT_EQ(small, slab_kmalloc(alloc, 32));
+  slab_allocator_free(alloc);
+  PASS();
+}
+
+TEST test_kfree_ignores_other_allocators() {
+  slab_allocator_t *a1 = slab_allocator_create();
+  slab_allocator_t *a2 = slab_allocator_create();
+  void *p = slab_kmalloc(a1, 64);
+  slab_kfree(a2, p);
+  void *q = slab_kmalloc(a1, 64);
+  ASSERT(p != q);
+  slab_kfree(a1, q);
+  slab_kfree(a1, p);
+  slab_allocator_free(a1);
+  slab_allocator_free(a2);
+  PASS();
+}
+
+typedef struct {
+  slab_allocator_t *alloc;
+  void **objs;  // THREAD_TEST_OBJECTS objects from slab_kmalloc
+} kmalloc_test_arg_t;
+
+static void *kmalloc_test_free(void *arg) {
+  kmalloc_test_arg_t *a = arg;
+  for (int i = 0; i < THREAD_TEST_OBJECTS; i++) {
+    slab_kfree(a->alloc, a->objs[i]);
+  }
+  return NULL;
+}
+
+TEST test_kfree_elsewhere() {
+  // Objects of every class allocated here and freed by another thread
+  slab_allocator_t *alloc = slab_allocator_create();
+  void **objs = malloc(sizeof(void *) * THREAD_TEST_OBJECTS);
+  for (int i = 0; i < THREAD_TEST_OBJECTS; i++) {
+    size_t size = (size_t)1 << (i % 12);
+    objs[i] = slab_kmalloc(alloc, size);
+    ASSERT(objs[i] != NULL);
+    memset(objs[i], i, size);
+  }
+  kmalloc_test_arg_t arg = {alloc, objs};
+  pthread_t thread;
+  ASSERT_EQ(0, pthread_create(&thread, NULL, kmalloc_test_free, &arg));
+  pthread_join(thread, NULL);
+
+  free(objs);
+  slab_allocator_free(alloc);
+  PASS();
+}
+
+SUITE(slab_kmalloc_suite) {
+  RUN_TEST(test_kmalloc_size_classes);
+  RUN_TEST(test_kmalloc_bounds);
+  RUN_TEST(test_kfree_finds_class);
+  RUN_TEST(test_kfree_ignores_other_allocators);
+  RUN_TEST(test_kfree_elsewhere);
+}
+
+TEST test_huge_pages_many_regions() {
+  // More objects than one region holds, freed and allocated again
+  slab_allocator_t *alloc = slab_allocator_create_huge_pages();
+  slab_cache_t *cache = slab_cache_create(alloc, 64, 16);
+  const int count = 100000;
+  uint64_t **objs = malloc(sizeof(uint64_t *) * count);
+
+  for (int round = 0; round < 2; round++) {
+    for (int i = 0; i < count; i++) {
+      objs[i] = slab_alloc(cache);
+      ASSERT(objs[i] != NULL);
+      ASSERT_EQ(0, (uintptr_t)objs[i] % 16);
+      objs[i][0] = (uint64_t)i;
+      objs[i][7] = (uint64_t)i;
+    }
+    for (int i = 0; i < count; i++) {
+      ASSERT_EQ((uint64_t)i, objs[i][0]);
+      ASSERT_EQ((uint64_t)i, objs[i][7]);
+    }
+    for (int i = 0; i < count; i++) {
+      slab_free(cache, objs[i]);
+    }
+  }
+
+  free(objs);
+  slab_allocator_free(alloc);
+  PASS();
+}
+
+TEST test_huge_pages_mixed_slab_sizes() {
+  // Caches with different slab sizes share the regions without overlap,
+  // and a freed cache's slabs go to the next one
+  slab_allocator_t *alloc = slab_allocator_create_huge_pages();
+  size_t sizes[3] = {40, 1024, PAGE_SIZE};
+  slab_cache_t *caches[3];
+  uint8_t *objs[3][200];
+  for (int c = 0; c < 3; c++) {
+    size_t align = sizes[c] == 40 ? 8 : sizes[c];
+    caches[c] = slab_cache_create(alloc, sizes[c], align);
+  }
+
+  for (int i = 0; i < 200; i++) {
+    for (int c = 0; c < 3; c++) {
+      objs[c][i] = slab_alloc(caches[c]);
+      ASSERT(objs[c][i] != NULL);
+      memset(objs[c][i], c * 200 + i, sizes[c]);
+    }
+  }
+  for (int i = 0; i < 200; i++) {
+    for (int c = 0; c < 3; c++) {
+      ASSERT_EQ((uint8_t)(c * 200 + i), objs[c][i][0]);
+      ASSERT_EQ((uint8_t)(c * 200 + i), objs[c][i][sizes[c] - 1]);
+    }
+  }
+
+  // Slabs of the same size are laid out alike, so reused ones hand out the
+  // same addresses
+  slab_cache_free(caches[2]);
+  slab_cache_t *again = slab_cache_create(alloc, PAGE_SIZE, PAGE_SIZE);
+  for (int i = 0; i < 200; i++) {
+    uint8_t *p = slab_alloc(again);
+    ASSERT(p != NULL);
+    ASSERT_EQ(0, (uintptr_t)p % PAGE_SIZE);
+    bool reused = false;
+    for (int j = 0; j < 200 && !reused; j++) reused = p == objs[2][j];
+    ASSERT(reused);
+    memset(p, 0xEE, PAGE_SIZE);
+  }
+  for (int i = 0; i < 200; i++) {
+    ASSERT_EQ((uint8_t)i, objs[0][i][39]);
+    ASSERT_EQ((uint8_t)(200 + i), objs[1][i][1023]);
+  }
+
+  slab_allocator_free(alloc);
+  PASS();
+}
+
+TEST test_huge_pages_split_chunks() {
+  // Released large slabs are split for small ones instead of cutting new
+  // memory out of the region
+  slab_allocator_t *alloc = slab_allocator_create_huge_pages();
+  slab_cache_t *large = slab_cache_create(alloc, PAGE_SIZE, PAGE_SIZE);
+  uint8_t *objs[200];
+  for (int i = 0; i < 200; i++) {
+    objs[i] = slab_alloc(large);
+    ASSERT(objs[i] != NULL);
+  }
+  slab_cache_free(large);
+
+  // PAGE_SIZE objects get slabs of 8 pages, aligned to their size
+  const uintptr_t block = 8 * PAGE_SIZE;
+  slab_cache_t *small = slab_cache_create(alloc, 40, 8);
+  for (int i = 0; i < 500; i++) {
+    uint8_t *p = slab_alloc(small);
+    ASSERT(p != NULL);
+    memset(p, 0xAB, 40);
+    bool reused = false;
+    for (int j = 0; j < 200 && !reused; j++)
+      reused = (uintptr_t)p / block == (uintptr_t)objs[j] / block;
+    ASSERT(reused);
+  }
+
+  slab_allocator_free(alloc);
+  PASS();
+}
+
+TEST test_huge_pages_kmalloc() {
+  slab_allocator_t *alloc = slab_allocator_create_huge_pages();
+  void *objs[KMALLOC_MAX_SIZE / 8];
+  for (size_t i = 0; i < KMALLOC_MAX_SIZE / 8; i++) {
+    objs[i] = slab_kmalloc(alloc, (i + 1) * 8);
+    ASSERT(objs[i] != NULL);
+    memset(objs[i], 0x5A, (i + 1) * 8);
+  }
+  for (size_t i = 0; i < KMALLOC_MAX_SIZE / 8; i++) {
+    slab_kfree(alloc, objs[i]);
+  }
+  ASSERT_EQ(objs[KMALLOC_MAX_SIZE / 8 - 1], slab_kmalloc(alloc, 2048));
+  slab_allocator_free(alloc);
+  PASS();
+}
+
+SUITE(slab_huge_pages_suite) {
+  RUN_TEST(test_huge_pages_many_regions);
+  RUN_TEST(test_huge_pages_mixed_slab_sizes);
+  RUN_TEST(test_huge_pages_split_chunks);
+  RUN_TEST(test_huge_pages_kmalloc);
+}
+
 GREATEST_MAIN_DEFS();
 
 int main(int argc, char **argv) {
   GREATEST_MAIN_BEGIN();
   RUN_SUITE(slab_suite);
+  RUN_SUITE(slab_thread_suite);
+  RUN_SUITE(slab_kmalloc_suite);
+  RUN_SUITE(slab_huge_pages_suite);
   GREATEST_PRINT_REPORT();
   custom_tests();
   return greatest_all_passed() ? EXIT_SUCCESS : EXIT_FAILURE;